@@ -46,9 +46,19 @@ HEADERS += \
     src/ApplicationModel.h \
     src/Backup.h \
     src/BackupApp.h \
+    src/BackupArchive.h \
+    src/BackupChunkStore.h \
+    src/BackupCopyEngine.h \
     src/BackupDefs.h \
+    src/BackupDelta.h \
+    src/BackupExcludes.h \
+    src/BackupFileCopier.h \
+    src/BackupJson.h \
     src/BackupList.h \
     src/BackupListModel.h \
+    src/BackupManifest.h \
+    src/BackupProgress.h \
+    src/BackupUring.h \
     src/BackupUtil.h \
     src/ConfigClient.h \
     src/ConfigGroupModel.h \
@@ -60,9 +70,19 @@ SOURCES += \
     src/ApplicationModel.cpp \
     src/Backup.cpp \
     src/BackupApp.cpp \
+    src/BackupArchive.cpp \
+    src/BackupChunkStore.cpp \
+    src/BackupCopyEngine.cpp \
+    src/BackupDelta.cpp \
+    src/BackupExcludes.cpp \
+    src/BackupFileCopier.cpp \
+    src/BackupJson.cpp \
     src/BackupList.cpp \
     src/BackupListItem.cpp \
     src/BackupListModel.cpp \
+    src/BackupManifest.cpp \
+    src/BackupProgress.cpp \
+    src/BackupUring.cpp \
     src/BackupUtil.cpp \
     src/ConfigClient.cpp \
     src/ConfigGroupModel.cpp \
@@ -37,16 +37,35 @@
 
 #include "ApplicationModel.h"
 
+#include "BackupList.h"
 #include "BackupUtil.h"
 
 #include "HarbourTask.h"
 #include "HarbourDebug.h"
 
+#include <QAtomicInt>
 #include <QThreadPool>
-#include <QImage>
 #include <QDir>
+#include <QDataStream>
+#include <QDateTime>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QSet>
+#include <QSharedPointer>
+#include <QSocketNotifier>
+#include <QTimer>
+#include <QVector>
+#include <QWaitCondition>
+#include <QtEndian>
 
 #include <glib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
 
 #define MODEL_ROLES_(first,role,last) \
     first(Name,name) \
@@ -63,7 +82,9 @@
 
 class ApplicationModel::ModelData {
 public:
+    class IconCache;
     class RefreshTask;
+    class UpdateTask;
 
     enum Role {
 #define FIRST(X,x) FirstRole = Qt::UserRole, X##Role = FirstRole,
@@ -77,10 +98,14 @@ public:
 
     typedef QList<ModelData*> List;
 
-    ModelData(QString aDesktopFile, const AppInfo* aAppInfo);
+    ModelData(QString aDesktopFile, QString aAppName, QString aAppIcon);
 
     QVariant get(Role aRole) const;
 
+    static QString iconUrl(QString aIconName);
+    static void forgetIconUrl(QString aIconName);
+    static int pngWidth(QString aPath);
+
 public:
     const QString iDesktopFile;
     const QString iAppName;
@@ -88,9 +113,10 @@ public:
     bool iKnownApp;
 };
 
-ApplicationModel::ModelData::ModelData(QString aDesktopFile, const AppInfo* aAppInfo) :
-    iDesktopFile(aDesktopFile), iAppName(aAppInfo->iAppName),
-    iAppIcon(aAppInfo->iconUrl()),
+ApplicationModel::ModelData::ModelData(QString aDesktopFile, QString aAppName,
+    QString aAppIcon) :
+    iDesktopFile(aDesktopFile), iAppName(aAppName),
+    iAppIcon(aAppIcon),
     iKnownApp(false)
 {
 }
@@ -110,10 +136,127 @@ QVariant ApplicationModel::ModelData::get(Role aRole) const
     return QVariant();
 }
 
+int ApplicationModel::ModelData::pngWidth(QString aPath)
+{
+    // Only the signature and the IHDR chunk are read
+    static const uchar signature[] = { 0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a };
+    uchar header[24];
+    QFile file(aPath);
+    if (file.open(QIODevice::ReadOnly) &&
+        file.read((char*)header, sizeof(header)) == sizeof(header) &&
+        !memcmp(header, signature, sizeof(signature)) &&
+        !memcmp(header + 12, "IHDR", 4)) {
+        return (int)qFromBigEndian<quint32>(header + 16);
+    }
+    return 0;
+}
+
+// ==========================================================================
+// ApplicationModel::ModelData::IconCache
+// ==========================================================================
+
+// Icon paths by icon name, shared by all models. The hicolor directories
+// are listed once, their names (NxN) tell the size of the icons. Only the
+// icons that have been found are cached, and only while they exist.
+class ApplicationModel::ModelData::IconCache {
+public:
+    struct Dir {
+        QString iPath;
+        int iSize; // Zero if the name doesn't tell
+    };
+
+    static IconCache* instance();
+
+private:
+    IconCache();
+
+public:
+    QMutex iMutex;
+    QList<Dir> iDirs;
+    QHash<QString,QString> iPaths;
+};
+
+ApplicationModel::ModelData::IconCache::IconCache()
+{
+    QDir hicolor("/usr/share/icons/hicolor");
+    QFileInfoList subdirs(hicolor.entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot));
+    const int n = subdirs.count();
+    for (int i = 0; i < n; i++) {
+        const QFileInfo& info = subdirs.at(i);
+        const QString name(info.fileName());
+        // 86x86 or 86x86@2
+        const int x = name.indexOf('x');
+        const int at = name.indexOf('@');
+        bool ok = false, okScale = true;
+        int size = (x > 0) ? name.left(x).toInt(&ok) : 0;
+        const int scale = (at > x) ? name.mid(at + 1).toInt(&okScale) : 1;
+        Dir dir;
+        dir.iPath = info.absoluteFilePath() + "/apps/";
+        dir.iSize = (ok && okScale && size > 0 && scale > 0) ? (size * scale) : 0;
+        iDirs.append(dir);
+    }
+}
+
+ApplicationModel::ModelData::IconCache* ApplicationModel::ModelData::IconCache::instance()
+{
+    static IconCache cache;
+    return &cache;
+}
+
+QString ApplicationModel::ModelData::iconUrl(QString aIconName)
+{
+    IconCache* cache = IconCache::instance();
+    QMutexLocker lock(&cache->iMutex);
+    const QString cached(cache->iPaths.value(aIconName));
+    if (!cached.isEmpty()) {
+        if (QFile::exists(cached)) {
+            return QString::fromLatin1("file://") + cached;
+        }
+        // The package has been removed or updated
+        cache->iPaths.remove(aIconName);
+    }
+
+    // Pick the largest icon without decoding any of them
+    const QList<IconCache::Dir>& dirs = cache->iDirs;
+    const int n = dirs.count();
+    QString bestPath;
+    int bestWidth = 0;
+    for (int i = 0; i < n; i++) {
+        const IconCache::Dir& dir = dirs.at(i);
+        const QString path(dir.iPath + aIconName + ".png");
+        if (QFile::exists(path)) {
+            const int width = dir.iSize ? dir.iSize : pngWidth(path);
+            if (width > bestWidth) {
+                HDEBUG(qPrintable(path) << width);
+                bestWidth = width;
+                bestPath = path;
+            }
+        }
+    }
+    if (bestPath.isEmpty()) {
+        // Assume a system-provided icon. Not cached, the app may
+        // install its own later.
+        const QString url(QString::fromLatin1("image://theme/") + aIconName);
+        HDEBUG("Assuming" << qPrintable(url));
+        return url;
+    }
+    cache->iPaths.insert(aIconName, bestPath);
+    return QString::fromLatin1("file://") + bestPath;
+}
+
+void ApplicationModel::ModelData::forgetIconUrl(QString aIconName)
+{
+    // Icons of a reinstalled app may have moved to a better place
+    IconCache* cache = IconCache::instance();
+    QMutexLocker lock(&cache->iMutex);
+    cache->iPaths.remove(aIconName);
+}
+
 // ==========================================================================
 // ApplicationModel::ModelData::RefreshTask
 // ==========================================================================
 
+static const char APPS_DIR[] = "/usr/share/applications";
 static const char DESKTOP_GROUP[] = G_KEY_FILE_DESKTOP_GROUP;
 static const char BACKUP_GROUP[] = "X-HarbourBackup";
 static const char BACKUP_KEY_PATH_LIST[] = "BackupPathList";
@@ -127,12 +270,125 @@ public:
     ~RefreshTask();
 
     void performTask() Q_DECL_OVERRIDE;
+
+    static List update(const QStringList aDesktopFiles);
+
+private:
+    // Parsed desktop files, including the ones that have nothing
+    // to back up. Those are the majority. Icons are stored by name,
+    // they get resolved when the model is filled.
+    struct CacheEntry {
+        qint64 iModified; // msec since epoch
+        qint64 iSize;
+        bool iBackup; // Has the backup group
+        QString iAppName;
+        QString iAppIcon;
+        QStringList iBackupPathList;
+        QStringList iBackupConfigList;
+    };
+
+    typedef QHash<QString,CacheEntry> Cache;
+
+    class Batch;
+    class ParseJob;
+
+    enum {
+        CHUNK_SIZE = 16 // Desktop files parsed in one go
+    };
+
+    static const quint32 CACHE_MAGIC = 0x4d424143; // MBAC
+    static const quint32 CACHE_VERSION = 2;
+
+    static QString cacheFile();
+    static QString cacheLocale();
+    static bool loadCache(Cache* aCache);
+    static void saveCache(const Cache& aCache);
+    static bool hasBackupGroup(const QString aDesktopFile);
+    static void parse(const QString aDesktopFile, CacheEntry* aEntry);
+    QVector<CacheEntry> parseAll(const QStringList aFiles,
+        const QVector<CacheEntry> aEntries);
+
+private:
+    QThreadPool* iPool;
+
 public:
     List iData;
 };
 
+// Desktop files to parse, split into chunks. Chunks are picked up by the
+// pool threads and by the refresh task itself, so it never has to wait
+// for a chunk that nobody is working on.
+class ApplicationModel::ModelData::RefreshTask::Batch {
+public:
+    Batch(const QStringList aFiles, const QVector<CacheEntry> aEntries);
+
+    bool parseNextChunk();
+    void waitForDone();
+
+public:
+    const QStringList iFiles;
+    QVector<CacheEntry> iEntries;
+    const int iChunkCount;
+
+private:
+    CacheEntry* iResults;
+    QAtomicInt iNextChunk;
+    QMutex iMutex;
+    QWaitCondition iDoneCondition;
+    int iChunksDone;
+};
+
+ApplicationModel::ModelData::RefreshTask::Batch::Batch(const QStringList aFiles,
+    const QVector<CacheEntry> aEntries) :
+    iFiles(aFiles),
+    iEntries(aEntries),
+    iChunkCount((aFiles.count() + CHUNK_SIZE - 1) / CHUNK_SIZE),
+    iResults(iEntries.data()), // Detaches the vector
+    iNextChunk(0),
+    iChunksDone(0)
+{
+}
+
+bool ApplicationModel::ModelData::RefreshTask::Batch::parseNextChunk()
+{
+    const int chunk = iNextChunk.fetchAndAddOrdered(1);
+    if (chunk >= iChunkCount) {
+        return false;
+    }
+    // Each entry is written by one thread only
+    const int end = qMin((chunk + 1) * (int)CHUNK_SIZE, iFiles.count());
+    for (int i = chunk * CHUNK_SIZE; i < end; i++) {
+        parse(iFiles.at(i), iResults + i);
+    }
+    QMutexLocker lock(&iMutex);
+    if (++iChunksDone == iChunkCount) {
+        iDoneCondition.wakeAll();
+    }
+    return true;
+}
+
+void ApplicationModel::ModelData::RefreshTask::Batch::waitForDone()
+{
+    QMutexLocker lock(&iMutex);
+    while (iChunksDone < iChunkCount) {
+        iDoneCondition.wait(&iMutex);
+    }
+}
+
+// Runs on the model's thread pool. May start after the batch is done,
+// hence the shared pointer.
+class ApplicationModel::ModelData::RefreshTask::ParseJob : public QRunnable {
+public:
+    ParseJob(QSharedPointer<Batch> aBatch) : iBatch(aBatch) {}
+    void run() Q_DECL_OVERRIDE { while (iBatch->parseNextChunk()); }
+
+private:
+    QSharedPointer<Batch> iBatch;
+};
+
 ApplicationModel::ModelData::RefreshTask::RefreshTask(QThreadPool* aPool) :
-    HarbourTask(aPool)
+    HarbourTask(aPool),
+    iPool(aPool)
 {
 }
 
@@ -141,22 +397,255 @@ ApplicationModel::ModelData::RefreshTask::~RefreshTask()
     qDeleteAll(iData);
 }
 
+QString ApplicationModel::ModelData::RefreshTask::cacheFile()
+{
+    return BackupList::configDir() + QStringLiteral("/apps.cache");
+}
+
+QString ApplicationModel::ModelData::RefreshTask::cacheLocale()
+{
+    // App names are localized
+    return QString::fromUtf8(g_get_language_names()[0]);
+}
+
+bool ApplicationModel::ModelData::RefreshTask::loadCache(Cache* aCache)
+{
+    const QString path(cacheFile());
+    QFile file(path);
+    if (file.open(QIODevice::ReadOnly)) {
+        QDataStream in(&file);
+        quint32 magic = 0, version = 0;
+        QString locale;
+        qint32 n = 0;
+        in >> magic >> version >> locale >> n;
+        if (magic == CACHE_MAGIC && version == CACHE_VERSION &&
+            locale == cacheLocale() && n >= 0) {
+            for (int i = 0; i < n && in.status() == QDataStream::Ok; i++) {
+                QString desktopFile;
+                CacheEntry entry;
+                in >> desktopFile >> entry.iModified >> entry.iSize >>
+                    entry.iBackup;
+                if (entry.iBackup) {
+                    in >> entry.iAppName >> entry.iAppIcon >>
+                        entry.iBackupPathList >> entry.iBackupConfigList;
+                }
+                aCache->insert(desktopFile, entry);
+            }
+            if (in.status() == QDataStream::Ok) {
+                HDEBUG(n << "entries in" << qPrintable(path));
+                return true;
+            }
+        }
+        HWARN("Ignoring" << qPrintable(path));
+        aCache->clear();
+    }
+    return false;
+}
+
+void ApplicationModel::ModelData::RefreshTask::saveCache(const Cache& aCache)
+{
+    const QString path(cacheFile());
+    QSaveFile file(path);
+    QFileInfo(path).dir().mkpath(QStringLiteral("."));
+    if (file.open(QIODevice::WriteOnly)) {
+        QDataStream out(&file);
+        out << CACHE_MAGIC << CACHE_VERSION << cacheLocale() <<
+            (qint32)aCache.count();
+        Cache::const_iterator it = aCache.constBegin();
+        while (it != aCache.constEnd()) {
+            const CacheEntry& entry = it.value();
+            out << it.key() << entry.iModified << entry.iSize <<
+                entry.iBackup;
+            if (entry.iBackup) {
+                out << entry.iAppName << entry.iAppIcon <<
+                    entry.iBackupPathList << entry.iBackupConfigList;
+            }
+            ++it;
+        }
+        if (out.status() == QDataStream::Ok && file.commit()) {
+            HDEBUG("Wrote" << qPrintable(path));
+            return;
+        }
+    }
+    HWARN("Failed to write" << qPrintable(path));
+}
+
+bool ApplicationModel::ModelData::RefreshTask::hasBackupGroup(const QString aDesktopFile)
+{
+    // Most desktop files have nothing to back up, there's no need
+    // to fully parse those
+    static const char group[] = "[X-HarbourBackup]";
+    GMappedFile* map = g_mapped_file_new(qPrintable(aDesktopFile), FALSE, NULL);
+    if (map) {
+        const bool found = memmem(g_mapped_file_get_contents(map),
+            g_mapped_file_get_length(map), group, sizeof(group) - 1) != NULL;
+        g_mapped_file_unref(map);
+        return found;
+    }
+    // Let GKeyFile deal with it
+    return true;
+}
+
+void ApplicationModel::ModelData::RefreshTask::parse(const QString aDesktopFile,
+    CacheEntry* aEntry)
+{
+    AppInfo* appInfo = hasBackupGroup(aDesktopFile) ?
+        parseDesktopFile(QFileInfo(aDesktopFile)) : Q_NULLPTR;
+    aEntry->iBackup = (appInfo != Q_NULLPTR);
+    if (appInfo) {
+        aEntry->iAppName = appInfo->iAppName;
+        aEntry->iAppIcon = appInfo->iAppIcon;
+        aEntry->iBackupPathList = appInfo->iBackupPathList;
+        aEntry->iBackupConfigList = appInfo->iBackupConfigList;
+        delete appInfo;
+    }
+}
+
+ApplicationModel::ModelData::List ApplicationModel::ModelData::RefreshTask::update(const QStringList aDesktopFiles)
+{
+    // Changed files, outside of the refresh task. The results come in
+    // the same order, NULL if the file is gone or has nothing to back up.
+    // The cache is updated too, so that the next start doesn't have to
+    // parse them again.
+    Cache cache;
+    loadCache(&cache);
+
+    List data;
+    const int n = aDesktopFiles.count();
+    for (int i = 0; i < n; i++) {
+        const QString desktopFile(aDesktopFiles.at(i));
+        const QFileInfo info(desktopFile);
+        ModelData* app = Q_NULLPTR;
+        if (info.exists()) {
+            CacheEntry entry;
+            entry.iModified = info.lastModified().toMSecsSinceEpoch();
+            entry.iSize = info.size();
+            parse(desktopFile, &entry);
+            cache.insert(desktopFile, entry);
+            if (entry.iBackup) {
+                // The file has changed, so may have the icons
+                forgetIconUrl(entry.iAppIcon);
+                app = new ModelData(desktopFile, entry.iAppName,
+                    iconUrl(entry.iAppIcon));
+            }
+        } else {
+            cache.remove(desktopFile);
+        }
+        data.append(app);
+    }
+    saveCache(cache);
+    return data;
+}
+
+QVector<ApplicationModel::ModelData::RefreshTask::CacheEntry>
+ApplicationModel::ModelData::RefreshTask::parseAll(const QStringList aFiles,
+    const QVector<CacheEntry> aEntries)
+{
+    // Results come in the same order as the input
+    QSharedPointer<Batch> batch(new Batch(aFiles, aEntries));
+    const int helpers = qMin(batch->iChunkCount, iPool->maxThreadCount()) - 1;
+    for (int i = 0; i < helpers; i++) {
+        iPool->start(new ParseJob(batch));
+    }
+    while (batch->parseNextChunk());
+    batch->waitForDone();
+    HDEBUG("Parsed" << aFiles.count() << "file(s) in" << batch->iChunkCount <<
+        "chunk(s)");
+    return batch->iEntries;
+}
+
 void ApplicationModel::ModelData::RefreshTask::performTask()
 {
     const QStringList filter("*.desktop");
-    QDir appsDir("/usr/share/applications");
-    QFileInfoList desktopFiles(appsDir.entryInfoList(filter, QDir::Files));
+    QDir appsDir(APPS_DIR);
+    // Case sensitive, findRow() depends on that
+    QFileInfoList desktopFiles(appsDir.entryInfoList(filter, QDir::Files,
+        QDir::Name));
+
+    // Only new and modified desktop files get parsed
+    Cache cache;
+    bool changed = !loadCache(&cache);
+    Cache updated;
 
+    QStringList files;
+    QVector<CacheEntry> entries;
     const int n = desktopFiles.count();
     for (int i = 0; i < n; i++) {
         const QFileInfo& info = desktopFiles.at(i);
         const QString desktopFile(info.absoluteFilePath());
-        AppInfo* appInfo = parseDesktopFile(desktopFile);
-        if (appInfo) {
-            iData.append(new ModelData(desktopFile, appInfo));
-            delete appInfo;
+        const qint64 modified = info.lastModified().toMSecsSinceEpoch();
+        const qint64 size = info.size();
+        Cache::const_iterator it = cache.constFind(desktopFile);
+        if (it != cache.constEnd() && it.value().iModified == modified &&
+            it.value().iSize == size) {
+            updated.insert(desktopFile, it.value());
+        } else {
+            CacheEntry entry;
+            entry.iModified = modified;
+            entry.iSize = size;
+            entry.iBackup = false;
+            files.append(desktopFile);
+            entries.append(entry);
         }
     }
+
+    // The rest are parsed in parallel
+    if (!files.isEmpty()) {
+        entries = parseAll(files, entries);
+        const int count = files.count();
+        for (int i = 0; i < count; i++) {
+            updated.insert(files.at(i), entries.at(i));
+        }
+        changed = true;
+    }
+
+    // Keep the directory order
+    for (int i = 0; i < n; i++) {
+        const QString desktopFile(desktopFiles.at(i).absoluteFilePath());
+        const CacheEntry& entry = updated[desktopFile];
+        if (entry.iBackup) {
+            iData.append(new ModelData(desktopFile, entry.iAppName,
+                iconUrl(entry.iAppIcon)));
+        }
+    }
+
+    if (changed || updated.count() != cache.count()) {
+        saveCache(updated);
+    }
+}
+
+// ==========================================================================
+// ApplicationModel::ModelData::UpdateTask
+// ==========================================================================
+
+class ApplicationModel::ModelData::UpdateTask : public HarbourTask {
+    Q_OBJECT
+public:
+    UpdateTask(QThreadPool* aPool, const QStringList aDesktopFiles);
+    ~UpdateTask();
+
+    void performTask() Q_DECL_OVERRIDE;
+
+public:
+    const QStringList iDesktopFiles;
+    List iData; // NULL entries for the removed rows
+};
+
+ApplicationModel::ModelData::UpdateTask::UpdateTask(QThreadPool* aPool,
+    const QStringList aDesktopFiles) :
+    HarbourTask(aPool),
+    iDesktopFiles(aDesktopFiles)
+{
+}
+
+ApplicationModel::ModelData::UpdateTask::~UpdateTask()
+{
+    qDeleteAll(iData);
+}
+
+void ApplicationModel::ModelData::UpdateTask::performTask()
+{
+    iData = RefreshTask::update(iDesktopFiles);
 }
 
 // ==========================================================================
@@ -170,34 +659,71 @@ public:
     Private(ApplicationModel* aParent);
     ~Private();
 
-    static QString iconUrl(QString aIconName);
+    enum {
+        UPDATE_DELAY_MS = 250
+    };
+
     ModelData* dataAt(int aIndex) const;
     ApplicationModel* parentModel() const;
     int rowCount() const;
+    int findRow(const QString aDesktopFile, bool* aFound) const;
+    void updateRow(const QString aDesktopFile, ModelData* aData);
+    void addAllPending();
 
 public Q_SLOTS:
     void onRefreshTaskDone();
+    void onUpdateTaskDone();
+    void onInotify();
+    void onUpdateTimer();
 
 public:
     QThreadPool* iThreadPool;
     ModelData::RefreshTask* iRefreshTask;
+    ModelData::UpdateTask* iUpdateTask;
     ModelData::List iData;
     QStringList iKnownApps;
+    int iInotifyFd;
+    QSocketNotifier* iNotifier;
+    QTimer* iUpdateTimer;
+    QSet<QString> iPending; // Changed desktop files
 };
 
 ApplicationModel::Private::Private(ApplicationModel* aParent) :
     QObject(aParent),
     iThreadPool(new QThreadPool(this)),
-    iRefreshTask(new ModelData::RefreshTask(iThreadPool))
+    iRefreshTask(new ModelData::RefreshTask(iThreadPool)),
+    iUpdateTask(Q_NULLPTR),
+    iInotifyFd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+    iNotifier(Q_NULLPTR),
+    iUpdateTimer(new QTimer(this))
 {
+    // Changes are collected for a while, packages tend to touch several
+    // files at once and a file may be written in more than one step
+    iUpdateTimer->setSingleShot(true);
+    iUpdateTimer->setInterval(UPDATE_DELAY_MS);
+    connect(iUpdateTimer, SIGNAL(timeout()), SLOT(onUpdateTimer()));
+
+    // Start watching before the scan, so that nothing is missed
+    if (iInotifyFd >= 0 && inotify_add_watch(iInotifyFd, APPS_DIR,
+        IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE |
+        IN_ATTRIB) >= 0) {
+        iNotifier = new QSocketNotifier(iInotifyFd, QSocketNotifier::Read,
+            this);
+        connect(iNotifier, SIGNAL(activated(int)), SLOT(onInotify()));
+    } else {
+        HWARN("Not watching" << APPS_DIR << ":" << strerror(errno));
+    }
     iRefreshTask->submit(this, SLOT(onRefreshTaskDone()));
 }
 
 ApplicationModel::Private::~Private()
 {
     if (iRefreshTask) iRefreshTask->release();
+    if (iUpdateTask) iUpdateTask->release();
     iThreadPool->waitForDone();
     delete iThreadPool;
+    delete iNotifier;
+    if (iInotifyFd >= 0) close(iInotifyFd);
     qDeleteAll(iData);
 }
 
@@ -229,49 +755,150 @@ void ApplicationModel::Private::onRefreshTaskDone()
         iRefreshTask->release();
         iRefreshTask = NULL;
 
-        // Update the model
+        // The model is empty until the initial scan is done, after
+        // that it's only updated incrementally
         ApplicationModel* model = parentModel();
         if (!data.isEmpty()) {
-            model->beginResetModel();
+            model->beginInsertRows(QModelIndex(), 0, data.count() - 1);
             iData = data;
             const int n = data.count();
             for (int i = 0; i < n; i++) {
                 ModelData* app = iData.at(i);
                 app->iKnownApp = iKnownApps.contains(app->iDesktopFile);
             }
-            model->endResetModel();
+            model->endInsertRows();
         }
         Q_EMIT model->readyChanged();
+
+        // Apply the changes made during the scan
+        if (!iPending.isEmpty()) {
+            iUpdateTimer->start();
+        }
     }
 }
 
-QString ApplicationModel::Private::iconUrl(QString aIconName)
+int ApplicationModel::Private::findRow(const QString aDesktopFile,
+    bool* aFound) const
 {
-    QDir hicolor("/usr/share/icons/hicolor");
-    QFileInfoList subdirs(hicolor.entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot));
-    const int n = subdirs.count();
-    QImage bestImage;
-    QString bestPath;
+    // The rows are sorted by file name (case sensitive QDir::Name)
+    int low = 0, high = iData.count() - 1;
+    while (low <= high) {
+        const int mid = (low + high) / 2;
+        const int cmp = iData.at(mid)->iDesktopFile.compare(aDesktopFile);
+        if (cmp < 0) {
+            low = mid + 1;
+        } else if (cmp > 0) {
+            high = mid - 1;
+        } else {
+            *aFound = true;
+            return mid;
+        }
+    }
+    *aFound = false;
+    return low; // Insertion point
+}
+
+void ApplicationModel::Private::updateRow(const QString aDesktopFile,
+    ModelData* aData)
+{
+    // Takes ownership of the data, NULL removes the row
+    ApplicationModel* model = parentModel();
+    bool found;
+    const int row = findRow(aDesktopFile, &found);
+    if (aData) {
+        aData->iKnownApp = iKnownApps.contains(aDesktopFile);
+    }
+    if (found) {
+        if (aData) {
+            HDEBUG("Updated" << qPrintable(aDesktopFile));
+            delete iData.at(row);
+            iData[row] = aData;
+            const QModelIndex index(model->index(row));
+            Q_EMIT model->dataChanged(index, index);
+        } else {
+            HDEBUG("Removed" << qPrintable(aDesktopFile));
+            model->beginRemoveRows(QModelIndex(), row, row);
+            delete iData.takeAt(row);
+            model->endRemoveRows();
+        }
+    } else if (aData) {
+        HDEBUG("Added" << qPrintable(aDesktopFile));
+        model->beginInsertRows(QModelIndex(), row, row);
+        iData.insert(row, aData);
+        model->endInsertRows();
+    }
+}
+
+void ApplicationModel::Private::addAllPending()
+{
+    // Events were lost, check every file we know about. That's still
+    // better than resetting the model.
+    const QStringList filter("*.desktop");
+    const QFileInfoList files(QDir(APPS_DIR).entryInfoList(filter, QDir::Files));
+    const int n = files.count();
     for (int i = 0; i < n; i++) {
-        QImage image;
-        const QFileInfo& dir = subdirs.at(i);
-        const QString path(dir.absoluteFilePath() + "/apps/" + aIconName + ".png");
-        if (image.load(path) && !image.isNull()) {
-            if (bestImage.isNull() || image.width() > bestImage.width()) {
-                HDEBUG(image);
-                bestImage = image;
-                bestPath = path;
+        iPending.insert(files.at(i).absoluteFilePath());
+    }
+    const int m = iData.count();
+    for (int i = 0; i < m; i++) {
+        iPending.insert(iData.at(i)->iDesktopFile);
+    }
+}
+
+void ApplicationModel::Private::onInotify()
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(iInotifyFd, buf, sizeof(buf))) > 0) {
+        const char* ptr = buf;
+        while (ptr < buf + len) {
+            const struct inotify_event* event = (struct inotify_event*)ptr;
+            if (event->mask & IN_Q_OVERFLOW) {
+                HWARN("inotify queue overflow");
+                addAllPending();
+            } else if (event->len && g_str_has_suffix(event->name, ".desktop")) {
+                HDEBUG(event->name << event->mask);
+                iPending.insert(QString::fromLatin1(APPS_DIR) + '/' +
+                    QString::fromLocal8Bit(event->name));
             }
+            ptr += sizeof(struct inotify_event) + event->len;
         }
     }
-    if (bestImage.isNull()) {
-        // Assume a system-provided icon
-        bestPath = QString::fromLatin1("image://theme/") + aIconName;
-        HDEBUG("Assuming" << qPrintable(bestPath));
-    } else {
-        bestPath = QString::fromLatin1("file://") + bestPath;
+    if (!iPending.isEmpty() && !iRefreshTask) {
+        iUpdateTimer->start();
+    }
+}
+
+void ApplicationModel::Private::onUpdateTimer()
+{
+    // One update at a time, the next one starts when it's done
+    if (!iUpdateTask && !iPending.isEmpty()) {
+        QStringList files(iPending.toList());
+        iPending.clear();
+        files.sort();
+        iUpdateTask = new ModelData::UpdateTask(iThreadPool, files);
+        iUpdateTask->submit(this, SLOT(onUpdateTaskDone()));
+    }
+}
+
+void ApplicationModel::Private::onUpdateTaskDone()
+{
+    if (sender() == iUpdateTask) {
+        const QStringList files(iUpdateTask->iDesktopFiles);
+        const ModelData::List data(iUpdateTask->iData);
+        iUpdateTask->iData.clear();
+        iUpdateTask->release();
+        iUpdateTask = Q_NULLPTR;
+
+        // Only the row changes happen on the main thread
+        const int n = files.count();
+        for (int i = 0; i < n; i++) {
+            updateRow(files.at(i), data.at(i));
+        }
+        if (!iPending.isEmpty()) {
+            iUpdateTimer->start();
+        }
     }
-    return bestPath;
 }
 
 // ==========================================================================
@@ -280,7 +907,7 @@ QString ApplicationModel::Private::iconUrl(QString aIconName)
 
 QString ApplicationModel::AppInfo::iconUrl() const
 {
-    return Private::iconUrl(iAppIcon);
+    return ModelData::iconUrl(iAppIcon);
 }
 
 // ==========================================================================
@@ -40,27 +40,45 @@
 #include <gio/gio.h>
 
 #include "Backup.h"
+#include "BackupArchive.h"
+#include "BackupChunkStore.h"
+#include "BackupCopyEngine.h"
+#include "BackupDelta.h"
+#include "BackupExcludes.h"
+#include "BackupFileCopier.h"
+#include "BackupJson.h"
 #include "BackupList.h"
+#include "BackupManifest.h"
+#include "BackupProgress.h"
+#include "BackupUring.h"
 #include "BackupUtil.h"
 #include "ConfigClient.h"
 
-#include "HarbourJson.h"
 #include "HarbourDebug.h"
 
-#include <MGConfItem>
-
+#include <QDateTime>
 #include <QDir>
+#include <QHash>
+#include <QMutex>
+#include <QSaveFile>
+#include <QTemporaryFile>
+#include <QWaitCondition>
 #include <QVariantMap>
 #include <QVariantList>
 
+#include <fcntl.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 
 const char Backup::ACTION_IMPORT[] = "import";
 const char Backup::ACTION_RESTORE[] = "restore";
 const char Backup::ACTION_EXPORT[] = "export";
+const char Backup::ACTION_ESTIMATE[] = "estimate";
 
 namespace {
     const QString DOT(".");
@@ -69,6 +87,32 @@ namespace {
     const QString USERS_DIR("users");
     const QString FILES_DIR("files");
 
+    // Optional content-addressed storage, see BackupChunkStore
+    const QString RECIPES_DIR("recipes");
+    const QString CHUNKS_DIR("chunks");
+
+    // Metadata of the backed up files, see BackupManifest. Each storage
+    // mode has its own, the snapshots carry theirs inside.
+    const QString MANIFEST_STORE("manifest");
+    const QString CHUNKS_MANIFEST_STORE("recipes.manifest");
+    const QString SNAPSHOT_MANIFEST(".mybackup-manifest");
+
+    // Storage mode used by the last export, see Private::storageMode()
+    const QString MODE_STORE("mode");
+
+    // Optional compressed archive, see BackupArchive. Files are stored
+    // under FILES_DIR and the configuration is CONFIG_STORE.
+    const QString ARCHIVE_STORE("files.tar.gz");
+
+    // Optional versioned snapshots, each one is a timestamped directory
+    // with the same layout as FILES_DIR. Unchanged files are hard links
+    // to the same files in the previous snapshot.
+    const QString SNAPSHOTS_DIR("snapshots");
+    const QString SNAPSHOT_NAME_FORMAT("yyyyMMdd-HHmmss");
+
+    // Block signatures of the large files, see BackupDelta
+    const QString SIGNATURES_DIR("signatures");
+
     //
     // config.json contains two lists:
     //
@@ -90,6 +134,16 @@ namespace {
     const QString CONFIG_KEYS("keys");
     const QString CONFIG_NAME("name");
     const QString CONFIG_VALUE("value");
+
+    //
+    // config.gvariant is the same configuration as a serialized a{sv}
+    // dictionary (little-endian) keyed by the full dconf path. Values
+    // are exactly as they were in dconf. Keys ending with slash mark
+    // the groups to be reset before restoring their contents, their
+    // values are empty tuples. If present, it's preferred to config.json
+    // at restore time.
+    //
+    const QString CONFIG_VALUES_STORE("config.gvariant");
 }
 
 // ==========================================================================
@@ -98,484 +152,2557 @@ namespace {
 
 class Backup::Private {
 public:
+    class Dir;
+    class CopyFileJob;
+    class CopyBatchJob;
+    class ScanJob;
+    class Totals;
+
+    enum StorageMode {
+        StoreFiles,
+        StoreChunks,
+        StoreArchive,
+        StoreSnapshots
+    };
+
+    Private(const Options& aOptions, const char* aDestExDir,
+        const char* aSrcExDir);
+
     static QDir backupFilesDir(const QString aBackupRoot);
+    static QDir backupRecipesDir(const QString aBackupRoot);
+    static QString backupChunksDir(const QString aBackupRoot);
+    static QString backupSnapshotsDir(const QString aBackupRoot);
+    static QString backupSignaturesDir(const QString aBackupRoot);
+    static QStringList backupSnapshots(const QString aBackupRoot);
+    static QDir backupDataDir(const QString aBackupRoot, StorageMode aMode,
+        const Options& aOptions);
     static QString backupUserRoot(const QString aBackupRoot);
     static QString backupConfigStore(const QString aBackupRoot);
-    static bool isExcluded(const char* aPath, const char* aExDir);
-    static void copyFile(const char* aDestFile, const char* aSrcFile);
-    static void copyDir(const char* aDestDir, const char* aSrcDir,
-        const char* aDestExDir, const char* aSrcExDir);
-    static void copyFiles(QDir aDestDir, QDir aSrcDir, const QString aEntry,
-        const char* aDestExDir, const char* aSrcExDir);
-    static void copyFiles(QDir aDestDir, QDir aSrcDir, const QStringList aList,
-        const char* aDestExDir, const char* aSrcExDir);
+    static QString backupConfigValues(const QString aBackupRoot);
+    static QString backupManifest(const QString aBackupRoot,
+        StorageMode aMode, const QString aSnapshot);
+    static QString backupArchive(const QString aBackupRoot);
+    static QString backupModeStore(const QString aBackupRoot);
+    static const char* storageModeName(StorageMode aMode);
+    static bool storageExists(const QString aBackupRoot, StorageMode aMode);
+    static StorageMode storageMode(const QString aBackupRoot,
+        const Options& aOptions);
+    static void saveStorageMode(const QString aBackupRoot,
+        StorageMode aMode);
+    static bool removeTree(int aDirFd, const char* aName);
+    static QStringList excludeList(const BackupList* aList,
+        const Options& aOptions);
+    static Dir* openDir(const QByteArray aPath);
+    static bool makeDestDir(const QByteArray aDestPath,
+        const QByteArray aSrcPath);
+    static Dir* openDestDir(const QByteArray aDestPath,
+        const QByteArray aSrcPath);
+    Dir* destDir(const QByteArray aDestPath, const QByteArray aSrcPath);
+    void clearDestDirs();
+    bool copyFile(Dir* aDestDir, Dir* aSrcDir, const char* aName,
+        struct stat* aCopied);
+    bool transferFile(Dir* aDestDir, Dir* aSrcDir, const char* aName,
+        const struct stat* aStat, struct stat* aCopied);
+    void setDestRoot(const char* aRoot);
+    QByteArray relativePath(const QByteArray aDestFile) const;
+    QByteArray archivePath(const QByteArray aDestFile) const;
+    void copyRegularFile(Dir* aDestDir, Dir* aSrcDir, const char* aName,
+        const struct stat* aStat, CopyBatchJob** aBatch);
+    void processFile(Dir* aDestDir, Dir* aSrcDir, const char* aName,
+        const struct stat* aStat);
+    void fileCopied(Dir* aDestDir, const char* aName,
+        const struct stat* aStat);
+    void fileProcessed(const struct stat* aStat);
+    void fileFailed(Dir* aSrcDir, const char* aName);
+    bool acceptFile(Dir* aDestDir, Dir* aSrcDir, const char* aName) const;
+    void copyDir(Dir* aDestParent, Dir* aSrcParent, const char* aName);
+    void copyDirContents(Dir* aDest, Dir* aSrc);
+    void copyFiles(QDir aDestDir, QDir aSrcDir, const QString aEntry);
+    void copyFiles(QDir aDestDir, QDir aSrcDir, const QStringList aList);
+    quint64 scanSize(int aDirFd, const char* aName,
+        const struct stat* aStat) const;
+    void scanDir(int aFd, const QByteArray aPath,
+        const BackupExcludes::State aExState, Totals* aTotals);
+    void scanEntry(QDir aSrcDir, const QString aEntry, Totals* aTotals);
+    void scanFiles(QDir aSrcDir, const QStringList aList);
+
+public:
+    BackupExcludes iDestExcludes;
+    BackupExcludes iSrcExcludes;
+    const BackupChunkStore* iChunkStore;
+    const BackupDelta* iDelta;
+    bool iRestoreChunks;
+    const BackupManifest* iManifest;
+    BackupArchive::Writer* iArchive;
+    BackupProgress* iProgress;
+    int iLinkDestFd;
+    bool iSnapshot; // Never share files with the live system
+    gint iFailures; // Updated atomically
+    QByteArray iDestRoot;
+    BackupManifest iNewManifest;
+    QHash<QByteArray,Dir*> iDestDirs; // Opened or created by this run
+    BackupFileCopier iCopier;
+    BackupUring iUring;
+    BackupCopyEngine iEngine;
 };
 
-QString Backup::Private::backupUserRoot(const QString aBackupRoot)
+// Reference counted directory descriptor. The path is only needed for
+// exclusion checks, manifest and logging, files are accessed relative
+// to the descriptor. Destination directories have no descriptor when
+// files are written to the archive.
+class Backup::Private::Dir {
+public:
+    Dir(int aFd, const QByteArray aPath);
+
+    Dir* ref();
+    void unref();
+    QByteArray filePath(const char* aName) const;
+
+private:
+    ~Dir();
+
+public:
+    const int iFd;
+    const QByteArray iPath;
+    BackupExcludes::State iExState; // Set before the Dir is shared
+    bool iFresh; // Created by this run and nothing's been put there yet
+
+private:
+    gint iRef;
+};
+
+Backup::Private::Dir::Dir(int aFd, const QByteArray aPath) :
+    iFd(aFd),
+    iPath(aPath),
+    iFresh(false),
+    iRef(1)
 {
-    return aBackupRoot + QDir::separator() +
-        USERS_DIR + QDir::separator() +
-        QString::number(geteuid()) + QDir::separator();
+}
 
+Backup::Private::Dir::~Dir()
+{
+    if (iFd >= 0) {
+        close(iFd);
+    }
 }
 
-QDir Backup::Private::backupFilesDir(const QString aBackupRoot)
+Backup::Private::Dir* Backup::Private::Dir::ref()
 {
-    return QDir(backupUserRoot(aBackupRoot) + FILES_DIR);
+    g_atomic_int_inc(&iRef);
+    return this;
 }
 
-QString Backup::Private::backupConfigStore(const QString aBackupRoot)
+void Backup::Private::Dir::unref()
 {
-    return backupUserRoot(aBackupRoot) + CONFIG_STORE;
+    if (g_atomic_int_dec_and_test(&iRef)) {
+        delete this;
+    }
 }
 
-void Backup::Private::copyFile(const char* aDestFile, const char* aSrcFile)
+QByteArray Backup::Private::Dir::filePath(const char* aName) const
 {
-    GError* error = NULL;
-    GFile* src = g_file_new_for_path(aSrcFile);
-    GFile* dest = g_file_new_for_path(aDestFile);
-    GFileCopyFlags flags = (GFileCopyFlags)(G_FILE_COPY_OVERWRITE |
-        G_FILE_COPY_ALL_METADATA);
-    char* srcPath = g_file_get_path(src);
-    char* destPath = g_file_get_path(dest);
-
-    // First try to create a hard link because it's so much faster
-    if (link(srcPath, destPath) == 0) {
-        HDEBUG(srcPath << "->" << destPath);
-    } else if (g_file_copy(src, dest, flags, NULL, NULL, NULL, &error)) {
-        HDEBUG(srcPath << "=>" << destPath);
-    } else {
-        if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
-            // Caller checks if the source exists but doesn't necessarily
-            // check if the destination directory exists. Try to create
-            // the destination directory and retry the attempt.
-            GFile* srcDir = g_file_get_parent(src);
-            char* srcDirPath = g_file_get_path(srcDir);
-            struct stat st;
-            if (!stat(srcDirPath, &st) && S_ISDIR(st.st_mode)) {
-                GFile* destDir = g_file_get_parent(dest);
-                char* destDirPath = g_file_get_path(destDir);
-                const mode_t mode = st.st_mode & ~S_IFMT;
-                if (!g_mkdir_with_parents(destDirPath, mode)) {
-                    // Try to copy ownership and mode
-                    if (chown(destDirPath, st.st_uid, st.st_gid)) {
-                        HWARN("Failed to chown" << destDirPath << ":" <<
-                            strerror(errno));
-                    }
-                    if (chmod(destDirPath, mode)) {
-                        HWARN("Failed to chmod" << destDirPath << ":" <<
-                            strerror(errno));
-                    }
-                    g_error_free(error);
-                    error = NULL;
-                    // And make another attempt to copy the file
-                    HDEBUG("Created" << destDirPath);
-                    if (g_file_copy(src, dest, flags, NULL, NULL, NULL, &error)) {
-                        HDEBUG(srcPath << "=>" << destPath);
-                    }
-                } else {
-                    HWARN("Failed to create directory" << destDirPath <<
-                        ":" << strerror(errno));
-                }
-                g_free(destDirPath);
-                g_object_unref(destDir);
-            }
-            g_free(srcDirPath);
-            g_object_unref(srcDir);
-        }
-        if (error) {
-            HWARN(error->message);
-            g_error_free(error);
-        }
+    QByteArray path(iPath);
+    path.append('/');
+    path.append(aName);
+    return path;
+}
+
+// Copies a single file on a BackupCopyEngine thread
+class Backup::Private::CopyFileJob : public BackupCopyEngine::Job {
+public:
+    CopyFileJob(Private* aOwner, Dir* aDestDir, Dir* aSrcDir,
+        const char* aName, const struct stat* aStat);
+    ~CopyFileJob();
+
+    void run() Q_DECL_OVERRIDE;
+
+private:
+    Private* iOwner;
+    Dir* iDestDir;
+    Dir* iSrcDir;
+    char* iName;
+    bool iHaveStat;
+    struct stat iStat;
+};
+
+Backup::Private::CopyFileJob::CopyFileJob(Private* aOwner, Dir* aDestDir,
+    Dir* aSrcDir, const char* aName, const struct stat* aStat) :
+    iOwner(aOwner),
+    iDestDir(aDestDir->ref()),
+    iSrcDir(aSrcDir->ref()),
+    iName(g_strdup(aName)),
+    iHaveStat(aStat != NULL)
+{
+    if (aStat) {
+        iStat = *aStat;
     }
+}
 
-    g_free(srcPath);
-    g_free(destPath);
-    g_object_unref(src);
-    g_object_unref(dest);
+Backup::Private::CopyFileJob::~CopyFileJob()
+{
+    iDestDir->unref();
+    iSrcDir->unref();
+    g_free(iName);
 }
 
-bool Backup::Private::isExcluded(const char* aPath, const char* aExDir)
+void Backup::Private::CopyFileJob::run()
 {
-    if (aExDir) {
-        const size_t xlen = strlen(aExDir);
-        if (!strncmp(aPath, aExDir, xlen)) {
-            if (!aPath[xlen]) {
-                HWARN(aPath << "is excluded, skipping");
-                return true;
-            } else if (aPath[xlen] == '/') {
-                HWARN(aPath << "is under" << aExDir << ", skipping");
-                return true;
-            }
-        }
+    iOwner->processFile(iDestDir, iSrcDir, iName, iHaveStat ? &iStat : NULL);
+}
+
+// Copies a batch of small files from one directory on a BackupCopyEngine
+// thread, see BackupUring. Whatever it fails to copy is copied one by one.
+class Backup::Private::CopyBatchJob : public BackupCopyEngine::Job {
+public:
+    CopyBatchJob(Private* aOwner, Dir* aDestDir, Dir* aSrcDir);
+    ~CopyBatchJob();
+
+    bool isFull() const;
+    void add(const char* aName, const struct stat* aStat);
+    void run() Q_DECL_OVERRIDE;
+
+private:
+    Private* iOwner;
+    Dir* iDestDir;
+    Dir* iSrcDir;
+    int iCount;
+    BackupUring::File iFiles[BackupUring::MAX_BATCH];
+};
+
+Backup::Private::CopyBatchJob::CopyBatchJob(Private* aOwner, Dir* aDestDir,
+    Dir* aSrcDir) :
+    iOwner(aOwner),
+    iDestDir(aDestDir->ref()),
+    iSrcDir(aSrcDir->ref()),
+    iCount(0)
+{
+}
+
+Backup::Private::CopyBatchJob::~CopyBatchJob()
+{
+    for (int i = 0; i < iCount; i++) {
+        g_free((char*)iFiles[i].iName);
     }
-    return false;
+    iDestDir->unref();
+    iSrcDir->unref();
 }
 
-void Backup::Private::copyDir(const char* aDestDir, const char* aSrcDir,
-    const char* aDestExDir, const char* aSrcExDir)
+bool Backup::Private::CopyBatchJob::isFull() const
 {
-    // Make sure that the source is a directory
-    struct stat st;
-    if (stat(aSrcDir, &st) && S_ISDIR(st.st_mode)) {
-        HWARN("Skipping" << aSrcDir);
-    } else if (!isExcluded(aSrcDir, aSrcExDir) &&
-               !isExcluded(aDestDir, aDestExDir)) {
-        // Create the destination directory if necessary
-        bool destDirExists = g_file_test(aDestDir, G_FILE_TEST_IS_DIR);
-        if (!destDirExists) {
-            const mode_t mode = st.st_mode & ~S_IFMT;
-            remove(aDestDir); // In case if there's file with the same name
-            if (g_mkdir_with_parents(aDestDir, mode) == 0) {
-                // Try to copy ownership and mode
-                if (chown(aDestDir, st.st_uid, st.st_gid)) {
-                    HWARN("Failed to chown" << aDestDir << ":" <<
-                        strerror(errno));
-                }
-                if (chmod(aDestDir, mode)) {
-                    HWARN("Failed to chmod" << aDestDir << ":" <<
-                        strerror(errno));
-                }
-                destDirExists = true;
-                HDEBUG("Created" << aDestDir);
-            } else {
-                HWARN("Failed to create directory" << aDestDir << ":" <<
-                    strerror(errno));
-            }
-        }
-        if (destDirExists) {
-            // Copy the contents
-            GDir* dir = g_dir_open(aSrcDir, 0, NULL);
-            if (dir) {
-                const char* name;
-                while ((name = g_dir_read_name(dir)) != NULL) {
-                    char* src = g_build_filename(aSrcDir, name, NULL);
-                    if (!stat(src, &st)) {
-                        char* dest = g_build_filename(aDestDir, name, NULL);
-                        // Be slightly paranoid :)
-                        if (strcmp(src, dest)) {
-                            if (S_ISREG(st.st_mode)) {
-                                copyFile(dest, src);
-                            } else {
-                                copyDir(dest, src, aDestExDir, aSrcExDir);
-                            }
-                        }
-                        g_free(dest);
-                    }
-                    g_free(src);
-                }
-                g_dir_close(dir);
-            }
-        }
+    return iCount >= BackupUring::MAX_BATCH;
+}
+
+void Backup::Private::CopyBatchJob::add(const char* aName,
+    const struct stat* aStat)
+{
+    BackupUring::File* file = iFiles + iCount++;
+    file->iName = g_strdup(aName);
+    file->iHaveStat = (aStat != NULL);
+    file->iCopied = false;
+    if (aStat) {
+        file->iStat = *aStat;
     }
 }
 
-void Backup::Private::copyFiles(QDir aDestDir, QDir aSrcDir,
-    const QString aEntry, const char* aDestExDir, const char* aSrcExDir)
+void Backup::Private::CopyBatchJob::run()
 {
-    // BackupList::backupFileList makes sure that paths are relative
-    // to the home directory. Caller makes sure that the destination
-    // directory exists.
-    bool copyTree = false;
-    QString entry(aEntry);
-    if (entry.endsWith(QDir::separator())) {
-        copyTree = true;
-        do { entry = entry.left(entry.length() - 1); }
-        while (entry.endsWith(QDir::separator()));
+    // Hard links are still cheaper, see copyFile()
+    struct stat destDir, srcDir;
+    if (iOwner->iSnapshot || fstat(iDestDir->iFd, &destDir) ||
+        fstat(iSrcDir->iFd, &srcDir) || destDir.st_dev != srcDir.st_dev) {
+        iOwner->iUring.copyFiles(iDestDir->iFd, iSrcDir->iFd, iFiles,
+            iCount);
     }
-    QFileInfo srcInfo(aSrcDir, entry);
-    const QByteArray srcPath(srcInfo.absoluteFilePath().toLocal8Bit());
-    if (srcInfo.exists()) {
-        QFileInfo destInfo(aDestDir, entry);
-        const QByteArray destPath(destInfo.absoluteFilePath().toLocal8Bit());
-        if (copyTree) {
-            if (srcInfo.isDir()) {
-                // Copy directory tree
-                copyDir(destPath.constData(), srcPath.constData(),
-                    aDestExDir, aSrcExDir);
-            } else {
-                HWARN(srcPath.constData() << "is not a directory");
+    for (int i = 0; i < iCount; i++) {
+        const BackupUring::File* file = iFiles + i;
+        const struct stat* st = file->iHaveStat ? &file->iStat : NULL;
+        if (file->iCopied) {
+            HDEBUG(iSrcDir->filePath(file->iName).constData() << "=>" <<
+                iDestDir->filePath(file->iName).constData());
+            if (st) {
+                iOwner->fileCopied(iDestDir, file->iName, st);
             }
+            iOwner->fileProcessed(st);
         } else {
-            if (srcInfo.isFile()) {
-                const char* dest = destPath.constData();
-                const char* src = srcPath.constData();
-                if (!isExcluded(src, aSrcExDir) &&
-                    !isExcluded(dest, aDestExDir)) {
-                    copyFile(dest, src);
-                }
-            } else {
-                HWARN(srcPath.constData() << "is not a file");
-            }
+            iOwner->processFile(iDestDir, iSrcDir, file->iName, st);
         }
-    } else {
-        // This is not an error, just skip it non-existing ones
-        HDEBUG(srcPath.constData() << "doesn't exist");
     }
 }
 
-void Backup::Private::copyFiles(QDir aDestDir, QDir aSrcDir,
-    const QStringList aList, const char* aDestExDir, const char* aSrcExDir)
+// Number and size of the files found by the scan
+class Backup::Private::Totals {
+public:
+    Totals();
+
+    void addFile(const QByteArray aPath, quint64 aSize);
+    void add(const Totals& aTotals);
+
+public:
+    QMutex iMutex;
+    quint64 iFiles;
+    quint64 iBytes;
+    QByteArray iLargestFile; // Sample for the throughput measurement
+    quint64 iLargestSize;
+};
+
+Backup::Private::Totals::Totals() :
+    iFiles(0),
+    iBytes(0),
+    iLargestSize(0)
 {
-    const int n = aList.count();
-    for (int i = 0; i < n; i++) {
-        copyFiles(aDestDir, aSrcDir, aList.at(i), aDestExDir, aSrcExDir);
+}
+
+void Backup::Private::Totals::addFile(const QByteArray aPath, quint64 aSize)
+{
+    // Not thread-safe, the local totals get merged with add()
+    iFiles++;
+    iBytes += aSize;
+    if (aSize > iLargestSize || iLargestFile.isEmpty()) {
+        iLargestFile = aPath;
+        iLargestSize = aSize;
     }
 }
 
-// ==========================================================================
-// Backup::Import
-// ==========================================================================
+void Backup::Private::Totals::add(const Totals& aTotals)
+{
+    QMutexLocker lock(&iMutex);
+    iFiles += aTotals.iFiles;
+    iBytes += aTotals.iBytes;
+    if (aTotals.iLargestSize > iLargestSize || iLargestFile.isEmpty()) {
+        iLargestFile = aTotals.iLargestFile;
+        iLargestSize = aTotals.iLargestSize;
+    }
+}
 
-class Backup::Import {
+// Scans a directory tree on a BackupCopyEngine thread
+class Backup::Private::ScanJob : public BackupCopyEngine::Job {
 public:
-    static void restoreSubGroups(const QString aPrefix, const QVariantList aSubGroups);
-    static void restoreSubKeys(const QString aPrefix, const QVariantList aSubKeys);
-    static void restoreGroups(const QVariantList aGroups);
-    static void restoreKey(const QString aKey, const QVariant aValue);
-    static void restoreKeys(const QVariantList aKeys);
-    static void restoreConfig(const QString aBackupRoot, const QStringList aConfigList);
-    static void restore(const QString aHome, const QString aBackupRoot,
-        const QStringList aFileList, const QStringList aConfigList);
+    ScanJob(Private* aOwner, int aFd, const QByteArray aPath,
+        const BackupExcludes::State aExState, Totals* aTotals);
+    ~ScanJob();
+
+    void run() Q_DECL_OVERRIDE;
+
+private:
+    Private* iOwner;
+    int iFd;
+    const QByteArray iPath;
+    const BackupExcludes::State iExState;
+    Totals* iTotals;
 };
 
-void Backup::Import::restoreSubGroups(const QString aPrefix,
-    const QVariantList aSubGroups)
+Backup::Private::ScanJob::ScanJob(Private* aOwner, int aFd,
+    const QByteArray aPath, const BackupExcludes::State aExState,
+    Totals* aTotals) :
+    iOwner(aOwner),
+    iFd(aFd),
+    iPath(aPath),
+    iExState(aExState),
+    iTotals(aTotals)
 {
-    const int n = aSubGroups.count();
-    for (int i = 0; i < n; i++) {
-        const QVariantMap entry(aSubGroups.at(i).toMap());
-        const QString subgroup(entry.value(CONFIG_NAME).toString());
-        if (!subgroup.startsWith('/') && subgroup.endsWith('/')) {
-            const QString group(aPrefix + subgroup);
-            restoreSubGroups(group, entry.value(CONFIG_GROUPS).toList());
-            restoreSubKeys(group, entry.value(CONFIG_KEYS).toList());
-        } else {
-            HWARN("Ignoring configuration subgroup" << subgroup);
-        }
-    }
 }
 
-void Backup::Import::restoreKey(const QString aKey, const QVariant aValue)
+Backup::Private::ScanJob::~ScanJob()
 {
-    if (aValue.isValid()) {
-        HDEBUG(aKey << "=" << aValue);
-        MGConfItem item(aKey);
-        item.set(aValue);
-        item.sync();
+    if (iFd >= 0) {
+        close(iFd);
     }
 }
 
-void Backup::Import::restoreSubKeys(const QString aPrefix,
-    const QVariantList aSubKeys)
+void Backup::Private::ScanJob::run()
 {
-    const int n = aSubKeys.count();
-    for (int i = 0; i < n; i++) {
-        const QVariantMap entry(aSubKeys.at(i).toMap());
-        const QString subkey(entry.value(CONFIG_NAME).toString());
-        if (!subkey.startsWith('/') && !subkey.endsWith('/')) {
-            restoreKey(aPrefix + subkey, entry.value(CONFIG_VALUE));
-        } else {
-            HWARN("Ignoring configuration subkey" << subkey);
-        }
-    }
+    Totals totals;
+    iOwner->scanDir(iFd, iPath, iExState, &totals);
+    iFd = -1; // scanDir has closed it
+    iTotals->add(totals);
 }
 
-void Backup::Import::restoreGroups(const QVariantList aGroups)
+Backup::Private::Private(const Options& aOptions, const char* aDestExDir,
+    const char* aSrcExDir) :
+    iChunkStore(Q_NULLPTR),
+    iDelta(Q_NULLPTR),
+    iRestoreChunks(false),
+    iManifest(Q_NULLPTR),
+    iArchive(Q_NULLPTR),
+    iProgress(Q_NULLPTR),
+    iLinkDestFd(-1),
+    iSnapshot(false),
+    iFailures(0),
+    iCopier(aOptions.iReadAhead * 1024),
+    iEngine(aOptions.iJobs)
 {
-    const int n = aGroups.count();
-    if (n > 0) {
-        ConfigClient dconf(ConfigClient::create());
-        for (int i = 0; i < n; i++) {
-            const QVariantMap entry(aGroups.at(i).toMap());
-            const QString group(entry.value(CONFIG_NAME).toString());
-            if (group.startsWith('/') && group.endsWith('/')) {
-                MGConfItem item(group);
-                item.set(QVariant()); // Clear the group
-                item.sync();
-                restoreSubGroups(group, entry.value(CONFIG_GROUPS).toList());
-                restoreSubKeys(group, entry.value(CONFIG_KEYS).toList());
-            } else {
-                HWARN("Ignoring configuration group" << group);
-            }
-        }
-        dconf.sync();
+    if (aDestExDir) {
+        iDestExcludes.addDir(aDestExDir);
+    }
+    if (aSrcExDir) {
+        iSrcExcludes.addDir(aSrcExDir);
+    }
+
+    // Each queued job holds two directory descriptors
+    struct rlimit rl;
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
 }
 
-void Backup::Import::restoreKeys(const QVariantList aKeys)
+QString Backup::Private::backupUserRoot(const QString aBackupRoot)
 {
-    const int n = aKeys.count();
-    if (n > 0) {
-        ConfigClient dconf(ConfigClient::create());
-        for (int i = 0; i < n; i++) {
-            const QVariantMap entry(aKeys.at(i).toMap());
-            const QString key(entry.value(CONFIG_NAME).toString());
-            if (key.startsWith('/') && !key.endsWith('/')) {
-                restoreKey(key, entry.value(CONFIG_VALUE));
-            } else {
-                HWARN("Ignoring configuration key" << key);
+    return aBackupRoot + QDir::separator() +
+        USERS_DIR + QDir::separator() +
+        QString::number(geteuid()) + QDir::separator();
+
+}
+
+QDir Backup::Private::backupFilesDir(const QString aBackupRoot)
+{
+    return QDir(backupUserRoot(aBackupRoot) + FILES_DIR);
+}
+
+QDir Backup::Private::backupRecipesDir(const QString aBackupRoot)
+{
+    return QDir(backupUserRoot(aBackupRoot) + RECIPES_DIR);
+}
+
+QString Backup::Private::backupChunksDir(const QString aBackupRoot)
+{
+    return backupUserRoot(aBackupRoot) + CHUNKS_DIR;
+}
+
+QString Backup::Private::backupSnapshotsDir(const QString aBackupRoot)
+{
+    return backupUserRoot(aBackupRoot) + SNAPSHOTS_DIR;
+}
+
+QString Backup::Private::backupSignaturesDir(const QString aBackupRoot)
+{
+    return backupUserRoot(aBackupRoot) + SIGNATURES_DIR;
+}
+
+QStringList Backup::Private::backupSnapshots(const QString aBackupRoot)
+{
+    // Oldest first. Hidden directories are incomplete snapshots.
+    return QDir(backupSnapshotsDir(aBackupRoot)).entryList(QDir::Dirs |
+        QDir::NoDotAndDotDot, QDir::Name);
+}
+
+QDir Backup::Private::backupDataDir(const QString aBackupRoot,
+    StorageMode aMode, const Options& aOptions)
+{
+    switch (aMode) {
+    case StoreChunks:
+        return backupRecipesDir(aBackupRoot);
+    case StoreSnapshots:
+        if (aOptions.iSnapshot) {
+            return QDir(backupSnapshotsDir(aBackupRoot)).filePath
+                (QString::fromLocal8Bit(aOptions.iSnapshot));
+        } else {
+            const QStringList snapshots(backupSnapshots(aBackupRoot));
+            if (!snapshots.isEmpty()) {
+                return QDir(backupSnapshotsDir(aBackupRoot)).filePath
+                    (snapshots.last());
             }
         }
-        dconf.sync();
+        break;
+    case StoreFiles:
+    case StoreArchive:
+        break;
     }
+    return backupFilesDir(aBackupRoot);
 }
 
-void Backup::Import::restoreConfig(const QString aBackupRoot,
-    const QStringList aList)
+QString Backup::Private::backupConfigStore(const QString aBackupRoot)
+{
+    return backupUserRoot(aBackupRoot) + CONFIG_STORE;
+}
+
+QString Backup::Private::backupConfigValues(const QString aBackupRoot)
+{
+    return backupUserRoot(aBackupRoot) + CONFIG_VALUES_STORE;
+}
+
+QString Backup::Private::backupManifest(const QString aBackupRoot,
+    StorageMode aMode, const QString aSnapshot)
 {
-    QVariantMap data;
-    if (HarbourJson::load(Private::backupConfigStore(aBackupRoot), data)) {
-        restoreGroups(data.value(CONFIG_GROUPS).toList());
-        restoreKeys(data.value(CONFIG_KEYS).toList());
+    switch (aMode) {
+    case StoreChunks:
+        return backupUserRoot(aBackupRoot) + CHUNKS_MANIFEST_STORE;
+    case StoreSnapshots:
+        return QDir(QDir(backupSnapshotsDir(aBackupRoot)).
+            filePath(aSnapshot)).filePath(SNAPSHOT_MANIFEST);
+    case StoreFiles:
+    case StoreArchive:
+        // Archive is rewritten from scratch, doesn't need one
+        break;
     }
+    return backupUserRoot(aBackupRoot) + MANIFEST_STORE;
 }
 
-void Backup::Import::restore(const QString aHome, const QString aBackupRoot,
-    const QStringList aFileList, const QStringList aConfigList)
+QString Backup::Private::backupArchive(const QString aBackupRoot)
 {
-    HDEBUG("Restoring files" << aBackupRoot << "=>" << aHome);
-    QDir backupDir(Private::backupFilesDir(aBackupRoot));
-    const QByteArray exPath(backupDir.absolutePath().toLocal8Bit());
-    Private::copyFiles(QDir(aHome), backupDir, aFileList,
-        exPath.constData(), Q_NULLPTR);
-    restoreConfig(aBackupRoot, aConfigList);
+    return backupUserRoot(aBackupRoot) + ARCHIVE_STORE;
 }
 
-// ==========================================================================
-// Backup::Export
-// ==========================================================================
+QString Backup::Private::backupModeStore(const QString aBackupRoot)
+{
+    return backupUserRoot(aBackupRoot) + MODE_STORE;
+}
 
-class Backup::Export {
-public:
-    static void storeKey(QVariantList* aList, const QString aGroup, const QString aName);
-    static QVariantMap groupEntry(const QString aName, const QVariantList aGroups, const QVariantList aKeys);
-    static QVariantMap storeGroup(ConfigClient aClient, const QString aParent, const QString aGroup);
-    static QVariantMap storeConfig(const QStringList aConfigList);
-    static void backupConfig(const QString aBackupRoot, const QStringList aConfigList);
-    static void backup(const QString aHome, const QString aBackupRoot,
-        const QStringList aFileList, const QStringList aConfigList);
-};
+const char* Backup::Private::storageModeName(StorageMode aMode)
+{
+    switch (aMode) {
+    case StoreChunks: return "chunks";
+    case StoreArchive: return "archive";
+    case StoreSnapshots: return "snapshots";
+    case StoreFiles: break;
+    }
+    return "files";
+}
+
+bool Backup::Private::storageExists(const QString aBackupRoot,
+    StorageMode aMode)
+{
+    switch (aMode) {
+    case StoreChunks:
+        return backupRecipesDir(aBackupRoot).exists();
+    case StoreArchive:
+        return QFile::exists(backupArchive(aBackupRoot));
+    case StoreSnapshots:
+        return !backupSnapshots(aBackupRoot).isEmpty();
+    case StoreFiles:
+        break;
+    }
+    return backupFilesDir(aBackupRoot).exists();
+}
 
-QVariantMap Backup::Export::groupEntry(const QString aName,
-    const QVariantList aGroups, const QVariantList aKeys)
+Backup::Private::StorageMode Backup::Private::storageMode(
+    const QString aBackupRoot, const Options& aOptions)
 {
-    QVariantMap group;
-    if (!aGroups.isEmpty()) {
-        group.insert(CONFIG_GROUPS, aGroups);
+    // Import is normally invoked without any options
+    if (aOptions.iArchive) {
+        return StoreArchive;
+    } else if (aOptions.iChunks) {
+        return StoreChunks;
+    } else if (aOptions.iSnapshot) {
+        return StoreSnapshots;
     }
-    if (!aKeys.isEmpty()) {
-        group.insert(CONFIG_KEYS, aKeys);
+
+    // Whatever the last export has written wins, the other stores
+    // may be left over from the earlier ones
+    QFile file(backupModeStore(aBackupRoot));
+    if (file.open(QIODevice::ReadOnly)) {
+        static const StorageMode modes[] = {
+            StoreFiles, StoreChunks, StoreArchive, StoreSnapshots
+        };
+        const QByteArray name(file.readAll().trimmed());
+        for (uint i = 0; i < G_N_ELEMENTS(modes); i++) {
+            if (name == storageModeName(modes[i]) &&
+                storageExists(aBackupRoot, modes[i])) {
+                HDEBUG("Last export used" << name.constData());
+                return modes[i];
+            }
+        }
     }
-    if (!group.isEmpty() && !aName.isEmpty()) {
-        group.insert(CONFIG_NAME, aName);
+
+    // Backups made before the mode was recorded, pick whatever
+    // we have if there's no plain files
+    if (!backupFilesDir(aBackupRoot).exists()) {
+        if (QFile::exists(backupArchive(aBackupRoot))) {
+            return StoreArchive;
+        } else if (!backupSnapshots(aBackupRoot).isEmpty()) {
+            return StoreSnapshots;
+        } else if (backupRecipesDir(aBackupRoot).exists()) {
+            return StoreChunks;
+        }
     }
-    return group;
+    return StoreFiles;
 }
 
-void Backup::Export::storeKey(QVariantList* aList,
-    const QString aGroup, const QString aName)
+void Backup::Private::saveStorageMode(const QString aBackupRoot,
+    StorageMode aMode)
 {
-    const QString path(aGroup + aName);
-    MGConfItem item(path);
-    const QVariant value(item.value());
-    if (value.isValid()) {
-        QVariantMap key;
-        key.insert(CONFIG_NAME, aName);
-        key.insert(CONFIG_VALUE, value);
-        aList->append(key);
-        HDEBUG(path << "=" << value);
-    } else {
-        HDEBUG(path << "doesn't exist");
+    QSaveFile file(backupModeStore(aBackupRoot));
+    if (!file.open(QIODevice::WriteOnly) ||
+        file.write(QByteArray(storageModeName(aMode)) + '\n') < 0 ||
+        !file.commit()) {
+        HWARN("Failed to save" << qPrintable(file.fileName()));
     }
 }
 
-QVariantMap Backup::Export::storeGroup(ConfigClient aClient,
-    const QString aParent, const QString aGroup)
+void Backup::Private::setDestRoot(const char* aRoot)
 {
-    QVariantList subgroups, subkeys;
-    const QString path(aParent + aGroup);
-    const QStringList entries(aClient.list(path));
-    const int n = entries.count();
-    for (int i = 0; i < n; i++) {
-        const QString name(entries.at(i));
-        if (name.endsWith('/')) {
-            HDEBUG("Group" << (path + name));
-            const QVariantMap subgroup(storeGroup(aClient, path, name));
-            if (!subgroup.isEmpty()) {
-                subgroups.append(subgroup);
-            }
-        } else {
-            storeKey(&subkeys, path, name);
-        }
+    // The manifest is maintained for the files under aRoot, the same
+    // tree is stored in the archive
+    iDestRoot = QByteArray(aRoot);
+}
+
+QByteArray Backup::Private::relativePath(const QByteArray aDestFile) const
+{
+    const int len = iDestRoot.length();
+    if (len && aDestFile.startsWith(iDestRoot) &&
+        aDestFile.length() > len && aDestFile.at(len) == '/') {
+        return aDestFile.mid(len + 1);
     }
-    return groupEntry(aGroup, subgroups, subkeys);
+    return QByteArray();
 }
 
-QVariantMap Backup::Export::storeConfig(const QStringList aConfigList)
+QByteArray Backup::Private::archivePath(const QByteArray aDestFile) const
 {
-    QVariantList groups, keys;
-    ConfigClient dconf(ConfigClient::create());
-    const int n = aConfigList.count();
-    for (int i = 0; i < n; i++) {
-        const QString name(aConfigList.at(i));
-        if (name.startsWith('/')) {
-            if (name.endsWith('/')) {
-                HDEBUG("Group" << name);
-                const QVariantMap group(storeGroup(dconf, QString(), name));
-                if (!group.isEmpty()) {
-                    groups.append(group);
-                }
-            } else {
-                storeKey(&keys, QString(), name);
-            }
-        } else {
-            HWARN("Ignoring configuration entry" << name);
+    const QByteArray path(relativePath(aDestFile));
+    return path.isEmpty() ? path : (FILES_DIR.toLatin1() + '/' + path);
+}
+
+void Backup::Private::fileCopied(Dir* aDestDir, const char* aName,
+    const struct stat* aStat)
+{
+    if (iManifest) {
+        const QByteArray path(relativePath(aDestDir->filePath(aName)));
+        if (!path.isEmpty()) {
+            iNewManifest.add(path, aStat);
         }
     }
-    return groupEntry(QString(), groups, keys);
 }
 
-void Backup::Export::backupConfig(const QString aBackupRoot,
-    const QStringList aConfigList)
+void Backup::Private::fileProcessed(const struct stat* aStat)
 {
-    const QString file(Private::backupConfigStore(aBackupRoot));
-    const QVariantMap config(storeConfig(aConfigList));
-    HDEBUG("Writing" << qPrintable(file));
-    HarbourJson::save(file, config);
+    // Failed files count too, otherwise the progress would never
+    // reach the total
+    if (iProgress && aStat) {
+        iProgress->fileDone(aStat->st_size);
+    }
 }
 
-void Backup::Export::backup(const QString aHome, const QString aBackupRoot,
-    const QStringList aFileList, const QStringList aConfigList)
+void Backup::Private::fileFailed(Dir* aSrcDir, const char* aName)
 {
-    HDEBUG("Backing up files" << aHome << "=>" << aBackupRoot);
-    QDir backupDir(Private::backupFilesDir(aBackupRoot));
-    const QByteArray exPath(backupDir.absolutePath().toLocal8Bit());
-    Private::copyFiles(backupDir, QDir(aHome), aFileList,
-        Q_NULLPTR, exPath.constData());
-    backupConfig(aBackupRoot, aConfigList);
+    // Files deleted after the directory has been read are simply
+    // not there anymore, that's not a failure
+    if (faccessat(aSrcDir->iFd, aName, F_OK, AT_SYMLINK_NOFOLLOW) &&
+        errno == ENOENT) {
+        HDEBUG(aSrcDir->filePath(aName).constData() << "is gone");
+    } else {
+        g_atomic_int_inc(&iFailures);
+    }
 }
 
-// ==========================================================================
-// Backup
-// ==========================================================================
+void Backup::Private::processFile(Dir* aDestDir, Dir* aSrcDir,
+    const char* aName, const struct stat* aStat)
+{
+    // The manifest describes the file as it was copied, which may
+    // differ from what the scan has seen
+    struct stat copied;
+    if (!transferFile(aDestDir, aSrcDir, aName, aStat, &copied)) {
+        fileFailed(aSrcDir, aName);
+        fileProcessed(aStat);
+    } else {
+        fileCopied(aDestDir, aName, &copied);
+        fileProcessed(&copied);
+    }
+}
 
-int Backup::run(Action aAction, const char* aHome, const char* aBackupRoot)
+void Backup::Private::copyRegularFile(Dir* aDestDir, Dir* aSrcDir,
+    const char* aName, const struct stat* aStat, CopyBatchJob** aBatch)
 {
-    const QString configDir(BackupList::configDir() + QDir::separator());
+    if (iArchive) {
+        // Archive is written sequentially, compression runs on its own
+        // thread
+        const QByteArray path(archivePath(aDestDir->filePath(aName)));
+        if (!path.isEmpty() &&
+            !iArchive->addFile(path, aSrcDir->iFd, aName, aStat)) {
+            fileFailed(aSrcDir, aName);
+        }
+        fileProcessed(aStat);
+        return;
+    } else if (iManifest && aStat) {
+        // Skip the file if it hasn't changed since the last backup
+        // and is still there
+        const QByteArray path(relativePath(aDestDir->filePath(aName)));
+        struct stat dest;
+        if (!path.isEmpty() && iManifest->contains(path, aStat) &&
+            ((iLinkDestFd >= 0) ?
+             // Share the file with the previous snapshot
+             !linkat(iLinkDestFd, path.constData(), aDestDir->iFd, aName, 0) :
+             (!fstatat(aDestDir->iFd, aName, &dest, 0) &&
+              S_ISREG(dest.st_mode) &&
+              (iChunkStore || dest.st_size == aStat->st_size)))) {
+            HDEBUG(aSrcDir->filePath(aName).constData() << "is unchanged");
+            iNewManifest.add(path, aStat);
+            fileProcessed(aStat);
+            return;
+        }
+    }
+    if (aBatch && iUring.isValid() && !iChunkStore &&
+        (!aStat || aStat->st_size <= BackupUring::MAX_FILE_SIZE)) {
+        // Small files are copied in batches
+        if (!*aBatch) {
+            *aBatch = new CopyBatchJob(this, aDestDir, aSrcDir);
+        }
+        (*aBatch)->add(aName, aStat);
+        if ((*aBatch)->isFull()) {
+            iEngine.submit(*aBatch);
+            *aBatch = Q_NULLPTR;
+        }
+    } else {
+        iEngine.submit(new CopyFileJob(this, aDestDir, aSrcDir, aName,
+            aStat));
+    }
+}
+
+// aCopied receives the stat of the file that has actually been stored
+bool Backup::Private::transferFile(Dir* aDestDir, Dir* aSrcDir,
+    const char* aName, const struct stat* aStat, struct stat* aCopied)
+{
+    if (iDelta && aStat && aStat->st_size >= BackupDelta::MIN_SIZE) {
+        // Large files may only need a few blocks updated
+        const QByteArray path(relativePath(aDestDir->filePath(aName)));
+        if (!path.isEmpty()) {
+            if (iDelta->update(aDestDir->iFd, aName, aSrcDir->iFd, aName,
+                aStat, path)) {
+                *aCopied = *aStat;
+                return true;
+            } else if (copyFile(aDestDir, aSrcDir, aName, aCopied)) {
+                iDelta->sign(aDestDir->iFd, aName, path);
+                return true;
+            }
+            return false;
+        }
+    }
+    if (!iChunkStore) {
+        return copyFile(aDestDir, aSrcDir, aName, aCopied);
+    } else if (aStat) {
+        *aCopied = *aStat;
+    } else if (fstatat(aSrcDir->iFd, aName, aCopied, 0)) {
+        return false;
+    }
+    if (iRestoreChunks) {
+        // The recipe knows the size of the file it describes
+        quint64 size;
+        if (iChunkStore->restoreFile(aDestDir->iFd, aName, aSrcDir->iFd,
+            aName, &size)) {
+            aCopied->st_size = size;
+            return true;
+        }
+        return false;
+    } else {
+        return iChunkStore->storeFile(aDestDir->iFd, aName,
+            aSrcDir->iFd, aName, aCopied);
+    }
+}
+
+bool Backup::Private::copyFile(Dir* aDestDir, Dir* aSrcDir,
+    const char* aName, struct stat* aCopied)
+{
+    // First try to create a hard link because it's so much faster.
+    // Snapshots can't share files with the live system though, those
+    // have to stay as they were.
+    if (!iSnapshot &&
+        linkat(aSrcDir->iFd, aName, aDestDir->iFd, aName, 0) == 0 &&
+        !fstatat(aDestDir->iFd, aName, aCopied, 0)) {
+        HDEBUG(aSrcDir->filePath(aName).constData() << "->" <<
+            aDestDir->filePath(aName).constData());
+        return true;
+    }
+
+    const int err = iCopier.copy(aDestDir->iFd, aName, aSrcDir->iFd, aName,
+        aCopied);
+    if (err) {
+        HWARN("Failed to copy" << aSrcDir->filePath(aName).constData() <<
+            ":" << strerror(err));
+        return false;
+    } else {
+        HDEBUG(aSrcDir->filePath(aName).constData() << "=>" <<
+            aDestDir->filePath(aName).constData());
+        return true;
+    }
+}
+
+QStringList Backup::Private::excludeList(const BackupList* aList,
+    const Options& aOptions)
+{
+    // User patterns come from backup.json and the command line
+    QStringList patterns(aList->excludeList());
+    if (aOptions.iExcludes) {
+        for (const char* const* ptr = aOptions.iExcludes; *ptr; ptr++) {
+            patterns.append(QString::fromLocal8Bit(*ptr));
+        }
+    }
+    return patterns;
+}
+
+bool Backup::Private::removeTree(int aDirFd, const char* aName)
+{
+    if (!unlinkat(aDirFd, aName, 0)) {
+        return true;
+    } else if (errno == EISDIR || errno == EPERM) {
+        const int fd = openat(aDirFd, aName, O_RDONLY | O_DIRECTORY |
+            O_NOFOLLOW | O_CLOEXEC);
+        DIR* dir = (fd >= 0) ? fdopendir(fd) : NULL;
+        if (dir) {
+            const struct dirent* entry;
+            while ((entry = readdir(dir)) != NULL) {
+                const char* name = entry->d_name;
+                if (name[0] != '.' || (name[1] &&
+                    (name[1] != '.' || name[2]))) {
+                    removeTree(fd, name);
+                }
+            }
+            closedir(dir);
+        } else if (fd >= 0) {
+            close(fd);
+        }
+        if (!unlinkat(aDirFd, aName, AT_REMOVEDIR)) {
+            return true;
+        }
+    }
+    HWARN("Failed to remove" << aName << ":" << strerror(errno));
+    return false;
+}
+
+Backup::Private::Dir* Backup::Private::openDir(const QByteArray aPath)
+{
+    const int fd = open(aPath.constData(), O_RDONLY | O_DIRECTORY |
+        O_CLOEXEC);
+    return (fd >= 0) ? new Dir(fd, aPath) : Q_NULLPTR;
+}
+
+bool Backup::Private::makeDestDir(const QByteArray aDestPath,
+    const QByteArray aSrcPath)
+{
+    // Creates the missing directories top down, each one with the same
+    // attributes as its source counterpart
+    struct stat st;
+    const char* destPath = aDestPath.constData();
+    if (stat(aSrcPath.constData(), &st) || !S_ISDIR(st.st_mode)) {
+        // Not supposed to happen below the leaf
+        return false;
+    }
+
+    const mode_t mode = st.st_mode & ~S_IFMT;
+    if (mkdir(destPath, mode)) {
+        const int slash = aDestPath.lastIndexOf('/');
+        const int srcSlash = aSrcPath.lastIndexOf('/');
+        if (errno == EEXIST) {
+            return true;
+        } else if (errno != ENOENT || slash <= 0 || srcSlash <= 0) {
+            HWARN("Failed to create directory" << destPath << ":" <<
+                strerror(errno));
+            return false;
+        }
+        const QByteArray parent(aDestPath.left(slash));
+        if (!makeDestDir(parent, aSrcPath.left(srcSlash)) &&
+            g_mkdir_with_parents(parent.constData(), 0755)) {
+            HWARN("Failed to create directory" << parent.constData() <<
+                ":" << strerror(errno));
+            return false;
+        }
+        if (mkdir(destPath, mode)) {
+            HWARN("Failed to create directory" << destPath << ":" <<
+                strerror(errno));
+            return false;
+        }
+    }
+
+    // Try to copy ownership and mode
+    if (chown(destPath, st.st_uid, st.st_gid)) {
+        HWARN("Failed to chown" << destPath << ":" << strerror(errno));
+    }
+    if (chmod(destPath, mode)) {
+        HWARN("Failed to chmod" << destPath << ":" << strerror(errno));
+    }
+    HDEBUG("Created" << destPath);
+    return true;
+}
+
+Backup::Private::Dir* Backup::Private::openDestDir(const QByteArray aDestPath,
+    const QByteArray aSrcPath)
+{
+    Dir* dir = openDir(aDestPath);
+    if (!dir && errno == ENOENT && makeDestDir(aDestPath, aSrcPath)) {
+        dir = openDir(aDestPath);
+        if (dir) {
+            dir->iFresh = true;
+        }
+    }
+    return dir;
+}
+
+Backup::Private::Dir* Backup::Private::destDir(const QByteArray aDestPath,
+    const QByteArray aSrcPath)
+{
+    if (iArchive) {
+        // Nothing is created in the file system
+        return new Dir(-1, aDestPath);
+    }
+
+    // Entries of the backup list often share parent directories, each
+    // one is only opened (or created) once per run
+    Dir* dir = iDestDirs.value(aDestPath);
+    if (dir) {
+        dir->iFresh = false; // It may have been filled by now
+        return dir->ref();
+    }
+    dir = openDestDir(aDestPath, aSrcPath);
+    if (dir) {
+        iDestDirs.insert(aDestPath, dir->ref());
+    }
+    return dir;
+}
+
+void Backup::Private::clearDestDirs()
+{
+    QHash<QByteArray,Dir*>::const_iterator it = iDestDirs.constBegin();
+    while (it != iDestDirs.constEnd()) {
+        it.value()->unref();
+        ++it;
+    }
+    iDestDirs.clear();
+}
+
+bool Backup::Private::acceptFile(Dir* aDestDir, Dir* aSrcDir,
+    const char* aName) const
+{
+    return iSrcExcludes.accept(aSrcDir->iExState, aName, false) &&
+        iDestExcludes.accept(aDestDir->iExState, aName, false);
+}
+
+void Backup::Private::copyDir(Dir* aDestParent, Dir* aSrcParent,
+    const char* aName)
+{
+    const QByteArray srcPath(aSrcParent->filePath(aName));
+    const QByteArray destPath(aDestParent->filePath(aName));
+    BackupExcludes::State srcExState, destExState;
+    // Be slightly paranoid :)
+    if (srcPath == destPath ||
+        !iSrcExcludes.accept(aSrcParent->iExState, aName, true, &srcExState) ||
+        !iDestExcludes.accept(aDestParent->iExState, aName, true, &destExState)) {
+        return;
+    }
+
+    // Make sure that the source is a directory
+    struct stat st;
+    const int srcFd = openat(aSrcParent->iFd, aName, O_RDONLY |
+        O_DIRECTORY | O_CLOEXEC);
+    if (srcFd < 0 || fstat(srcFd, &st)) {
+        HWARN("Skipping" << srcPath.constData());
+        if (srcFd >= 0) close(srcFd);
+        return;
+    }
+
+    if (iArchive) {
+        const QByteArray path(archivePath(destPath));
+        if (!path.isEmpty()) {
+            iArchive->addDirectory(path, &st);
+        }
+        Dir* src = new Dir(srcFd, srcPath);
+        Dir* dest = new Dir(-1, destPath);
+        src->iExState = srcExState;
+        dest->iExState = destExState;
+        copyDirContents(dest, src);
+        src->unref();
+        dest->unref();
+        return;
+    }
+
+    // Create the destination directory if necessary. There's nothing
+    // to look for in the directory that has just been created.
+    const bool fresh = aDestParent->iFresh;
+    bool created = false;
+    int destFd = fresh ? -1 : openat(aDestParent->iFd, aName, O_RDONLY |
+        O_DIRECTORY | O_CLOEXEC);
+    if (destFd < 0) {
+        const mode_t mode = st.st_mode & ~S_IFMT;
+        if (!fresh) {
+            // In case if there's file with the same name
+            unlinkat(aDestParent->iFd, aName, 0);
+        }
+        if (!mkdirat(aDestParent->iFd, aName, mode) &&
+            (destFd = openat(aDestParent->iFd, aName, O_RDONLY |
+             O_DIRECTORY | O_CLOEXEC)) >= 0) {
+            // Try to copy ownership and mode
+            if (fchown(destFd, st.st_uid, st.st_gid)) {
+                HWARN("Failed to chown" << destPath.constData() << ":" <<
+                    strerror(errno));
+            }
+            if (fchmod(destFd, mode)) {
+                HWARN("Failed to chmod" << destPath.constData() << ":" <<
+                    strerror(errno));
+            }
+            HDEBUG("Created" << destPath.constData());
+            created = true;
+        } else {
+            HWARN("Failed to create directory" << destPath.constData() <<
+                ":" << strerror(errno));
+            g_atomic_int_inc(&iFailures);
+            close(srcFd);
+            return;
+        }
+    }
+
+    Dir* src = new Dir(srcFd, srcPath);
+    Dir* dest = new Dir(destFd, destPath);
+    src->iExState = srcExState;
+    dest->iExState = destExState;
+    dest->iFresh = created;
+    copyDirContents(dest, src);
+    src->unref();
+    dest->unref();
+}
+
+void Backup::Private::copyDirContents(Dir* aDest, Dir* aSrc)
+{
+    // The stream gets its own descriptor, the one held by Dir
+    // may outlive the listing.
+    const int listFd = dup(aSrc->iFd);
+    DIR* dir = (listFd >= 0) ? fdopendir(listFd) : NULL;
+    if (dir) {
+        // Only regular files need to be stat'ed upfront, and only if
+        // the manifest is being maintained or the progress is reported.
+        // Otherwise it's done by the copy thread on the open file.
+        const bool needStat = (iManifest || iProgress);
+        CopyBatchJob* batch = Q_NULLPTR;
+        const struct dirent* entry;
+        struct stat st;
+        while ((entry = readdir(dir)) != NULL) {
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (!name[1] ||
+                (name[1] == '.' && !name[2]))) {
+                continue;
+            }
+            switch (entry->d_type) {
+            case DT_DIR:
+                copyDir(aDest, aSrc, name);
+                break;
+            case DT_REG:
+                if (!needStat) {
+                    if (acceptFile(aDest, aSrc, name)) {
+                        copyRegularFile(aDest, aSrc, name, NULL, &batch);
+                    }
+                    break;
+                }
+                /* fallthrough */
+            case DT_LNK:
+            case DT_UNKNOWN:
+                // Symbolic links are followed
+                if (!fstatat(aSrc->iFd, name, &st, 0)) {
+                    if (S_ISREG(st.st_mode)) {
+                        if (acceptFile(aDest, aSrc, name)) {
+                            copyRegularFile(aDest, aSrc, name, &st,
+                                &batch);
+                        }
+                    } else if (S_ISDIR(st.st_mode)) {
+                        copyDir(aDest, aSrc, name);
+                    }
+                }
+                break;
+            default:
+                // Sockets, pipes, devices and such
+                HDEBUG("Skipping" << aSrc->filePath(name).constData());
+                break;
+            }
+        }
+        if (batch) {
+            iEngine.submit(batch);
+        }
+        closedir(dir);
+    } else {
+        if (listFd >= 0) close(listFd);
+        HWARN("Failed to list" << aSrc->iPath.constData() << ":" <<
+            strerror(errno));
+    }
+}
+
+void Backup::Private::copyFiles(QDir aDestDir, QDir aSrcDir,
+    const QString aEntry)
+{
+    // BackupList::backupFileList makes sure that paths are relative
+    // to the home directory. Caller makes sure that the destination
+    // directory exists.
+    bool copyTree = false;
+    QString entry(aEntry);
+    if (entry.endsWith(QDir::separator())) {
+        copyTree = true;
+        do { entry = entry.left(entry.length() - 1); }
+        while (entry.endsWith(QDir::separator()));
+    }
+    QFileInfo srcInfo(aSrcDir, entry);
+    const QString srcFile(QDir::cleanPath(srcInfo.absoluteFilePath()));
+    const QByteArray srcPath(srcFile.toLocal8Bit());
+    if (srcInfo.exists()) {
+        const QString destFile(QDir::cleanPath(QFileInfo(aDestDir, entry).
+            absoluteFilePath()));
+        const QByteArray destPath(destFile.toLocal8Bit());
+        if (copyTree && srcInfo.isDir()) {
+            // Copy directory tree
+            BackupExcludes::State srcExState, destExState;
+            if (iSrcExcludes.acceptPath(srcPath, true, &srcExState) &&
+                iDestExcludes.acceptPath(destPath, true, &destExState) &&
+                srcPath != destPath) {
+                Dir* src = openDir(srcPath);
+                Dir* dest = src ? destDir(destPath, srcPath) : Q_NULLPTR;
+                if (dest) {
+                    src->iExState = srcExState;
+                    dest->iExState = destExState;
+                    struct stat st;
+                    const QByteArray path(archivePath(destPath));
+                    if (iArchive && !path.isEmpty() && !fstat(src->iFd, &st)) {
+                        iArchive->addDirectory(path, &st);
+                    }
+                    copyDirContents(dest, src);
+                    dest->unref();
+                } else {
+                    HWARN("Can't copy" << srcPath.constData());
+                }
+                if (src) {
+                    src->unref();
+                }
+            }
+        } else if (!copyTree && srcInfo.isFile()) {
+            // Single file is copied relative to its parent directories
+            const QFileInfo srcFileInfo(srcFile);
+            const QFileInfo destFileInfo(destFile);
+            const QByteArray name(srcFileInfo.fileName().toLocal8Bit());
+            const QByteArray srcParentPath(srcFileInfo.absolutePath().
+                toLocal8Bit());
+            const QByteArray destParentPath(destFileInfo.absolutePath().
+                toLocal8Bit());
+            struct stat st;
+            if (iSrcExcludes.acceptPath(srcPath, false) &&
+                iDestExcludes.acceptPath(destPath, false)) {
+                Dir* srcParent = openDir(srcParentPath);
+                Dir* destParent = srcParent ?
+                    destDir(destParentPath, srcParentPath) : Q_NULLPTR;
+                if (destParent) {
+                    if (!fstatat(srcParent->iFd, name.constData(), &st, 0)) {
+                        copyRegularFile(destParent, srcParent,
+                            name.constData(), &st, Q_NULLPTR);
+                    }
+                    destParent->unref();
+                } else {
+                    HWARN("Can't copy" << srcPath.constData());
+                }
+                if (srcParent) {
+                    srcParent->unref();
+                }
+            }
+        } else {
+            HWARN(srcPath.constData() << "is not a" <<
+                (copyTree ? "directory" : "file"));
+        }
+    } else {
+        // This is not an error, just skip it non-existing ones
+        HDEBUG(srcPath.constData() << "doesn't exist");
+    }
+}
+
+void Backup::Private::copyFiles(QDir aDestDir, QDir aSrcDir,
+    const QStringList aList)
+{
+    const int n = aList.count();
+    for (int i = 0; i < n; i++) {
+        copyFiles(aDestDir, aSrcDir, aList.at(i));
+    }
+    // Wait for the copy threads to finish
+    iEngine.finish();
+    clearDestDirs();
+}
+
+quint64 Backup::Private::scanSize(int aDirFd, const char* aName,
+    const struct stat* aStat) const
+{
+    // Recipes are much smaller than the files they restore
+    quint64 size;
+    return (iRestoreChunks && BackupChunkStore::recipeSize(aDirFd, aName,
+        &size)) ? size : aStat->st_size;
+}
+
+void Backup::Private::scanDir(int aFd, const QByteArray aPath,
+    const BackupExcludes::State aExState, Totals* aTotals)
+{
+    // Same traversal as copyDirContents, without copying anything.
+    // Takes ownership of the descriptor.
+    DIR* dir = fdopendir(aFd);
+    if (dir) {
+        const struct dirent* entry;
+        struct stat st;
+        while ((entry = readdir(dir)) != NULL) {
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (!name[1] ||
+                (name[1] == '.' && !name[2]))) {
+                continue;
+            }
+            if (entry->d_type == DT_DIR || entry->d_type == DT_REG ||
+                entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+                BackupExcludes::State exState;
+                if (!fstatat(aFd, name, &st, 0) &&
+                    iSrcExcludes.accept(aExState, name, S_ISDIR(st.st_mode),
+                    &exState)) {
+                    const QByteArray path(aPath + '/' + name);
+                    if (S_ISREG(st.st_mode)) {
+                        aTotals->addFile(path, scanSize(aFd, name, &st));
+                    } else if (S_ISDIR(st.st_mode)) {
+                        const int fd = openat(aFd, name, O_RDONLY |
+                            O_DIRECTORY | O_CLOEXEC);
+                        if (fd >= 0) {
+                            scanDir(fd, path, exState, aTotals);
+                        }
+                    }
+                }
+            }
+        }
+        closedir(dir);
+    } else {
+        close(aFd);
+    }
+}
+
+void Backup::Private::scanEntry(QDir aSrcDir, const QString aEntry,
+    Totals* aTotals)
+{
+    QString rel(aEntry);
+    const bool tree = rel.endsWith(QDir::separator());
+    while (rel.endsWith(QDir::separator())) {
+        rel = rel.left(rel.length() - 1);
+    }
+    const QByteArray path(QDir::cleanPath(QFileInfo(aSrcDir, rel).
+        absoluteFilePath()).toLocal8Bit());
+    struct stat st;
+    BackupExcludes::State exState;
+    if (!iSrcExcludes.acceptPath(path, tree, &exState) ||
+        stat(path.constData(), &st)) {
+        return;
+    }
+
+    Totals totals;
+    if (tree && S_ISDIR(st.st_mode)) {
+        // Top level subdirectories are scanned in parallel
+        const int fd = open(path.constData(), O_RDONLY | O_DIRECTORY |
+            O_CLOEXEC);
+        DIR* dir = (fd >= 0) ? fdopendir(fd) : NULL;
+        if (dir) {
+            const struct dirent* entry;
+            while ((entry = readdir(dir)) != NULL) {
+                const char* name = entry->d_name;
+                if (name[0] == '.' && (!name[1] ||
+                    (name[1] == '.' && !name[2]))) {
+                    continue;
+                }
+                BackupExcludes::State subExState;
+                if (!fstatat(fd, name, &st, 0) &&
+                    iSrcExcludes.accept(exState, name, S_ISDIR(st.st_mode),
+                    &subExState)) {
+                    const QByteArray subPath(path + '/' + name);
+                    if (S_ISREG(st.st_mode)) {
+                        totals.addFile(subPath, scanSize(fd, name, &st));
+                    } else if (S_ISDIR(st.st_mode)) {
+                        const int subFd = openat(fd, name, O_RDONLY |
+                            O_DIRECTORY | O_CLOEXEC);
+                        if (subFd >= 0) {
+                            iEngine.submit(new ScanJob(this, subFd, subPath,
+                                subExState, aTotals));
+                        }
+                    }
+                }
+            }
+            closedir(dir);
+        } else if (fd >= 0) {
+            close(fd);
+        }
+    } else if (!tree && S_ISREG(st.st_mode)) {
+        totals.addFile(path, scanSize(AT_FDCWD, path.constData(), &st));
+    }
+    aTotals->add(totals);
+}
+
+void Backup::Private::scanFiles(QDir aSrcDir, const QStringList aList)
+{
+    Totals totals;
+    const int n = aList.count();
+    for (int i = 0; i < n; i++) {
+        scanEntry(aSrcDir, aList.at(i), &totals);
+    }
+    iEngine.finish();
+    HDEBUG(totals.iFiles << "file(s)," << totals.iBytes << "bytes");
+    iProgress->setTotal(totals.iFiles, totals.iBytes);
+}
+
+// ==========================================================================
+// Backup::Phase
+// ==========================================================================
+
+// Configuration is handled on its own thread while the files are being
+// copied, unless the phases have to run one after another. In the latter
+// case, everything happens in wait(). It must be called before the phase
+// is deleted.
+class Backup::Phase {
+public:
+    Phase();
+    virtual ~Phase();
+
+    void start(bool aSequential);
+    bool wait();
+
+protected:
+    virtual bool run() = 0;
+
+private:
+    static gpointer threadProc(gpointer aPhase);
+
+private:
+    GThread* iThread;
+    bool iDone;
+    bool iResult;
+};
+
+Backup::Phase::Phase() :
+    iThread(NULL),
+    iDone(false),
+    iResult(false)
+{
+}
+
+Backup::Phase::~Phase()
+{
+    if (iThread) {
+        g_thread_join(iThread);
+    }
+}
+
+gpointer Backup::Phase::threadProc(gpointer aPhase)
+{
+    Phase* self = (Phase*)aPhase;
+    self->iResult = self->run();
+    return NULL;
+}
+
+void Backup::Phase::start(bool aSequential)
+{
+    if (!aSequential && !iThread && !iDone) {
+        iThread = g_thread_new("config", threadProc, this);
+    }
+}
+
+bool Backup::Phase::wait()
+{
+    if (iThread) {
+        g_thread_join(iThread);
+        iThread = NULL;
+    } else if (!iDone) {
+        iResult = run();
+    }
+    iDone = true;
+    return iResult;
+}
+
+// ==========================================================================
+// Backup::Import
+// ==========================================================================
+
+class Backup::Import {
+public:
+    class ConfigPhase;
+
+    static void restoreSubGroups(ConfigClient::Changeset* aChanges, const QString aPrefix,
+        const QVariantList aSubGroups);
+    static void restoreSubKeys(ConfigClient::Changeset* aChanges, const QString aPrefix,
+        const QVariantList aSubKeys);
+    static void restoreKey(ConfigClient::Changeset* aChanges, const QString aKey,
+        const QVariant aValue);
+    static bool parseGroups(BackupJson::Reader* aJson, BackupJson::Reader::Token aToken,
+        ConfigClient::Changeset* aChanges, ConfigClient aClient, const QString aPrefix);
+    static bool parseGroup(BackupJson::Reader* aJson, ConfigClient::Changeset* aChanges,
+        ConfigClient aClient, const QString aPrefix);
+    static bool parseKeys(BackupJson::Reader* aJson, BackupJson::Reader::Token aToken,
+        ConfigClient::Changeset* aChanges, const QString aPrefix);
+    static bool restoreJson(ConfigClient::Changeset* aChanges, ConfigClient aClient,
+        const QString aFile);
+    static bool restoreValues(ConfigClient::Changeset* aChanges, ConfigClient aClient,
+        const QString aFile);
+    static bool restoreArchivedValues(ConfigClient::Changeset* aChanges,
+        ConfigClient aClient, const QString aBackupRoot);
+    static bool restoreConfig(const QString aBackupRoot, const QStringList aConfigList,
+        const Options& aOptions);
+    static void loadBackupList(BackupList* aList, const QString aBackupRoot,
+        const QString aConfigFileRel, const Options& aOptions);
+    static bool restore(const QString aHome, const QString aBackupRoot,
+        const QStringList aFileList, const QStringList aConfigList,
+        const Options& aOptions);
+};
+
+class Backup::Import::ConfigPhase : public Phase {
+public:
+    ConfigPhase(const QString aBackupRoot, const QStringList aConfigList,
+        const Options& aOptions) : iBackupRoot(aBackupRoot),
+        iConfigList(aConfigList), iOptions(aOptions) {}
+
+protected:
+    bool run() Q_DECL_OVERRIDE
+        { return restoreConfig(iBackupRoot, iConfigList, iOptions); }
+
+private:
+    const QString iBackupRoot;
+    const QStringList iConfigList;
+    const Options iOptions;
+};
+
+void Backup::Import::restoreSubGroups(ConfigClient::Changeset* aChanges,
+    const QString aPrefix, const QVariantList aSubGroups)
+{
+    const int n = aSubGroups.count();
+    for (int i = 0; i < n; i++) {
+        const QVariantMap entry(aSubGroups.at(i).toMap());
+        const QString subgroup(entry.value(CONFIG_NAME).toString());
+        if (!subgroup.startsWith('/') && subgroup.endsWith('/')) {
+            const QString group(aPrefix + subgroup);
+            restoreSubGroups(aChanges, group, entry.value(CONFIG_GROUPS).toList());
+            restoreSubKeys(aChanges, group, entry.value(CONFIG_KEYS).toList());
+        } else {
+            HWARN("Ignoring configuration subgroup" << subgroup);
+        }
+    }
+}
+
+void Backup::Import::restoreKey(ConfigClient::Changeset* aChanges,
+    const QString aKey, const QVariant aValue)
+{
+    if (aValue.isValid()) {
+        HDEBUG(aKey << "=" << aValue);
+        aChanges->set(aKey, aValue);
+    }
+}
+
+void Backup::Import::restoreSubKeys(ConfigClient::Changeset* aChanges,
+    const QString aPrefix, const QVariantList aSubKeys)
+{
+    const int n = aSubKeys.count();
+    for (int i = 0; i < n; i++) {
+        const QVariantMap entry(aSubKeys.at(i).toMap());
+        const QString subkey(entry.value(CONFIG_NAME).toString());
+        if (!subkey.startsWith('/') && !subkey.endsWith('/')) {
+            restoreKey(aChanges, aPrefix + subkey, entry.value(CONFIG_VALUE));
+        } else {
+            HWARN("Ignoring configuration subkey" << subkey);
+        }
+    }
+}
+
+// Top level names (with empty prefix) are absolute, the others relative
+bool Backup::Import::parseGroups(BackupJson::Reader* aJson,
+    BackupJson::Reader::Token aToken, ConfigClient::Changeset* aChanges,
+    ConfigClient aClient, const QString aPrefix)
+{
+    if (aToken != BackupJson::Reader::BeginArray) {
+        return aJson->skipValue(aToken);
+    }
+    BackupJson::Reader::Token token;
+    while ((token = aJson->next()) != BackupJson::Reader::EndArray) {
+        if (token == BackupJson::Reader::BeginObject) {
+            if (!parseGroup(aJson, aChanges, aClient, aPrefix)) {
+                return false;
+            }
+        } else if (!aJson->skipValue(token)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Backup::Import::parseGroup(BackupJson::Reader* aJson,
+    ConfigClient::Changeset* aChanges, ConfigClient aClient,
+    const QString aPrefix)
+{
+    // QJsonDocument writes the name after the contents, in that case
+    // the contents have to be buffered until the name is known
+    QString group;
+    bool named = false;
+    QVariantList groups, keys;
+    BackupJson::Reader::Token token;
+    while ((token = aJson->next()) == BackupJson::Reader::Name) {
+        const QString member(aJson->name());
+        token = aJson->next();
+        if (member == CONFIG_NAME && token == BackupJson::Reader::Value) {
+            const QString name(aJson->value().toString());
+            named = true;
+            if (aPrefix.isEmpty() ? (name.startsWith('/') && name.endsWith('/')) :
+                (!name.startsWith('/') && name.endsWith('/'))) {
+                group = aPrefix + name;
+                if (aPrefix.isEmpty()) {
+                    aClient.resetGroup(group, aChanges); // Clear the group
+                }
+                restoreSubGroups(aChanges, group, groups);
+                restoreSubKeys(aChanges, group, keys);
+            } else {
+                HWARN("Ignoring configuration group" << name);
+            }
+        } else if (member == CONFIG_GROUPS && !named) {
+            groups = aJson->readValue(token).toList();
+        } else if (member == CONFIG_GROUPS && !group.isEmpty()) {
+            if (!parseGroups(aJson, token, aChanges, aClient, group)) {
+                return false;
+            }
+        } else if (member == CONFIG_KEYS && !named) {
+            keys = aJson->readValue(token).toList();
+        } else if (member == CONFIG_KEYS && !group.isEmpty()) {
+            if (!parseKeys(aJson, token, aChanges, group)) {
+                return false;
+            }
+        } else if (!aJson->skipValue(token)) {
+            return false;
+        }
+    }
+    return token == BackupJson::Reader::EndObject;
+}
+
+bool Backup::Import::parseKeys(BackupJson::Reader* aJson,
+    BackupJson::Reader::Token aToken, ConfigClient::Changeset* aChanges,
+    const QString aPrefix)
+{
+    if (aToken != BackupJson::Reader::BeginArray) {
+        return aJson->skipValue(aToken);
+    }
+    BackupJson::Reader::Token token;
+    while ((token = aJson->next()) != BackupJson::Reader::EndArray) {
+        if (token != BackupJson::Reader::BeginObject) {
+            if (!aJson->skipValue(token)) {
+                return false;
+            }
+            continue;
+        }
+
+        // Each key is small enough to be read as a whole
+        QString name;
+        QVariant value;
+        while ((token = aJson->next()) == BackupJson::Reader::Name) {
+            const QString member(aJson->name());
+            token = aJson->next();
+            if (member == CONFIG_NAME && token == BackupJson::Reader::Value) {
+                name = aJson->value().toString();
+            } else if (member == CONFIG_VALUE) {
+                value = aJson->readValue(token);
+            } else if (!aJson->skipValue(token)) {
+                return false;
+            }
+        }
+        if (token != BackupJson::Reader::EndObject) {
+            return false;
+        } else if (aPrefix.isEmpty() ? (name.startsWith('/') && !name.endsWith('/')) :
+            (!name.startsWith('/') && !name.endsWith('/'))) {
+            restoreKey(aChanges, aPrefix + name, value);
+        } else {
+            HWARN("Ignoring configuration key" << name);
+        }
+    }
+    return true;
+}
+
+bool Backup::Import::restoreJson(ConfigClient::Changeset* aChanges,
+    ConfigClient aClient, const QString aFile)
+{
+    // A missing file is not an error, there's just nothing to restore
+    BackupJson::Reader json(aFile);
+    if (!json.isOpen()) {
+        HDEBUG("No" << qPrintable(aFile));
+        return true;
+    }
+    BackupJson::Reader::Token token = json.next();
+    while ((token = json.next()) == BackupJson::Reader::Name) {
+        const QString member(json.name());
+        token = json.next();
+        if (member == CONFIG_GROUPS) {
+            if (!parseGroups(&json, token, aChanges, aClient, QString())) {
+                break;
+            }
+        } else if (member == CONFIG_KEYS) {
+            if (!parseKeys(&json, token, aChanges, QString())) {
+                break;
+            }
+        } else if (!json.skipValue(token)) {
+            break;
+        }
+    }
+    if (token == BackupJson::Reader::EndObject) {
+        return true;
+    } else {
+        HWARN("Failed to parse" << qPrintable(aFile));
+        return false;
+    }
+}
+
+bool Backup::Import::restoreValues(ConfigClient::Changeset* aChanges,
+    ConfigClient aClient, const QString aFile)
+{
+    // The file is mapped, values are fed to the changeset as they are
+    const QByteArray path(aFile.toLocal8Bit());
+    GMappedFile* map = g_mapped_file_new(path.constData(), FALSE, NULL);
+    if (!map) {
+        return false;
+    }
+
+    GBytes* bytes = g_mapped_file_get_bytes(map);
+    GVariant* dict = g_variant_ref_sink(g_variant_new_from_bytes
+        (G_VARIANT_TYPE_VARDICT, bytes, FALSE));
+    if (G_BYTE_ORDER != G_LITTLE_ENDIAN) {
+        GVariant* swapped = g_variant_byteswap(dict);
+        g_variant_unref(dict);
+        dict = swapped;
+    }
+    HDEBUG(g_variant_n_children(dict) << "entries in" << path.constData());
+
+    // Group resets go first, then the values
+    GVariantIter it;
+    const char* key;
+    GVariant* value;
+    g_variant_iter_init(&it, dict);
+    while (g_variant_iter_next(&it, "{&sv}", &key, &value)) {
+        if (g_str_has_suffix(key, "/")) {
+            aClient.resetGroup(QString::fromUtf8(key), aChanges);
+        }
+        g_variant_unref(value);
+    }
+    g_variant_iter_init(&it, dict);
+    while (g_variant_iter_next(&it, "{&sv}", &key, &value)) {
+        if (!g_str_has_suffix(key, "/")) {
+            aChanges->setValue(QString::fromUtf8(key), value);
+        }
+        g_variant_unref(value);
+    }
+    g_variant_unref(dict);
+    g_bytes_unref(bytes);
+    g_mapped_file_unref(map);
+    return true;
+}
+
+bool Backup::Import::restoreArchivedValues(ConfigClient::Changeset* aChanges,
+    ConfigClient aClient, const QString aBackupRoot)
+{
+    QTemporaryFile tmp;
+    if (tmp.open()) {
+        BackupArchive::Reader archive(Private::backupArchive(aBackupRoot));
+        tmp.close();
+        return archive.extractFile(CONFIG_VALUES_STORE.toLocal8Bit(),
+            tmp.fileName()) && restoreValues(aChanges, aClient,
+            tmp.fileName());
+    }
+    return false;
+}
+
+bool Backup::Import::restoreConfig(const QString aBackupRoot,
+    const QStringList aList, const Options& aOptions)
+{
+    ConfigClient dconf(ConfigClient::create());
+    ConfigClient::Changeset changes;
+    const bool archive = (Private::storageMode(aBackupRoot, aOptions) ==
+        Private::StoreArchive);
+    if (!(archive ? restoreArchivedValues(&changes, dconf, aBackupRoot) :
+        restoreValues(&changes, dconf, Private::backupConfigValues(aBackupRoot)))) {
+        // No binary store, fall back to config.json. Nothing is restored
+        // if it turns out to be broken.
+        if (archive) {
+            // Extract the file from the archive first
+            QTemporaryFile tmp;
+            if (!tmp.open()) {
+                return false;
+            }
+            BackupArchive::Reader reader(Private::backupArchive(aBackupRoot));
+            tmp.close();
+            if (reader.extractFile(CONFIG_STORE.toLocal8Bit(), tmp.fileName()) &&
+                !restoreJson(&changes, dconf, tmp.fileName())) {
+                return false;
+            }
+        } else if (!restoreJson(&changes, dconf,
+            Private::backupConfigStore(aBackupRoot))) {
+            return false;
+        }
+    }
+
+    // Everything is written in one transaction, skipping the keys
+    // which already have the right values
+    BackupProgress progress(aOptions.iProgressFd);
+    int written = 0, reset = 0;
+    dconf.reduce(&changes, &written, &reset);
+    HDEBUG(written << "key(s) to write," << reset << "to reset");
+    progress.configRestored(written, reset);
+    if (!changes.isEmpty()) {
+        const bool ok = dconf.apply(changes);
+        dconf.sync();
+        return ok;
+    }
+    return true;
+}
+
+void Backup::Import::loadBackupList(BackupList* aList,
+    const QString aBackupRoot, const QString aConfigFileRel,
+    const Options& aOptions)
+{
+    const Private::StorageMode mode(Private::storageMode(aBackupRoot, aOptions));
+    const bool chunks = (mode == Private::StoreChunks);
+    const QString file(QFileInfo(Private::backupDataDir(aBackupRoot, mode,
+        aOptions), aConfigFileRel).absoluteFilePath());
+    if (mode == Private::StoreArchive) {
+        QTemporaryFile tmp;
+        if (tmp.open()) {
+            BackupArchive::Reader archive(Private::backupArchive(aBackupRoot));
+            tmp.close();
+            if (archive.extractFile(FILES_DIR.toLocal8Bit() + '/' +
+                QDir::cleanPath(aConfigFileRel).toLocal8Bit(), tmp.fileName())) {
+                aList->load(tmp.fileName());
+            }
+        }
+    } else if (chunks) {
+        // Reassemble the file first
+        QTemporaryFile tmp;
+        if (tmp.open()) {
+            const QByteArray tmpPath(tmp.fileName().toLocal8Bit());
+            BackupChunkStore store(Private::backupChunksDir(aBackupRoot));
+            tmp.close();
+            if (store.restoreFile(AT_FDCWD, tmpPath.constData(),
+                AT_FDCWD, file.toLocal8Bit().constData(), Q_NULLPTR)) {
+                aList->load(tmp.fileName());
+            }
+        }
+    } else {
+        aList->load(file);
+    }
+}
+
+bool Backup::Import::restore(const QString aHome, const QString aBackupRoot,
+    const QStringList aFileList, const QStringList aConfigList,
+    const Options& aOptions)
+{
+    // dconf is written through the service while the files are restored
+    ConfigPhase config(aBackupRoot, aConfigList, aOptions);
+    config.start(aOptions.iSequential);
+
+    HDEBUG("Restoring files" << aBackupRoot << "=>" << aHome);
+    bool ok;
+    const Private::StorageMode mode(Private::storageMode(aBackupRoot, aOptions));
+    const bool chunks = (mode == Private::StoreChunks);
+    QDir backupDir(Private::backupDataDir(aBackupRoot, mode, aOptions));
+    const QByteArray exPath((mode != Private::StoreFiles) ?
+        QDir(Private::backupUserRoot(aBackupRoot)).absolutePath().toLocal8Bit() :
+        backupDir.absolutePath().toLocal8Bit());
+    if (mode == Private::StoreArchive) {
+        // Stream the selected entries out of the archive. The sizes
+        // aren't known upfront, only the progress is reported.
+        BackupArchive::Reader archive(Private::backupArchive(aBackupRoot));
+        BackupProgress progress(aOptions.iProgressFd);
+        int failures = 0;
+        progress.start();
+        const int count = archive.extract(FILES_DIR.toLocal8Bit(), aHome,
+            aFileList, exPath.constData(), &progress, &failures);
+        HDEBUG("Extracted" << count << "file(s)");
+        progress.finish();
+        ok = archive.isOpen() && !failures;
+        if (failures) {
+            HWARN(failures << "file(s) failed");
+        }
+    } else {
+        BackupChunkStore chunkStore(Private::backupChunksDir(aBackupRoot));
+        BackupProgress progress(aOptions.iProgressFd);
+        Private files(aOptions, exPath.constData(), Q_NULLPTR);
+        if (chunks) {
+            files.iChunkStore = &chunkStore;
+            files.iRestoreChunks = true;
+        } else if (mode == Private::StoreSnapshots) {
+            // The manifest isn't part of the backed up data
+            files.iSrcExcludes.addDir(backupDir.absoluteFilePath
+                (SNAPSHOT_MANIFEST).toLocal8Bit());
+        }
+        if (progress.isEnabled()) {
+            files.iProgress = &progress;
+            files.scanFiles(backupDir, aFileList);
+            progress.start();
+        }
+        files.copyFiles(QDir(aHome), backupDir, aFileList);
+        progress.finish();
+        ok = !files.iFailures;
+        if (!ok) {
+            HWARN(files.iFailures << "file(s) failed");
+        }
+    }
+
+    // Single completion point for both phases
+    const bool configOk = config.wait();
+    return ok && configOk;
+}
+
+// ==========================================================================
+// Backup::Export
+// ==========================================================================
+
+class Backup::Export {
+public:
+    class ConfigPhase;
+    class GroupWriter;
+    class Recording;
+    class SnapshotJob;
+
+    static const int MAX_CONFIG_JOBS = 4;
+
+    static void storeConfig(BackupJson::Writer* aJson, const QStringList aConfigList,
+        GVariantBuilder* aValues, int aJobs);
+    static bool saveValues(const QString aFile, GVariant* aValues);
+    static bool saveConfig(const QString aJsonFile, const QString aValuesFile,
+        const QStringList aConfigList, int aJobs);
+    static bool commitSnapshot(const QString aBackupRoot,
+        const QString aName, int aKeep);
+    static bool backup(const QString aHome, const QString aBackupRoot,
+        const QStringList aFileList, const QStringList aConfigList,
+        const QStringList aExcludes, const Options& aOptions);
+};
+
+// Writes config.json while the dconf snapshot is being taken. Keys of
+// each group come before its subgroups. Empty groups are omitted, so a
+// group is only opened when something actually gets written into it.
+class Backup::Export::GroupWriter : public ConfigClient::Visitor {
+public:
+    GroupWriter(BackupJson::Writer* aJson, GVariantBuilder* aValues);
+
+    void beginGroup(const QString aPath) Q_DECL_OVERRIDE;
+    void endGroup(const QString aPath) Q_DECL_OVERRIDE;
+    void key(const QString aPath, GVariant* aValue) Q_DECL_OVERRIDE;
+    void finish();
+
+private:
+    struct Group {
+        Group(const QString aPath, const QString aName) :
+            iPath(aPath), iName(aName), iOpen(false), iArray(NULL) {}
+        QString iPath;
+        QString iName;
+        bool iOpen;
+        const QString* iArray; // Currently open array member
+    };
+
+    void open(int aIndex);
+    void openArray(Group* aGroup, const QString* aArray);
+    void close(Group* aGroup);
+
+private:
+    BackupJson::Writer* iJson;
+    GVariantBuilder* iValues;
+    QList<Group> iStack; // The first one is the root object
+};
+
+Backup::Export::GroupWriter::GroupWriter(BackupJson::Writer* aJson,
+    GVariantBuilder* aValues) :
+    iJson(aJson),
+    iValues(aValues)
+{
+    iStack.append(Group(QString(), QString()));
+    iStack.last().iOpen = true;
+    iJson->beginObject();
+}
+
+void Backup::Export::GroupWriter::open(int aIndex)
+{
+    Group& group = iStack[aIndex];
+    if (!group.iOpen) {
+        open(aIndex - 1);
+        openArray(&iStack[aIndex - 1], &CONFIG_GROUPS);
+        iJson->beginObject();
+        iJson->name(CONFIG_NAME);
+        iJson->value(group.iName);
+        group.iOpen = true;
+        if (aIndex == 1) {
+            // This is the group to be reset on restore. Empty groups
+            // are left alone, same as they are by config.json
+            g_variant_builder_add(iValues, "{sv}",
+                group.iPath.toUtf8().constData(), g_variant_new_tuple(NULL, 0));
+        }
+    }
+}
+
+void Backup::Export::GroupWriter::openArray(Group* aGroup,
+    const QString* aArray)
+{
+    if (aGroup->iArray != aArray) {
+        if (aGroup->iArray) {
+            iJson->endArray();
+        }
+        iJson->name(*aArray);
+        iJson->beginArray();
+        aGroup->iArray = aArray;
+    }
+}
+
+void Backup::Export::GroupWriter::close(Group* aGroup)
+{
+    if (aGroup->iOpen) {
+        if (aGroup->iArray) {
+            iJson->endArray();
+        }
+        iJson->endObject();
+    }
+}
+
+void Backup::Export::GroupWriter::beginGroup(const QString aPath)
+{
+    // Top level group names are absolute, subgroups are relative
+    const bool top = (iStack.count() == 1);
+    iStack.append(Group(aPath, top ? aPath :
+        aPath.mid(iStack.last().iPath.length())));
+    HDEBUG("Group" << aPath);
+}
+
+void Backup::Export::GroupWriter::endGroup(const QString)
+{
+    close(&iStack.last());
+    iStack.removeLast();
+}
+
+void Backup::Export::GroupWriter::key(const QString aPath, GVariant* aValue)
+{
+    const QVariant value(ConfigClient::toVariant(aValue));
+    const int top = iStack.count() - 1;
+    if (value.isValid()) {
+        // Opening the top level group also marks it for reset
+        open(top);
+    }
+    g_variant_builder_add(iValues, "{sv}", aPath.toUtf8().constData(), aValue);
+    if (value.isValid()) {
+        Group& group = iStack[top];
+        openArray(&group, &CONFIG_KEYS);
+        iJson->beginObject();
+        iJson->name(CONFIG_NAME);
+        iJson->value(aPath.mid(group.iPath.length()));
+        iJson->name(CONFIG_VALUE);
+        iJson->value(value);
+        iJson->endObject();
+        HDEBUG(aPath << "=" << value);
+    }
+}
+
+void Backup::Export::GroupWriter::finish()
+{
+    close(&iStack.first());
+    iStack.clear();
+}
+
+// Snapshot of the dconf entries taken on a worker thread and then
+// replayed on the thread writing config.json
+class Backup::Export::Recording : public ConfigClient::Visitor {
+public:
+    Recording(const QStringList aPaths);
+    ~Recording();
+
+    void beginGroup(const QString aPath) Q_DECL_OVERRIDE;
+    void endGroup(const QString aPath) Q_DECL_OVERRIDE;
+    void key(const QString aPath, GVariant* aValue) Q_DECL_OVERRIDE;
+
+    void record();
+    void replay(ConfigClient::Visitor* aVisitor);
+
+private:
+    struct Event {
+        Event(const QString aPath, GVariant* aValue) :
+            iPath(aPath), iValue(aValue) {}
+        QString iPath; // Group if ends with slash
+        GVariant* iValue; // NULL for groups
+    };
+
+    void clear();
+
+private:
+    const QStringList iPaths; // Groups (recursively) or keys
+    QList<Event> iEvents;
+    QMutex iMutex;
+    QWaitCondition iDone;
+    bool iRecorded;
+};
+
+Backup::Export::Recording::Recording(const QStringList aPaths) :
+    iPaths(aPaths),
+    iRecorded(false)
+{
+}
+
+Backup::Export::Recording::~Recording()
+{
+    clear();
+}
+
+void Backup::Export::Recording::clear()
+{
+    const int n = iEvents.count();
+    for (int i = 0; i < n; i++) {
+        if (iEvents.at(i).iValue) {
+            g_variant_unref(iEvents.at(i).iValue);
+        }
+    }
+    iEvents.clear();
+}
+
+void Backup::Export::Recording::beginGroup(const QString aPath)
+{
+    iEvents.append(Event(aPath, NULL));
+}
+
+void Backup::Export::Recording::endGroup(const QString)
+{
+    iEvents.append(Event(QString(), NULL));
+}
+
+void Backup::Export::Recording::key(const QString aPath, GVariant* aValue)
+{
+    iEvents.append(Event(aPath, g_variant_ref(aValue)));
+}
+
+void Backup::Export::Recording::record()
+{
+    // Each recording reads dconf through its own client
+    ConfigClient dconf(ConfigClient::create());
+    const int n = iPaths.count();
+    for (int i = 0; i < n; i++) {
+        const QString path(iPaths.at(i));
+        if (path.endsWith('/')) {
+            dconf.snapshot(path, this);
+        } else {
+            GVariant* value = dconf.readValue(path);
+            if (value) {
+                key(path, value);
+                g_variant_unref(value);
+            } else {
+                HDEBUG(path << "doesn't exist");
+            }
+        }
+    }
+    QMutexLocker lock(&iMutex);
+    iRecorded = true;
+    iDone.wakeAll();
+}
+
+void Backup::Export::Recording::replay(ConfigClient::Visitor* aVisitor)
+{
+    iMutex.lock();
+    while (!iRecorded) {
+        iDone.wait(&iMutex);
+    }
+    iMutex.unlock();
+
+    // Group paths are only needed by beginGroup, keep track of them
+    QStringList groups;
+    const int n = iEvents.count();
+    for (int i = 0; i < n; i++) {
+        const Event& event = iEvents.at(i);
+        if (event.iValue) {
+            aVisitor->key(event.iPath, event.iValue);
+        } else if (!event.iPath.isEmpty()) {
+            groups.append(event.iPath);
+            aVisitor->beginGroup(event.iPath);
+        } else {
+            aVisitor->endGroup(groups.takeLast());
+        }
+    }
+    clear();
+}
+
+class Backup::Export::SnapshotJob : public BackupCopyEngine::Job {
+public:
+    SnapshotJob(Recording* aRecording) : iRecording(aRecording) {}
+    void run() Q_DECL_OVERRIDE { iRecording->record(); }
+
+private:
+    Recording* iRecording;
+};
+
+void Backup::Export::storeConfig(BackupJson::Writer* aJson,
+    const QStringList aConfigList, GVariantBuilder* aValues, int aJobs)
+{
+    // Top level groups are split into their own keys and subgroups.
+    // Those are read in parallel and then written in the original order,
+    // groups first, then the individual keys (each array is written once).
+    // A negative recording index marks the beginning or the end of the
+    // top level group.
+    struct Step {
+        Step(int aRecording, const QString aGroup = QString()) :
+            iRecording(aRecording), iGroup(aGroup) {}
+        int iRecording;
+        QString iGroup;
+    };
+
+    QList<Step> steps;
+    QList<Recording*> recordings;
+    QStringList keys;
+    ConfigClient dconf(ConfigClient::create());
+    const int n = aConfigList.count();
+    for (int i = 0; i < n; i++) {
+        const QString name(aConfigList.at(i));
+        if (!name.startsWith('/')) {
+            HWARN("Ignoring configuration entry" << name);
+        } else if (name.endsWith('/')) {
+            const QStringList entries(dconf.list(name));
+            const int k = entries.count();
+            QStringList groupKeys;
+            steps.append(Step(-1, name));
+            for (int j = 0; j < k; j++) {
+                const QString entry(entries.at(j));
+                if (!entry.endsWith('/')) {
+                    groupKeys.append(name + entry);
+                }
+            }
+            if (!groupKeys.isEmpty()) {
+                steps.append(Step(recordings.count()));
+                recordings.append(new Recording(groupKeys));
+            }
+            for (int j = 0; j < k; j++) {
+                const QString entry(entries.at(j));
+                if (entry.endsWith('/')) {
+                    steps.append(Step(recordings.count()));
+                    recordings.append(new Recording(QStringList(name + entry)));
+                }
+            }
+            steps.append(Step(-1, name));
+        } else {
+            keys.append(name);
+        }
+    }
+    if (!keys.isEmpty()) {
+        steps.append(Step(recordings.count()));
+        recordings.append(new Recording(keys));
+    }
+
+    // Only a few recordings are kept ahead of the writer
+    int jobs = (aJobs > 0) ? aJobs : BackupCopyEngine::defaultJobs();
+    if (jobs > MAX_CONFIG_JOBS) {
+        jobs = MAX_CONFIG_JOBS;
+    }
+    BackupCopyEngine engine(jobs);
+    const int ahead = 2 * engine.jobs();
+    const int total = recordings.count();
+    int submitted = 0;
+    bool inGroup = false;
+    GroupWriter writer(aJson, aValues);
+    for (int i = 0; i < steps.count(); i++) {
+        const Step& step = steps.at(i);
+        if (step.iRecording >= 0) {
+            while (submitted < total && submitted <= step.iRecording + ahead) {
+                engine.submit(new SnapshotJob(recordings.at(submitted++)));
+            }
+            recordings.at(step.iRecording)->replay(&writer);
+        } else if (!inGroup) {
+            inGroup = true;
+            writer.beginGroup(step.iGroup);
+        } else {
+            inGroup = false;
+            writer.endGroup(step.iGroup);
+        }
+    }
+    engine.finish();
+    writer.finish();
+    qDeleteAll(recordings);
+}
+
+bool Backup::Export::saveValues(const QString aFile, GVariant* aValues)
+{
+    GVariant* data = (G_BYTE_ORDER == G_LITTLE_ENDIAN) ?
+        g_variant_ref(aValues) : g_variant_byteswap(aValues);
+    const QByteArray path(aFile.toLocal8Bit());
+    GError* error = NULL;
+    const bool ok = g_file_set_contents(path.constData(),
+        (const char*)g_variant_get_data(data), g_variant_get_size(data),
+        &error);
+    if (!ok) {
+        HWARN(error->message);
+        g_error_free(error);
+    }
+    g_variant_unref(data);
+    return ok;
+}
+
+bool Backup::Export::saveConfig(const QString aJsonFile,
+    const QString aValuesFile, const QStringList aConfigList, int aJobs)
+{
+    HDEBUG("Writing" << qPrintable(aJsonFile));
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    BackupJson::Writer json(aJsonFile);
+    storeConfig(&json, aConfigList, &builder, aJobs);
+    const bool jsonOk = json.finish();
+    GVariant* values = g_variant_ref_sink(g_variant_builder_end(&builder));
+    const bool valuesOk = saveValues(aValuesFile, values);
+    g_variant_unref(values);
+    return jsonOk && valuesOk;
+}
+
+// In archive mode the configuration is saved to temporary files, which
+// are added to the archive after the files
+class Backup::Export::ConfigPhase : public Phase {
+public:
+    ConfigPhase(const QString aBackupRoot, const QStringList aConfigList,
+        bool aArchive, int aJobs);
+
+    bool addTo(BackupArchive::Writer* aArchive);
+
+protected:
+    bool run() Q_DECL_OVERRIDE;
+
+private:
+    const QString iBackupRoot;
+    const QStringList iConfigList;
+    const int iJobs;
+    QString iJsonFile;
+    QString iValuesFile;
+    QTemporaryFile iJsonTmp;
+    QTemporaryFile iValuesTmp;
+};
+
+Backup::Export::ConfigPhase::ConfigPhase(const QString aBackupRoot,
+    const QStringList aConfigList, bool aArchive, int aJobs) :
+    iBackupRoot(aBackupRoot),
+    iConfigList(aConfigList),
+    iJobs(aJobs)
+{
+    if (!aArchive) {
+        iJsonFile = Private::backupConfigStore(aBackupRoot);
+        iValuesFile = Private::backupConfigValues(aBackupRoot);
+    } else if (iJsonTmp.open() && iValuesTmp.open()) {
+        iJsonFile = iJsonTmp.fileName();
+        iValuesFile = iValuesTmp.fileName();
+        iJsonTmp.close();
+        iValuesTmp.close();
+    }
+}
+
+bool Backup::Export::ConfigPhase::run()
+{
+    return !iJsonFile.isEmpty() &&
+        saveConfig(iJsonFile, iValuesFile, iConfigList, iJobs);
+}
+
+bool Backup::Export::ConfigPhase::addTo(BackupArchive::Writer* aArchive)
+{
+    const QByteArray json(iJsonFile.toLocal8Bit());
+    const QByteArray values(iValuesFile.toLocal8Bit());
+    return aArchive->addFile(CONFIG_STORE.toLocal8Bit(), AT_FDCWD,
+        json.constData(), Q_NULLPTR) &&
+        aArchive->addFile(CONFIG_VALUES_STORE.toLocal8Bit(), AT_FDCWD,
+        values.constData(), Q_NULLPTR);
+}
+
+bool Backup::Export::commitSnapshot(const QString aBackupRoot,
+    const QString aName, int aKeep)
+{
+    bool ok = false;
+    const QByteArray dir(Private::backupSnapshotsDir(aBackupRoot).
+        toLocal8Bit());
+    const int fd = open(dir.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        const QByteArray name(aName.toLocal8Bit());
+        const QByteArray partial(DOT.toLatin1() + name);
+        if (!renameat(fd, partial.constData(), fd, name.constData())) {
+            HDEBUG("Created snapshot" << name.constData());
+            ok = true;
+
+            // Prune the old ones
+            const QStringList snapshots(Private::backupSnapshots(aBackupRoot));
+            const int n = snapshots.count() - aKeep;
+            for (int i = 0; i < n; i++) {
+                const QByteArray old(snapshots.at(i).toLocal8Bit());
+                HDEBUG("Removing snapshot" << old.constData());
+                Private::removeTree(fd, old.constData());
+            }
+        } else {
+            // The old snapshots stay, this one is of no use
+            HWARN("Failed to rename" << partial.constData() << ":" <<
+                strerror(errno));
+            Private::removeTree(fd, partial.constData());
+        }
+        close(fd);
+    } else {
+        HWARN("Failed to open" << dir.constData() << ":" << strerror(errno));
+    }
+    return ok;
+}
+
+bool Backup::Export::backup(const QString aHome, const QString aBackupRoot,
+    const QStringList aFileList, const QStringList aConfigList,
+    const QStringList aExcludes, const Options& aOptions)
+{
+    HDEBUG("Backing up files" << aHome << "=>" << aBackupRoot);
+    const bool archive = aOptions.iArchive;
+    const bool chunks = aOptions.iChunks && !archive;
+    const bool snapshots = aOptions.iSnapshots > 0 && !chunks && !archive;
+    const bool delta = aOptions.iDelta && !chunks && !archive && !snapshots;
+    QDir backupDir(Private::backupDataDir(aBackupRoot, chunks ?
+        Private::StoreChunks : Private::StoreFiles, aOptions));
+    QDir snapshotsDir(Private::backupSnapshotsDir(aBackupRoot));
+    QString snapshot;
+    if (snapshots) {
+        // The new snapshot stays hidden until it's complete
+        const QStringList existing(Private::backupSnapshots(aBackupRoot));
+        const QString now(QDateTime::currentDateTimeUtc().
+            toString(SNAPSHOT_NAME_FORMAT));
+        snapshot = now;
+        for (int i = 1; existing.contains(snapshot); i++) {
+            snapshot = now + QChar('-') + QString::number(i);
+        }
+        const QString partial(DOT + snapshot);
+        snapshotsDir.mkpath(partial);
+        backupDir = QDir(snapshotsDir.filePath(partial));
+    }
+    const QByteArray destPath(backupDir.absolutePath().toLocal8Bit());
+    // Chunks and recipes (or the archive, or the snapshots) are all
+    // under the user root
+    const QByteArray exPath((chunks || archive || snapshots || delta) ?
+        QDir(Private::backupUserRoot(aBackupRoot)).absolutePath().toLocal8Bit() :
+        destPath);
+
+    // dconf is read while the files are being scanned and copied
+    ConfigPhase config(aBackupRoot, aConfigList, archive, aOptions.iJobs);
+    config.start(aOptions.iSequential);
+
+    bool ok;
+    BackupProgress progress(aOptions.iProgressFd);
+    Private files(aOptions, Q_NULLPTR, exPath.constData());
+    files.iSrcExcludes.addPatterns(QDir(aHome).absolutePath().toLocal8Bit(),
+        aExcludes);
+    files.setDestRoot(destPath.constData());
+    if (progress.isEnabled()) {
+        files.iProgress = &progress;
+        files.scanFiles(QDir(aHome), aFileList);
+        progress.start();
+    }
+    if (archive) {
+        // The archive is rewritten from scratch, no need for the manifest
+        BackupArchive::Writer writer(Private::backupArchive(aBackupRoot),
+            aOptions.iCompression);
+        if (writer.isOpen()) {
+            files.iArchive = &writer;
+            files.copyFiles(backupDir, QDir(aHome), aFileList);
+            files.iArchive = Q_NULLPTR;
+            progress.finish();
+            // An archive without the configuration would replace the
+            // previous good one, the writer discards it if not finished
+            ok = config.wait() && config.addTo(&writer);
+            if (!ok) {
+                HWARN("Keeping the old archive");
+            } else if (writer.finish()) {
+                Private::saveStorageMode(aBackupRoot, Private::StoreArchive);
+            } else {
+                ok = false;
+            }
+        } else {
+            config.wait();
+            ok = false;
+        }
+    } else {
+        const Private::StorageMode mode(chunks ? Private::StoreChunks :
+            snapshots ? Private::StoreSnapshots : Private::StoreFiles);
+        BackupManifest manifest;
+        BackupChunkStore chunkStore(Private::backupChunksDir(aBackupRoot));
+        BackupDelta deltas(Private::backupSignaturesDir(aBackupRoot));
+        files.iManifest = &manifest;
+        if (chunks) {
+            files.iChunkStore = &chunkStore;
+        } else if (delta) {
+            files.iDelta = &deltas;
+        }
+        if (snapshots) {
+            // Unchanged files are shared with the latest snapshot, which
+            // is described by its own manifest. The first one has nothing
+            // to share.
+            const QStringList existing(Private::backupSnapshots(aBackupRoot));
+            files.iSnapshot = true;
+            if (!existing.isEmpty()) {
+                const QByteArray prev(snapshotsDir.filePath(existing.last()).
+                    toLocal8Bit());
+                files.iLinkDestFd = open(prev.constData(), O_RDONLY |
+                    O_DIRECTORY | O_CLOEXEC);
+                if (files.iLinkDestFd >= 0) {
+                    HDEBUG("Previous snapshot" << prev.constData());
+                    manifest.load(Private::backupManifest(aBackupRoot,
+                        mode, existing.last()));
+                }
+            }
+        } else {
+            manifest.load(Private::backupManifest(aBackupRoot, mode,
+                QString()));
+        }
+        files.copyFiles(backupDir, QDir(aHome), aFileList);
+        progress.finish();
+        if (files.iLinkDestFd >= 0) {
+            close(files.iLinkDestFd);
+            files.iLinkDestFd = -1;
+        }
+        if (snapshots) {
+            // Only a published snapshot gets its manifest
+            ok = commitSnapshot(aBackupRoot, snapshot, aOptions.iSnapshots);
+            if (ok) {
+                Private::saveStorageMode(aBackupRoot, mode);
+                ok = files.iNewManifest.save(Private::backupManifest
+                    (aBackupRoot, mode, snapshot));
+            }
+        } else {
+            Private::saveStorageMode(aBackupRoot, mode);
+            ok = files.iNewManifest.save(Private::backupManifest(aBackupRoot,
+                mode, QString()));
+        }
+        ok = config.wait() && ok;
+        if (chunks && ok && !files.iFailures) {
+            // Chunks of the files that have changed or gone away are
+            // no longer referenced by anything
+            chunkStore.sweep(backupDir.absolutePath());
+        }
+    }
+
+    // Single completion point for both phases
+    if (files.iFailures) {
+        HWARN(files.iFailures << "file(s) failed");
+        ok = false;
+    }
+    return ok;
+}
+
+// ==========================================================================
+// Backup::Estimate
+// ==========================================================================
+
+class Backup::Estimate {
+public:
+    enum {
+        SAMPLE_SIZE = 16 * 1024 * 1024,
+        SAMPLE_BUF_SIZE = 128 * 1024
+    };
+
+    static quint64 measureThroughput(const QByteArray aFile);
+    static qint64 estimateTime(quint64 aBytes, quint64 aRate);
+    static void estimate(const QString aHome, const QString aBackupRoot,
+        const BackupList* aList, const QString aExtraPath,
+        const Options& aOptions);
+};
+
+quint64 Backup::Estimate::measureThroughput(const QByteArray aFile)
+{
+    // Read the beginning of the file bypassing the page cache (as much
+    // as possible) and see how long it takes. Nothing gets written, so
+    // it's the read speed that's being measured.
+    quint64 rate = 0;
+    const int fd = open(aFile.constData(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        char* buf = (char*)g_malloc(SAMPLE_BUF_SIZE);
+        quint64 total = 0;
+        ssize_t n;
+        posix_fadvise(fd, 0, SAMPLE_SIZE, POSIX_FADV_DONTNEED);
+        posix_fadvise(fd, 0, SAMPLE_SIZE, POSIX_FADV_SEQUENTIAL);
+        const gint64 start = g_get_monotonic_time();
+        while (total < SAMPLE_SIZE &&
+            (n = read(fd, buf, SAMPLE_BUF_SIZE)) > 0) {
+            total += n;
+        }
+        const gint64 usec = g_get_monotonic_time() - start;
+        if (total && usec > 0) {
+            rate = total * G_USEC_PER_SEC / usec;
+        }
+        HDEBUG(total << "bytes in" << usec << "us from" << aFile.constData());
+        g_free(buf);
+        close(fd);
+    }
+    return rate;
+}
+
+qint64 Backup::Estimate::estimateTime(quint64 aBytes, quint64 aRate)
+{
+    return aRate ? (qint64)((aBytes + aRate - 1) / aRate) : aBytes ? -1 : 0;
+}
+
+void Backup::Estimate::estimate(const QString aHome, const QString aBackupRoot,
+    const BackupList* aList, const QString aExtraPath,
+    const Options& aOptions)
+{
+    // The backup directory (if any) is excluded, the same way as by export
+    const QByteArray exPath(aBackupRoot.isEmpty() ? QByteArray() :
+        QDir(Private::backupUserRoot(aBackupRoot)).absolutePath().toLocal8Bit());
+    Private files(aOptions, Q_NULLPTR, exPath.isEmpty() ? Q_NULLPTR :
+        exPath.constData());
+    files.iSrcExcludes.addPatterns(QDir(aHome).absolutePath().toLocal8Bit(),
+        Private::excludeList(aList, aOptions));
+
+    // Scan each unique entry once, all in parallel
+    const QDir home(aHome);
+    const QStringList entries(aList->backupFileList(aExtraPath));
+    QHash<QString,Private::Totals*> scanned;
+    const int n = entries.count();
+    for (int i = 0; i < n; i++) {
+        Private::Totals* totals = new Private::Totals;
+        scanned.insert(entries.at(i), totals);
+        files.scanEntry(home, entries.at(i), totals);
+    }
+    files.iEngine.finish();
+
+    // Measure throughput on the largest file
+    Private::Totals all;
+    for (int i = 0; i < n; i++) {
+        all.add(*scanned.value(entries.at(i)));
+    }
+    const quint64 rate = all.iLargestFile.isEmpty() ? 0 :
+        measureThroughput(all.iLargestFile);
+
+    // Per item
+    const int k = aList->count();
+    for (int i = 0; i < k; i++) {
+        const BackupList::Item* item = aList->itemAt(i);
+        const QStringList paths(item->pathList());
+        quint64 itemFiles = 0, itemBytes = 0;
+        for (int j = 0; j < paths.count(); j++) {
+            const Private::Totals* totals = scanned.value
+                (BackupUtil::relativeToHome(paths.at(j)));
+            if (totals) {
+                itemFiles += totals->iFiles;
+                itemBytes += totals->iBytes;
+            }
+        }
+        printf("item %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+            " %" G_GINT64_FORMAT " %s\n", (guint64)itemFiles,
+            (guint64)itemBytes, (gint64)estimateTime(itemBytes, rate),
+            qPrintable(item->path()));
+    }
+    printf("total %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+        " %" G_GINT64_FORMAT "\n", (guint64)all.iFiles,
+        (guint64)all.iBytes, (gint64)estimateTime(all.iBytes, rate));
+    printf("throughput %" G_GUINT64_FORMAT "\n", (guint64)rate);
+    fflush(stdout);
+    qDeleteAll(scanned);
+}
+
+// ==========================================================================
+// Backup::Options
+// ==========================================================================
+
+Backup::Options::Options() :
+    iJobs(0),
+    iReadAhead(0),
+    iChunks(false),
+    iArchive(false),
+    iCompression(6),
+    iProgressFd(-1),
+    iSnapshots(0),
+    iSnapshot(Q_NULLPTR),
+    iDelta(false),
+    iSequential(false),
+    iExcludes(Q_NULLPTR)
+{
+}
+
+// ==========================================================================
+// Backup
+// ==========================================================================
+
+bool Backup::run(Action aAction, const char* aHome, const char* aBackupRoot,
+    const Options& aOptions)
+{
+    const QString configDir(BackupList::configDir() + QDir::separator());
     const QString configFile(BackupList::defaultConfigFile());
     const QString configDirRel(BackupUtil::relativeToHome(configDir));
     const QString configFileRel(BackupUtil::relativeToHome(configFile));
     BackupList backup;
+    bool ok = true;
     switch (aAction) {
     case ImportAction:
         // Load backup configuration from the backup
-        backup.load(QFileInfo(Private::backupFilesDir(aBackupRoot),
-            configFileRel).absoluteFilePath());
-        Import::restore(QString::fromLocal8Bit(aHome),
+        Import::loadBackupList(&backup, QString::fromLocal8Bit(aBackupRoot),
+            configFileRel, aOptions);
+        ok = Import::restore(QString::fromLocal8Bit(aHome),
             QString::fromLocal8Bit(aBackupRoot),
             backup.backupFileList(configDirRel),
-            backup.backupConfigList(QString()));
+            backup.backupConfigList(QString()), aOptions);
         backup.updateLastRestore();
         backup.save(configFile);
         break;
@@ -583,13 +2710,21 @@ int Backup::run(Action aAction, const char* aHome, const char* aBackupRoot)
         backup.load(configFile);
         backup.updateLastBackup();
         backup.save(configFile);
-        Export::backup(QString::fromLocal8Bit(aHome),
+        ok = Export::backup(QString::fromLocal8Bit(aHome),
             QString::fromLocal8Bit(aBackupRoot),
             backup.backupFileList(configDirRel),
-            backup.backupConfigList(QString()));
+            backup.backupConfigList(QString()),
+            Private::excludeList(&backup, aOptions), aOptions);
+        break;
+    case EstimateAction:
+        // Nothing is written, not even the last backup time
+        backup.load(configFile);
+        Estimate::estimate(QString::fromLocal8Bit(aHome),
+            QString::fromLocal8Bit(aBackupRoot), &backup, configDirRel,
+            aOptions);
         break;
     case NoAction:
         break;
     }
-    return 0;
+    return ok;
 }
@@ -43,18 +43,42 @@ public:
     class Private;
     class Import;
     class Export;
+    class Estimate;
+    class Phase;
 
     enum Action {
         NoAction,
         ImportAction,
-        ExportAction
+        ExportAction,
+        EstimateAction
     };
 
     static const char ACTION_IMPORT[];
     static const char ACTION_RESTORE[]; // Same as import
     static const char ACTION_EXPORT[];
+    static const char ACTION_ESTIMATE[];
 
-    static int run(Action aAction, const char* aHome, const char* aBackupDir);
+    class Options {
+    public:
+        Options();
+
+        int iJobs; // Number of copy threads, 0 = one per CPU
+        int iReadAhead; // Per file read-ahead window in KiB, 0 = default
+        bool iChunks; // Store files in the deduplicating chunk store
+        bool iArchive; // Store everything in a compressed archive
+        int iCompression; // Archive compression level, 0..9
+        int iProgressFd; // Where to write BackupProgress reports, -1 if none
+        int iSnapshots; // Number of export snapshots to keep, 0 = none
+        const char* iSnapshot; // Snapshot to import, NULL = the latest
+        bool iDelta; // Update large files in place, see BackupDelta
+        bool iSequential; // Don't overlap file and config phases
+        const char* const* iExcludes; // Extra patterns, NULL terminated
+    };
+
+    // aBackupDir is optional for EstimateAction. Returns false if
+    // anything has failed.
+    static bool run(Action aAction, const char* aHome, const char* aBackupDir,
+        const Options& aOptions);
 };
 
 #endif // BACKUP_H
@@ -0,0 +1,1205 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include <gio/gio.h>
+
+#include "BackupArchive.h"
+#include "BackupProgress.h"
+
+#include "HarbourDebug.h"
+
+#include <QDir>
+#include <QFileInfo>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+const char BackupArchive::INDEX_NAME[] = ".mybackup-index";
+
+namespace {
+
+    enum {
+        TAR_BLOCK = 512,
+        TAR_NAME_SIZE = 100,
+        FOOTER_SIZE = 34
+    };
+
+    // Empty gzip member with 'MB' extra subfield (8 bytes, the offset)
+    const guchar FOOTER_HEADER[] = {
+        0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff,
+        0x0c, 0x00, 'M', 'B', 0x08, 0x00
+    };
+    const guchar FOOTER_TRAILER[] = {
+        0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+    Q_STATIC_ASSERT(sizeof(FOOTER_HEADER) + 8 + sizeof(FOOTER_TRAILER) ==
+        FOOTER_SIZE);
+
+    bool writeAll(int aFd, const void* aData, gsize aSize)
+    {
+        const char* ptr = (const char*)aData;
+        while (aSize > 0) {
+            const ssize_t n = write(aFd, ptr, aSize);
+            if (n > 0) {
+                ptr += n;
+                aSize -= n;
+            } else if (n < 0 && errno != EINTR) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void tarNumber(char* aField, int aSize, guint64 aValue)
+    {
+        if (aValue < (G_GUINT64_CONSTANT(1) << (3 * (aSize - 1)))) {
+            // Octal, NULL terminated
+            snprintf(aField, aSize, "%0*" G_GINT64_MODIFIER "o",
+                aSize - 1, aValue);
+        } else {
+            // GNU base-256 extension
+            for (int i = aSize - 1; i > 0; i--) {
+                aField[i] = (char)(aValue & 0xff);
+                aValue >>= 8;
+            }
+            aField[0] = (char)0x80;
+        }
+    }
+
+    guint64 tarParseNumber(const char* aField, int aSize)
+    {
+        guint64 value = 0;
+        if (((guchar)aField[0]) & 0x80) {
+            for (int i = 1; i < aSize; i++) {
+                value = (value << 8) | (guchar)aField[i];
+            }
+        } else {
+            for (int i = 0; i < aSize && aField[i]; i++) {
+                if (aField[i] >= '0' && aField[i] <= '7') {
+                    value = (value << 3) | (aField[i] - '0');
+                }
+            }
+        }
+        return value;
+    }
+
+    guint tarChecksum(const char* aBlock)
+    {
+        guint sum = 0;
+        for (int i = 0; i < TAR_BLOCK; i++) {
+            // The checksum field itself is counted as spaces
+            sum += (i >= 148 && i < 156) ? ' ' : (guchar)aBlock[i];
+        }
+        return sum;
+    }
+
+    void tarHeader(char* aBlock, const char* aName, char aType, guint aMode,
+        guint aUid, guint aGid, guint64 aSize, guint64 aMtime)
+    {
+        memset(aBlock, 0, TAR_BLOCK);
+        strncpy(aBlock, aName, TAR_NAME_SIZE);
+        tarNumber(aBlock + 100, 8, aMode);
+        tarNumber(aBlock + 108, 8, aUid);
+        tarNumber(aBlock + 116, 8, aGid);
+        tarNumber(aBlock + 124, 12, aSize);
+        tarNumber(aBlock + 136, 12, aMtime);
+        aBlock[156] = aType;
+        memcpy(aBlock + 257, "ustar  ", 8); // GNU magic and version
+        snprintf(aBlock + 148, 8, "%06o", tarChecksum(aBlock));
+        aBlock[155] = ' ';
+    }
+
+    inline guint64 tarPadding(guint64 aSize)
+    {
+        return (TAR_BLOCK - (aSize % TAR_BLOCK)) % TAR_BLOCK;
+    }
+}
+
+// ==========================================================================
+// BackupArchive::Writer::Private
+// ==========================================================================
+
+class BackupArchive::Writer::Private {
+public:
+    enum {
+        BLOCK_SIZE = 256 * 1024,
+        MAX_QUEUED_BLOCKS = 16, // Limits the memory usage
+        OUT_BUF_SIZE = 64 * 1024
+    };
+
+    enum BlockType {
+        BlockBegin, // Data is the entry name
+        BlockData,
+        BlockEnd,
+        BlockFinish
+    };
+
+    struct Block {
+        BlockType iType;
+        char* iData;
+        gsize iSize;
+    };
+
+    Private(const QString aFile, int aCompressionLevel);
+    ~Private();
+
+    void push(BlockType aType, char* aData = NULL, gsize aSize = 0);
+    void pushCopy(const void* aData, gsize aSize);
+    void pushZeros(gsize aSize);
+    void pushHeader(const QByteArray aName, char aType,
+        const struct stat* aStat, guint64 aSize);
+    Block* pop();
+
+    static QByteArray headerData(const QByteArray aName, char aType,
+        guint aMode, guint aUid, guint aGid, guint64 aSize, guint64 aMtime);
+    static gpointer threadProc(gpointer aPrivate);
+    void run();
+    bool output(const void* aData, gsize aSize);
+    bool compress(const void* aData, gsize aSize, bool aEnd);
+    bool writeIndex();
+
+public:
+    const QByteArray iFile;
+    const QByteArray iTmpFile;
+    int iFd;
+    bool iFinished;
+    GMutex iMutex;
+    GCond iCond;
+    GQueue iQueue;
+    GThread* iThread;
+    // Owned by the compressor thread
+    GConverter* iCompressor;
+    char* iOutBuf;
+    guint64 iOffset;
+    GString* iIndex;
+    bool iError;
+};
+
+BackupArchive::Writer::Private::Private(const QString aFile,
+    int aCompressionLevel) :
+    iFile(aFile.toLocal8Bit()),
+    iTmpFile(iFile + ".tmp"),
+    iFinished(false),
+    iThread(NULL),
+    iCompressor(G_CONVERTER(g_zlib_compressor_new
+        (G_ZLIB_COMPRESSOR_FORMAT_GZIP, aCompressionLevel))),
+    iOutBuf((char*)g_malloc(OUT_BUF_SIZE)),
+    iOffset(0),
+    iIndex(g_string_new(NULL)),
+    iError(false)
+{
+    g_mutex_init(&iMutex);
+    g_cond_init(&iCond);
+    g_queue_init(&iQueue);
+    QFileInfo(aFile).dir().mkpath(QStringLiteral("."));
+    iFd = open(iTmpFile.constData(), O_WRONLY | O_CREAT | O_TRUNC |
+        O_CLOEXEC, 0600);
+    if (iFd >= 0) {
+        iThread = g_thread_new("archive", threadProc, this);
+    } else {
+        HWARN("Failed to create" << iTmpFile.constData() << ":" <<
+            strerror(errno));
+    }
+}
+
+BackupArchive::Writer::Private::~Private()
+{
+    if (iThread) {
+        // Abandoned archive
+        push(BlockFinish);
+        g_thread_join(iThread);
+        iError = true;
+    }
+    if (iFd >= 0) {
+        close(iFd);
+        if (!iFinished) {
+            unlink(iTmpFile.constData());
+        }
+    }
+    g_object_unref(iCompressor);
+    g_string_free(iIndex, TRUE);
+    g_free(iOutBuf);
+    g_cond_clear(&iCond);
+    g_mutex_clear(&iMutex);
+}
+
+void BackupArchive::Writer::Private::push(BlockType aType, char* aData,
+    gsize aSize)
+{
+    Block* block = g_slice_new(Block);
+    block->iType = aType;
+    block->iData = aData;
+    block->iSize = aSize;
+    g_mutex_lock(&iMutex);
+    while (g_queue_get_length(&iQueue) >= MAX_QUEUED_BLOCKS) {
+        g_cond_wait(&iCond, &iMutex);
+    }
+    g_queue_push_tail(&iQueue, block);
+    g_cond_broadcast(&iCond);
+    g_mutex_unlock(&iMutex);
+}
+
+BackupArchive::Writer::Private::Block* BackupArchive::Writer::Private::pop()
+{
+    g_mutex_lock(&iMutex);
+    while (g_queue_is_empty(&iQueue)) {
+        g_cond_wait(&iCond, &iMutex);
+    }
+    Block* block = (Block*)g_queue_pop_head(&iQueue);
+    g_cond_broadcast(&iCond);
+    g_mutex_unlock(&iMutex);
+    return block;
+}
+
+void BackupArchive::Writer::Private::pushCopy(const void* aData, gsize aSize)
+{
+    if (aSize) {
+        push(BlockData, (char*)g_memdup(aData, aSize), aSize);
+    }
+}
+
+void BackupArchive::Writer::Private::pushZeros(gsize aSize)
+{
+    if (aSize) {
+        push(BlockData, (char*)g_malloc0(aSize), aSize);
+    }
+}
+
+QByteArray BackupArchive::Writer::Private::headerData(const QByteArray aName,
+    char aType, guint aMode, guint aUid, guint aGid, guint64 aSize,
+    guint64 aMtime)
+{
+    QByteArray data;
+    char block[TAR_BLOCK];
+    if (aName.length() > TAR_NAME_SIZE) {
+        // GNU long name extension
+        const guint64 len = aName.length() + 1;
+        tarHeader(block, "././@LongLink", 'L', 0, 0, 0, len, 0);
+        data.append(block, TAR_BLOCK);
+        data.append(aName.constData(), len);
+        data.append(QByteArray(tarPadding(len), 0));
+    }
+    tarHeader(block, aName.constData(), aType, aMode, aUid, aGid, aSize,
+        aMtime);
+    data.append(block, TAR_BLOCK);
+    return data;
+}
+
+void BackupArchive::Writer::Private::pushHeader(const QByteArray aName,
+    char aType, const struct stat* aStat, guint64 aSize)
+{
+    const QByteArray header(headerData(aName, aType,
+        aStat->st_mode & ~S_IFMT, aStat->st_uid, aStat->st_gid, aSize,
+        aStat->st_mtime));
+    pushCopy(header.constData(), header.length());
+}
+
+gpointer BackupArchive::Writer::Private::threadProc(gpointer aPrivate)
+{
+    ((Private*)aPrivate)->run();
+    return NULL;
+}
+
+void BackupArchive::Writer::Private::run()
+{
+    bool done = false;
+    while (!done) {
+        Block* block = pop();
+        if (!iError) {
+            switch (block->iType) {
+            case BlockBegin:
+                // Each entry is a separate gzip member
+                g_converter_reset(iCompressor);
+                g_string_append_printf(iIndex, "%" G_GUINT64_FORMAT "\t%s\n",
+                    iOffset, block->iData);
+                break;
+            case BlockData:
+                iError = !compress(block->iData, block->iSize, false);
+                break;
+            case BlockEnd:
+                iError = !compress(NULL, 0, true);
+                break;
+            case BlockFinish:
+                done = true;
+                break;
+            }
+        } else {
+            done = (block->iType == BlockFinish);
+        }
+        g_free(block->iData);
+        g_slice_free(Block, block);
+    }
+    if (!iError && iFinished) {
+        iError = !writeIndex();
+    }
+}
+
+bool BackupArchive::Writer::Private::output(const void* aData, gsize aSize)
+{
+    if (writeAll(iFd, aData, aSize)) {
+        iOffset += aSize;
+        return true;
+    } else {
+        HWARN("Failed to write" << iTmpFile.constData() << ":" <<
+            strerror(errno));
+        return false;
+    }
+}
+
+bool BackupArchive::Writer::Private::compress(const void* aData,
+    gsize aSize, bool aEnd)
+{
+    const char* in = (const char*)aData;
+    const GConverterFlags flags = aEnd ? G_CONVERTER_INPUT_AT_END :
+        G_CONVERTER_NO_FLAGS;
+    for (;;) {
+        gsize nread = 0, nwritten = 0;
+        GError* error = NULL;
+        const GConverterResult result = g_converter_convert(iCompressor,
+            in, aSize, iOutBuf, OUT_BUF_SIZE, flags, &nread, &nwritten,
+            &error);
+        if (result == G_CONVERTER_ERROR) {
+            HWARN(error->message);
+            g_error_free(error);
+            return false;
+        }
+        in += nread;
+        aSize -= nread;
+        if (nwritten && !output(iOutBuf, nwritten)) {
+            return false;
+        }
+        if (result == G_CONVERTER_FINISHED || (!aEnd && !aSize)) {
+            return true;
+        }
+    }
+}
+
+bool BackupArchive::Writer::Private::writeIndex()
+{
+    // The index goes into the last tar entry, followed by the end of
+    // archive marker in the same gzip member
+    const guint64 indexOffset = iOffset;
+    const guint64 size = iIndex->len;
+    const QByteArray header(headerData(QByteArray(INDEX_NAME), '0', 0600,
+        getuid(), getgid(), size, time(NULL)));
+    const QByteArray trailer(tarPadding(size) + 2 * TAR_BLOCK, 0);
+    g_converter_reset(iCompressor);
+    if (compress(header.constData(), header.length(), false) &&
+        compress(iIndex->str, size, false) &&
+        compress(trailer.constData(), trailer.length(), true)) {
+        guchar offset[8];
+        for (int i = 0; i < 8; i++) {
+            offset[i] = (guchar)(indexOffset >> (8 * i));
+        }
+        return output(FOOTER_HEADER, sizeof(FOOTER_HEADER)) &&
+            output(offset, sizeof(offset)) &&
+            output(FOOTER_TRAILER, sizeof(FOOTER_TRAILER));
+    }
+    return false;
+}
+
+// ==========================================================================
+// BackupArchive::Writer
+// ==========================================================================
+
+BackupArchive::Writer::Writer(const QString aFile, int aCompressionLevel) :
+    iPrivate(new Private(aFile, aCompressionLevel))
+{
+}
+
+BackupArchive::Writer::~Writer()
+{
+    delete iPrivate;
+}
+
+bool BackupArchive::Writer::isOpen() const
+{
+    return iPrivate->iThread != NULL;
+}
+
+void BackupArchive::Writer::addDirectory(const QByteArray aPath,
+    const struct stat* aStat)
+{
+    if (iPrivate->iThread && !aPath.contains('\n')) {
+        const QByteArray name(aPath + '/');
+        iPrivate->push(Private::BlockBegin, g_strdup(name.constData()));
+        iPrivate->pushHeader(name, '5', aStat, 0);
+        iPrivate->push(Private::BlockEnd);
+    }
+}
+
+bool BackupArchive::Writer::addFile(const QByteArray aPath, int aDirFd,
+    const char* aName, const struct stat* aStat)
+{
+    if (!iPrivate->iThread) {
+        return false;
+    } else if (aPath.contains('\n')) {
+        HWARN("Skipping" << aPath.constData());
+        return false;
+    }
+
+    const int fd = openat(aDirFd, aName, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || (!aStat && fstat(fd, &st))) {
+        HWARN("Failed to open" << aPath.constData() << ":" <<
+            strerror(errno));
+        if (fd >= 0) close(fd);
+        return false;
+    } else if (!aStat) {
+        aStat = &st;
+    }
+
+    // The size in the header is what will be written
+    const guint64 size = aStat->st_size;
+    guint64 remaining = size;
+    bool complete = true;
+    iPrivate->push(Private::BlockBegin, g_strdup(aPath.constData()));
+    iPrivate->pushHeader(aPath, '0', aStat, size);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (remaining > 0) {
+        const gsize blockSize = (gsize)MIN(remaining,
+            (guint64)Private::BLOCK_SIZE);
+        char* block = (char*)g_malloc(blockSize);
+        gsize filled = 0;
+        while (filled < blockSize) {
+            const ssize_t n = read(fd, block + filled, blockSize - filled);
+            if (n > 0) {
+                filled += n;
+            } else if (!n || errno != EINTR) {
+                // The file has shrunk (or can't be read), pad it to
+                // keep the stream consistent but fail the entry
+                if (complete) {
+                    HWARN("Short read from" << aPath.constData());
+                    complete = false;
+                }
+                memset(block + filled, 0, blockSize - filled);
+                filled = blockSize;
+            }
+        }
+        iPrivate->push(Private::BlockData, block, blockSize);
+        remaining -= blockSize;
+    }
+    iPrivate->pushZeros(tarPadding(size));
+    iPrivate->push(Private::BlockEnd);
+    close(fd);
+    HDEBUG(aPath.constData() << size);
+    return complete;
+}
+
+bool BackupArchive::Writer::finish()
+{
+    bool ok = false;
+    if (iPrivate->iThread) {
+        iPrivate->iFinished = true;
+        iPrivate->push(Private::BlockFinish);
+        g_thread_join(iPrivate->iThread);
+        iPrivate->iThread = NULL;
+        if (!iPrivate->iError && !fsync(iPrivate->iFd) &&
+            !close(iPrivate->iFd)) {
+            iPrivate->iFd = -1;
+            if (!rename(iPrivate->iTmpFile.constData(),
+                iPrivate->iFile.constData())) {
+                HDEBUG("Wrote" << iPrivate->iFile.constData() <<
+                    iPrivate->iOffset << "bytes");
+                ok = true;
+            }
+        }
+        if (!ok) {
+            HWARN("Failed to write" << iPrivate->iFile.constData());
+            iPrivate->iFinished = false;
+            if (iPrivate->iFd < 0) {
+                unlink(iPrivate->iTmpFile.constData());
+            }
+        }
+    }
+    return ok;
+}
+
+// ==========================================================================
+// BackupArchive::Reader::Private
+// ==========================================================================
+
+class BackupArchive::Reader::Private {
+public:
+    class Sink;
+    class IndexSink;
+    class FileSink;
+
+    enum {
+        IN_BUF_SIZE = 64 * 1024,
+        OUT_BUF_SIZE = 64 * 1024
+    };
+
+    struct Meta {
+        guint iMode;
+        guint iUid;
+        guint iGid;
+        guint64 iMtime;
+    };
+
+    struct Entry {
+        guint64 iOffset;
+        QByteArray iPath;
+    };
+
+    Private(const QString aFile);
+    ~Private();
+
+    bool loadIndex();
+    gint64 readMember(guint64 aOffset, Sink* aSink);
+    int extract(FileSink* aSink);
+
+public:
+    int iFd;
+    guint64 iSize;
+    bool iHaveIndex;
+    QList<Entry> iIndex;
+    char* iInBuf;
+    char* iOutBuf;
+};
+
+// Parses the tar stream and passes the entries to the subclass
+class BackupArchive::Reader::Private::Sink {
+public:
+    Sink();
+    virtual ~Sink();
+
+    bool feed(const char* aData, gsize aSize);
+    void reset();
+
+    virtual bool beginFile(const QByteArray aPath, const Meta& aMeta) = 0;
+    virtual bool fileData(const char* aData, gsize aSize) = 0;
+    virtual void endFile() = 0;
+    virtual void directory(const QByteArray aPath, const Meta& aMeta);
+
+private:
+    bool parseHeader();
+
+private:
+    char iHeader[TAR_BLOCK];
+    gsize iHeaderFill;
+    char iType;
+    bool iWanted;
+    bool iEnd;
+    guint64 iRemaining;
+    guint64 iPadding;
+    QByteArray iLongName;
+};
+
+BackupArchive::Reader::Private::Sink::Sink() :
+    iHeaderFill(0),
+    iType(0),
+    iWanted(false),
+    iEnd(false),
+    iRemaining(0),
+    iPadding(0)
+{
+}
+
+BackupArchive::Reader::Private::Sink::~Sink()
+{
+}
+
+void BackupArchive::Reader::Private::Sink::directory(const QByteArray,
+    const Meta&)
+{
+}
+
+void BackupArchive::Reader::Private::Sink::reset()
+{
+    // Forget whatever a truncated member has left behind
+    iHeaderFill = 0;
+    iType = 0;
+    iWanted = false;
+    iEnd = false;
+    iRemaining = 0;
+    iPadding = 0;
+    iLongName.clear();
+}
+
+bool BackupArchive::Reader::Private::Sink::parseHeader()
+{
+    bool empty = true;
+    for (int i = 0; i < TAR_BLOCK && empty; i++) {
+        empty = !iHeader[i];
+    }
+    if (empty) {
+        // End of archive
+        iEnd = true;
+        return true;
+    }
+    if (tarParseNumber(iHeader + 148, 8) != tarChecksum(iHeader)) {
+        HWARN("Tar header checksum mismatch");
+        return false;
+    }
+
+    QByteArray name;
+    if (!iLongName.isEmpty()) {
+        name = iLongName;
+        iLongName.clear();
+    } else {
+        name = QByteArray(iHeader, qstrnlen(iHeader, TAR_NAME_SIZE));
+        if (!memcmp(iHeader + 257, "ustar", 6) && iHeader[345]) {
+            // POSIX prefix
+            name.prepend('/');
+            name.prepend(QByteArray(iHeader + 345, qstrnlen(iHeader + 345,
+                155)));
+        }
+    }
+
+    Meta meta;
+    meta.iMode = (guint)tarParseNumber(iHeader + 100, 8);
+    meta.iUid = (guint)tarParseNumber(iHeader + 108, 8);
+    meta.iGid = (guint)tarParseNumber(iHeader + 116, 8);
+    meta.iMtime = tarParseNumber(iHeader + 136, 12);
+    iType = iHeader[156];
+    iRemaining = tarParseNumber(iHeader + 124, 12);
+    iPadding = tarPadding(iRemaining);
+    iWanted = false;
+    switch (iType) {
+    case 'L':
+        // Long name is collected in iLongName
+        break;
+    case '0':
+    case '\0':
+        iWanted = beginFile(name, meta);
+        if (iWanted && !iRemaining) {
+            endFile();
+            iWanted = false;
+        }
+        break;
+    case '5':
+        while (name.endsWith('/')) name.chop(1);
+        directory(name, meta);
+        break;
+    }
+    return true;
+}
+
+bool BackupArchive::Reader::Private::Sink::feed(const char* aData,
+    gsize aSize)
+{
+    while (aSize > 0 && !iEnd) {
+        if (iRemaining) {
+            const gsize n = (gsize)MIN((guint64)aSize, iRemaining);
+            if (iType == 'L') {
+                iLongName.append(aData, n);
+            } else if (iWanted && !fileData(aData, n)) {
+                return false;
+            }
+            aData += n;
+            aSize -= n;
+            iRemaining -= n;
+            if (!iRemaining) {
+                if (iType == 'L') {
+                    // Strip the NULL terminator
+                    iLongName = QByteArray(iLongName.constData(),
+                        qstrnlen(iLongName.constData(), iLongName.size()));
+                } else if (iWanted) {
+                    endFile();
+                    iWanted = false;
+                }
+            }
+        } else if (iPadding) {
+            const gsize n = (gsize)MIN((guint64)aSize, iPadding);
+            aData += n;
+            aSize -= n;
+            iPadding -= n;
+        } else {
+            const gsize n = MIN(aSize, TAR_BLOCK - iHeaderFill);
+            memcpy(iHeader + iHeaderFill, aData, n);
+            iHeaderFill += n;
+            aData += n;
+            aSize -= n;
+            if (iHeaderFill == TAR_BLOCK) {
+                iHeaderFill = 0;
+                if (!parseHeader()) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Collects the index
+class BackupArchive::Reader::Private::IndexSink : public Sink {
+public:
+    bool beginFile(const QByteArray aPath, const Meta&) Q_DECL_OVERRIDE
+        { return aPath == INDEX_NAME; }
+    bool fileData(const char* aData, gsize aSize) Q_DECL_OVERRIDE
+        { iData.append(aData, aSize); return true; }
+    void endFile() Q_DECL_OVERRIDE
+        { iDone = true; }
+
+    IndexSink() : iDone(false) {}
+
+public:
+    QByteArray iData;
+    bool iDone;
+};
+
+// Writes the selected entries to the file system
+class BackupArchive::Reader::Private::FileSink : public Sink {
+public:
+    FileSink(const QByteArray aRoot, const QString aDestDir,
+        const QStringList aEntries, const char* aExDir,
+        BackupProgress* aProgress);
+    FileSink(const QByteArray aPath, const QString aDestFile);
+    ~FileSink();
+
+    bool isSelected(const QByteArray aPath) const;
+    QByteArray destPath(const QByteArray aPath) const;
+    void abortFile();
+
+    bool beginFile(const QByteArray aPath, const Meta& aMeta) Q_DECL_OVERRIDE;
+    bool fileData(const char* aData, gsize aSize) Q_DECL_OVERRIDE;
+    void endFile() Q_DECL_OVERRIDE;
+    void directory(const QByteArray aPath, const Meta& aMeta) Q_DECL_OVERRIDE;
+
+    static void setMetadata(int aFd, const char* aPath, const Meta& aMeta);
+
+public:
+    QByteArray iRoot;
+    const QByteArray iDestDir;
+    const QByteArray iDestFile;
+    QList<QByteArray> iDirs;
+    QList<QByteArray> iFiles;
+    const char* iExDir;
+    BackupProgress* iProgress;
+    int iFd;
+    QByteArray iPath;
+    char* iTmpPath;
+    Meta iMeta;
+    quint64 iBytes;
+    int iCount;
+    int iFailures;
+};
+
+BackupArchive::Reader::Private::FileSink::FileSink(const QByteArray aRoot,
+    const QString aDestDir, const QStringList aEntries, const char* aExDir,
+    BackupProgress* aProgress) :
+    iRoot(aRoot),
+    iDestDir(QDir(aDestDir).absolutePath().toLocal8Bit()),
+    iExDir(aExDir),
+    iProgress(aProgress),
+    iFd(-1),
+    iTmpPath(NULL),
+    iBytes(0),
+    iCount(0),
+    iFailures(0)
+{
+    if (!iRoot.isEmpty() && !iRoot.endsWith('/')) {
+        iRoot.append('/');
+    }
+    const int n = aEntries.count();
+    for (int i = 0; i < n; i++) {
+        QByteArray entry(QDir::cleanPath(aEntries.at(i)).toLocal8Bit());
+        if (entry == ".") {
+            // The whole thing
+            entry.clear();
+        }
+        if (aEntries.at(i).endsWith('/')) {
+            iDirs.append(entry);
+        } else {
+            iFiles.append(entry);
+        }
+    }
+}
+
+BackupArchive::Reader::Private::FileSink::FileSink(const QByteArray aPath,
+    const QString aDestFile) :
+    iDestFile(aDestFile.toLocal8Bit()),
+    iExDir(NULL),
+    iProgress(NULL),
+    iFd(-1),
+    iTmpPath(NULL),
+    iBytes(0),
+    iCount(0),
+    iFailures(0)
+{
+    iFiles.append(aPath);
+}
+
+BackupArchive::Reader::Private::FileSink::~FileSink()
+{
+    if (iFd >= 0) {
+        close(iFd);
+        unlink(iTmpPath);
+    }
+    g_free(iTmpPath);
+}
+
+bool BackupArchive::Reader::Private::FileSink::isSelected(const QByteArray aPath)
+    const
+{
+    if (!aPath.startsWith(iRoot)) {
+        return false;
+    }
+    const QByteArray path(aPath.mid(iRoot.length()));
+    if (iFiles.contains(path)) {
+        return true;
+    }
+    const int n = iDirs.count();
+    for (int i = 0; i < n; i++) {
+        const QByteArray& dir = iDirs.at(i);
+        if (dir.isEmpty() || path == dir || (path.startsWith(dir) &&
+            path.at(dir.length()) == '/')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+QByteArray BackupArchive::Reader::Private::FileSink::destPath(const QByteArray aPath)
+    const
+{
+    if (isSelected(aPath)) {
+        if (!iDestFile.isEmpty()) {
+            return iDestFile;
+        } else if (!aPath.startsWith('/') &&
+            !QByteArray('/' + aPath + '/').contains("/../")) {
+            const QByteArray path(iDestDir + '/' + aPath.mid(iRoot.length()));
+            if (iExDir) {
+                const size_t xlen = strlen(iExDir);
+                if (!strncmp(path.constData(), iExDir, xlen) &&
+                    (!path.at(xlen) || path.at(xlen) == '/')) {
+                    HWARN(path.constData() << "is excluded, skipping");
+                    return QByteArray();
+                }
+            }
+            return path;
+        }
+    }
+    return QByteArray();
+}
+
+void BackupArchive::Reader::Private::FileSink::abortFile()
+{
+    if (iFd >= 0) {
+        HWARN("Failed to extract" << iPath.constData());
+        close(iFd);
+        unlink(iTmpPath);
+        iFd = -1;
+        iFailures++;
+        if (iProgress) {
+            iProgress->fileDone(iBytes);
+        }
+    }
+}
+
+void BackupArchive::Reader::Private::FileSink::setMetadata(int aFd,
+    const char* aPath, const Meta& aMeta)
+{
+    struct timespec times[2];
+    times[0].tv_sec = times[1].tv_sec = aMeta.iMtime;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    if (fchown(aFd, aMeta.iUid, aMeta.iGid)) {
+        HWARN("Failed to chown" << aPath << ":" << strerror(errno));
+    }
+    if (fchmod(aFd, aMeta.iMode & 07777)) {
+        HWARN("Failed to chmod" << aPath << ":" << strerror(errno));
+    }
+    if (futimens(aFd, times)) {
+        HWARN("Failed to set times" << aPath << ":" << strerror(errno));
+    }
+}
+
+bool BackupArchive::Reader::Private::FileSink::beginFile(const QByteArray aPath,
+    const Meta& aMeta)
+{
+    abortFile();
+    iPath = destPath(aPath);
+    iBytes = 0;
+    if (!iPath.isEmpty()) {
+        char* dir = g_path_get_dirname(iPath.constData());
+        g_mkdir_with_parents(dir, 0755);
+        g_free(dir);
+        g_free(iTmpPath);
+        iTmpPath = g_strconcat(iPath.constData(), ".XXXXXX", NULL);
+        iFd = g_mkstemp_full(iTmpPath, O_WRONLY | O_CLOEXEC, 0600);
+        if (iFd >= 0) {
+            iMeta = aMeta;
+            return true;
+        }
+        HWARN("Failed to create" << iTmpPath << ":" << strerror(errno));
+        iFailures++;
+        if (iProgress) {
+            iProgress->fileDone(0);
+        }
+    }
+    return false;
+}
+
+bool BackupArchive::Reader::Private::FileSink::fileData(const char* aData,
+    gsize aSize)
+{
+    if (!writeAll(iFd, aData, aSize)) {
+        HWARN("Failed to write" << iTmpPath << ":" << strerror(errno));
+        abortFile();
+        return false;
+    }
+    iBytes += aSize;
+    return true;
+}
+
+void BackupArchive::Reader::Private::FileSink::endFile()
+{
+    setMetadata(iFd, iPath.constData(), iMeta);
+    if (!close(iFd) && !rename(iTmpPath, iPath.constData())) {
+        HDEBUG("Extracted" << iPath.constData());
+        iCount++;
+    } else {
+        HWARN("Failed to extract" << iPath.constData() << ":" <<
+            strerror(errno));
+        unlink(iTmpPath);
+        iFailures++;
+    }
+    iFd = -1;
+    if (iProgress) {
+        iProgress->fileDone(iBytes);
+    }
+}
+
+void BackupArchive::Reader::Private::FileSink::directory(const QByteArray aPath,
+    const Meta& aMeta)
+{
+    const QByteArray path(destPath(aPath));
+    if (!path.isEmpty() && !g_mkdir_with_parents(path.constData(),
+        aMeta.iMode & 07777)) {
+        const int fd = open(path.constData(), O_RDONLY | O_DIRECTORY |
+            O_CLOEXEC);
+        if (fd >= 0) {
+            if (fchown(fd, aMeta.iUid, aMeta.iGid)) {
+                HWARN("Failed to chown" << path.constData() << ":" <<
+                    strerror(errno));
+            }
+            if (fchmod(fd, aMeta.iMode & 07777)) {
+                HWARN("Failed to chmod" << path.constData() << ":" <<
+                    strerror(errno));
+            }
+            close(fd);
+        }
+    }
+}
+
+BackupArchive::Reader::Private::Private(const QString aFile) :
+    iSize(0),
+    iHaveIndex(false),
+    iInBuf((char*)g_malloc(IN_BUF_SIZE)),
+    iOutBuf((char*)g_malloc(OUT_BUF_SIZE))
+{
+    const QByteArray path(aFile.toLocal8Bit());
+    struct stat st;
+    iFd = open(path.constData(), O_RDONLY | O_CLOEXEC);
+    if (iFd >= 0 && !fstat(iFd, &st)) {
+        iSize = st.st_size;
+        iHaveIndex = loadIndex();
+    }
+}
+
+BackupArchive::Reader::Private::~Private()
+{
+    if (iFd >= 0) {
+        close(iFd);
+    }
+    g_free(iInBuf);
+    g_free(iOutBuf);
+}
+
+bool BackupArchive::Reader::Private::loadIndex()
+{
+    guchar footer[FOOTER_SIZE];
+    if (iSize < FOOTER_SIZE || pread(iFd, footer, FOOTER_SIZE,
+        iSize - FOOTER_SIZE) != FOOTER_SIZE ||
+        memcmp(footer, FOOTER_HEADER, sizeof(FOOTER_HEADER))) {
+        HWARN("No archive index");
+        return false;
+    }
+
+    guint64 offset = 0;
+    for (int i = 7; i >= 0; i--) {
+        offset = (offset << 8) | footer[sizeof(FOOTER_HEADER) + i];
+    }
+
+    IndexSink sink;
+    if (offset < iSize && readMember(offset, &sink) >= 0 && sink.iDone) {
+        const QList<QByteArray> lines(sink.iData.split('\n'));
+        const int n = lines.count();
+        for (int i = 0; i < n; i++) {
+            const QByteArray& line = lines.at(i);
+            const int tab = line.indexOf('\t');
+            if (tab > 0) {
+                Entry entry;
+                entry.iOffset = line.left(tab).toULongLong();
+                entry.iPath = line.mid(tab + 1);
+                iIndex.append(entry);
+            }
+        }
+        HDEBUG(iIndex.count() << "entries in the index");
+        return true;
+    }
+    HWARN("Failed to load the archive index");
+    return false;
+}
+
+gint64 BackupArchive::Reader::Private::readMember(guint64 aOffset,
+    Sink* aSink)
+{
+    GConverter* z = G_CONVERTER(g_zlib_decompressor_new
+        (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+    guint64 pos = aOffset;
+    gint64 next = -1;
+    bool done = false;
+
+    while (!done) {
+        const ssize_t len = pread(iFd, iInBuf, IN_BUF_SIZE, pos);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            HWARN("Read error:" << strerror(errno));
+            break;
+        }
+
+        // Decompress whatever we have read
+        const GConverterFlags flags = len ? G_CONVERTER_NO_FLAGS :
+            G_CONVERTER_INPUT_AT_END;
+        gsize used = 0;
+        bool more = false;
+        while (!done && !more) {
+            gsize nread = 0, nwritten = 0;
+            GError* error = NULL;
+            const GConverterResult result = g_converter_convert(z,
+                iInBuf + used, len - used, iOutBuf, OUT_BUF_SIZE, flags,
+                &nread, &nwritten, &error);
+            if (result == G_CONVERTER_ERROR) {
+                if (len && g_error_matches(error, G_IO_ERROR,
+                    G_IO_ERROR_PARTIAL_INPUT)) {
+                    more = true;
+                } else {
+                    HWARN(error->message);
+                    done = true;
+                }
+                g_error_free(error);
+            } else {
+                used += nread;
+                if (nwritten && !aSink->feed(iOutBuf, nwritten)) {
+                    done = true;
+                } else if (result == G_CONVERTER_FINISHED) {
+                    next = pos + used;
+                    done = true;
+                } else if (used == (gsize)len && nwritten < OUT_BUF_SIZE) {
+                    more = true;
+                }
+            }
+        }
+        if (!len) {
+            // Truncated member
+            done = true;
+        }
+        pos += used;
+    }
+    g_object_unref(z);
+    return next;
+}
+
+int BackupArchive::Reader::Private::extract(FileSink* aSink)
+{
+    if (iHaveIndex) {
+        // Jump straight to the selected entries
+        const int n = iIndex.count();
+        for (int i = 0; i < n; i++) {
+            const Entry& entry = iIndex.at(i);
+            QByteArray path(entry.iPath);
+            while (path.endsWith('/')) path.chop(1);
+            if (aSink->isSelected(path)) {
+                // A broken member fails its file but not the rest
+                aSink->reset();
+                readMember(entry.iOffset, aSink);
+                aSink->abortFile();
+            }
+        }
+    } else {
+        // Scan the whole thing member by member
+        gint64 offset = 0;
+        while (offset >= 0 && (guint64)offset < iSize) {
+            offset = readMember(offset, aSink);
+        }
+        aSink->abortFile();
+    }
+    return aSink->iCount;
+}
+
+// ==========================================================================
+// BackupArchive::Reader
+// ==========================================================================
+
+BackupArchive::Reader::Reader(const QString aFile) :
+    iPrivate(new Private(aFile))
+{
+}
+
+BackupArchive::Reader::~Reader()
+{
+    delete iPrivate;
+}
+
+bool BackupArchive::Reader::isOpen() const
+{
+    return iPrivate->iFd >= 0;
+}
+
+int BackupArchive::Reader::extract(const QByteArray aRoot,
+    const QString aDestDir, const QStringList aEntries, const char* aExDir,
+    BackupProgress* aProgress, int* aFailures)
+{
+    Private::FileSink sink(aRoot, aDestDir, aEntries, aExDir, aProgress);
+    const int count = isOpen() ? iPrivate->extract(&sink) : 0;
+    if (aFailures) {
+        *aFailures = sink.iFailures;
+    }
+    return count;
+}
+
+bool BackupArchive::Reader::extractFile(const QByteArray aPath,
+    const QString aDestFile)
+{
+    Private::FileSink sink(aPath, aDestFile);
+    return isOpen() && iPrivate->extract(&sink) > 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef BACKUP_ARCHIVE_H
+#define BACKUP_ARCHIVE_H
+
+#include <QByteArray>
+#include <QStringList>
+
+#include <sys/stat.h>
+
+class BackupProgress;
+
+//
+// Compressed tar archive. Each tar entry is compressed as a separate
+// gzip member, which allows to decompress individual entries without
+// reading the entire archive. The last entry is the index, mapping
+// entry names to the offsets of their gzip members. It's followed by
+// an empty gzip member carrying the offset of the index in its extra
+// field. The whole thing is still a valid .tar.gz file.
+//
+class BackupArchive {
+public:
+    class Writer;
+    class Reader;
+
+    static const char INDEX_NAME[];
+};
+
+//
+// Data are read on the calling thread and compressed and written on
+// a separate thread. The amount of memory in the pipeline is bounded.
+//
+class BackupArchive::Writer {
+    Q_DISABLE_COPY(Writer)
+    class Private;
+
+public:
+    Writer(const QString aFile, int aCompressionLevel);
+    ~Writer();
+
+    bool isOpen() const;
+    void addDirectory(const QByteArray aPath, const struct stat* aStat);
+    // Returns false if the file couldn't be read in full, the entry is
+    // still written (zero padded) to keep the archive consistent
+    bool addFile(const QByteArray aPath, int aDirFd, const char* aName,
+        const struct stat* aStat);
+    bool finish();
+
+private:
+    Private* iPrivate;
+};
+
+class BackupArchive::Reader {
+    Q_DISABLE_COPY(Reader)
+    class Private;
+
+public:
+    Reader(const QString aFile);
+    ~Reader();
+
+    bool isOpen() const;
+
+    // Entries ending with slash select directory trees, others select
+    // individual files. Entries are relative to aRoot inside the archive.
+    // Returns the number of extracted files, aFailures (if not NULL)
+    // receives the number of selected files that couldn't be extracted.
+    int extract(const QByteArray aRoot, const QString aDestDir,
+        const QStringList aEntries, const char* aExDir,
+        BackupProgress* aProgress, int* aFailures);
+    bool extractFile(const QByteArray aPath, const QString aDestFile);
+
+private:
+    Private* iPrivate;
+};
+
+#endif // BACKUP_ARCHIVE_H
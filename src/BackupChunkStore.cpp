@@ -0,0 +1,608 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "BackupChunkStore.h"
+
+#include "HarbourDebug.h"
+
+#include <glib.h>
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+// ==========================================================================
+// BackupChunkStore::Private
+// ==========================================================================
+
+class BackupChunkStore::Private {
+public:
+    enum {
+        MIN_CHUNK = 16 * 1024,
+        MAX_CHUNK = 256 * 1024,
+        GEAR_WINDOW = 64 // Gear hash only depends on the last 64 bytes
+    };
+
+    static const guint64 CUT_MASK;
+    static const char RECIPE_MAGIC[];
+    static const char RECIPE_SIZE[];
+
+    Private(const QString aDir);
+
+    static const guint64* gearTable();
+    static gsize findCut(const guchar* aData, gsize aSize);
+    static bool writeAll(int aFd, const void* aData, gsize aSize);
+    static char* readAll(int aFd);
+    static int createTemp(int aDirFd, const char* aName, char** aTmpName);
+    static bool commitTemp(int aFd, int aDirFd, const char* aTmpName,
+        const char* aName, const struct stat* aStat);
+    static bool isDotOrDotDot(const char* aName);
+    static bool markRecipe(int aDirFd, const char* aName, GHashTable* aUsed);
+    static bool markRecipes(int aDirFd, GHashTable* aUsed);
+
+    char* chunkPath(const char* aHash) const;
+    bool storeChunk(const guchar* aData, gsize aSize, GString* aRecipe) const;
+    bool restoreChunk(int aFd, const char* aHash, guint64* aTotal) const;
+
+public:
+    const QByteArray iDir;
+};
+
+// 16 bits => average chunk is MIN_CHUNK + 64K
+const guint64 BackupChunkStore::Private::CUT_MASK =
+    G_GUINT64_CONSTANT(0xffff000000000000);
+const char BackupChunkStore::Private::RECIPE_MAGIC[] = "MyBackup recipe 1";
+const char BackupChunkStore::Private::RECIPE_SIZE[] = "size ";
+
+BackupChunkStore::Private::Private(const QString aDir) :
+    iDir(aDir.toLocal8Bit())
+{
+}
+
+const guint64* BackupChunkStore::Private::gearTable()
+{
+    // The table must never change, otherwise the new chunks won't
+    // match the ones which are already in the store.
+    static const struct Gear {
+        guint64 iTable[256];
+        Gear() {
+            // splitmix64
+            guint64 x = 0;
+            for (int i = 0; i < 256; i++) {
+                guint64 z = (x += G_GUINT64_CONSTANT(0x9e3779b97f4a7c15));
+                z = (z ^ (z >> 30)) * G_GUINT64_CONSTANT(0xbf58476d1ce4e5b9);
+                z = (z ^ (z >> 27)) * G_GUINT64_CONSTANT(0x94d049bb133111eb);
+                iTable[i] = z ^ (z >> 31);
+            }
+        }
+    } gear;
+    return gear.iTable;
+}
+
+gsize BackupChunkStore::Private::findCut(const guchar* aData, gsize aSize)
+{
+    if (aSize > MIN_CHUNK) {
+        const guint64* gear = gearTable();
+        guint64 fp = 0;
+        for (gsize i = MIN_CHUNK - GEAR_WINDOW; i < aSize; i++) {
+            fp = (fp << 1) + gear[aData[i]];
+            if (i >= MIN_CHUNK && !(fp & CUT_MASK)) {
+                return i + 1;
+            }
+        }
+    }
+    return aSize;
+}
+
+bool BackupChunkStore::Private::writeAll(int aFd, const void* aData,
+    gsize aSize)
+{
+    const char* ptr = (const char*)aData;
+    while (aSize > 0) {
+        const ssize_t n = write(aFd, ptr, aSize);
+        if (n > 0) {
+            ptr += n;
+            aSize -= n;
+        } else if (n < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+char* BackupChunkStore::Private::readAll(int aFd)
+{
+    GByteArray* buf = g_byte_array_new();
+    guint8 chunk[4096];
+    for (;;) {
+        const ssize_t n = read(aFd, chunk, sizeof(chunk));
+        if (n > 0) {
+            g_byte_array_append(buf, chunk, n);
+        } else if (!n) {
+            // NULL terminate it
+            const guint8 zero = 0;
+            g_byte_array_append(buf, &zero, 1);
+            return (char*)g_byte_array_free(buf, FALSE);
+        } else if (errno != EINTR) {
+            g_byte_array_free(buf, TRUE);
+            return NULL;
+        }
+    }
+}
+
+int BackupChunkStore::Private::createTemp(int aDirFd, const char* aName,
+    char** aTmpName)
+{
+    // Hidden file next to the target one
+    const char* slash = strrchr(aName, '/');
+    const int dirLen = slash ? (int)(slash - aName + 1) : 0;
+    for (int i = 0; i < 100; i++) {
+        char* tmp = g_strdup_printf("%.*s.%s.%08x", dirLen, aName,
+            aName + dirLen, g_random_int());
+        const int fd = openat(aDirFd, tmp, O_WRONLY | O_CREAT | O_EXCL |
+            O_CLOEXEC, 0600);
+        if (fd >= 0) {
+            *aTmpName = tmp;
+            return fd;
+        }
+        g_free(tmp);
+        if (errno != EEXIST) {
+            break;
+        }
+    }
+    HWARN("Failed to create temporary file for" << aName << ":" <<
+        strerror(errno));
+    return -1;
+}
+
+bool BackupChunkStore::Private::commitTemp(int aFd, int aDirFd,
+    const char* aTmpName, const char* aName, const struct stat* aStat)
+{
+    const struct timespec times[2] = { aStat->st_atim, aStat->st_mtim };
+    bool ok = true;
+    if (fchown(aFd, aStat->st_uid, aStat->st_gid)) {
+        HWARN("Failed to chown" << aName << ":" << strerror(errno));
+    }
+    if (fchmod(aFd, aStat->st_mode & ~S_IFMT)) {
+        HWARN("Failed to chmod" << aName << ":" << strerror(errno));
+    }
+    if (futimens(aFd, times)) {
+        HWARN("Failed to set times" << aName << ":" << strerror(errno));
+    }
+    if (close(aFd)) {
+        HWARN("Failed to write" << aName << ":" << strerror(errno));
+        ok = false;
+    } else if (renameat(aDirFd, aTmpName, aDirFd, aName)) {
+        HWARN("Failed to rename" << aTmpName << ":" << strerror(errno));
+        ok = false;
+    }
+    if (!ok) {
+        unlinkat(aDirFd, aTmpName, 0);
+    }
+    return ok;
+}
+
+bool BackupChunkStore::Private::isDotOrDotDot(const char* aName)
+{
+    return aName[0] == '.' && (!aName[1] || (aName[1] == '.' && !aName[2]));
+}
+
+bool BackupChunkStore::Private::markRecipe(int aDirFd, const char* aName,
+    GHashTable* aUsed)
+{
+    char* contents = NULL;
+    const int in = openat(aDirFd, aName, O_RDONLY | O_CLOEXEC);
+    if (in >= 0) {
+        contents = readAll(in);
+        close(in);
+    }
+    if (!contents) {
+        HWARN("Failed to read" << aName << ":" << strerror(errno));
+        return false;
+    }
+
+    // Hashes start on the third line. Files which don't look like
+    // recipes don't reference anything.
+    char** lines = g_strsplit(contents, "\n", -1);
+    if (g_strv_length(lines) >= 2 && !strcmp(lines[0], RECIPE_MAGIC)) {
+        for (char** ptr = lines + 2; *ptr; ptr++) {
+            if (**ptr) {
+                g_hash_table_add(aUsed, g_strdup(*ptr));
+            }
+        }
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    return true;
+}
+
+bool BackupChunkStore::Private::markRecipes(int aDirFd, GHashTable* aUsed)
+{
+    DIR* dir = fdopendir(aDirFd);
+    if (!dir) {
+        HWARN("Failed to open directory:" << strerror(errno));
+        close(aDirFd);
+        return false;
+    }
+
+    bool ok = true;
+    const struct dirent* entry;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        const char* name = entry->d_name;
+        struct stat st;
+        if (isDotOrDotDot(name)) {
+            continue;
+        } else if (fstatat(aDirFd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+            HWARN("Failed to stat" << name << ":" << strerror(errno));
+            ok = false;
+        } else if (S_ISDIR(st.st_mode)) {
+            const int fd = openat(aDirFd, name, O_RDONLY | O_DIRECTORY |
+                O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0) {
+                ok = markRecipes(fd, aUsed);
+            } else {
+                HWARN("Failed to open" << name << ":" << strerror(errno));
+                ok = false;
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            ok = markRecipe(aDirFd, name, aUsed);
+        }
+    }
+    closedir(dir);
+    return ok;
+}
+
+char* BackupChunkStore::Private::chunkPath(const char* aHash) const
+{
+    // Spread the chunks between 256 subdirectories
+    return g_strdup_printf("%s/%.2s/%s", iDir.constData(), aHash, aHash);
+}
+
+bool BackupChunkStore::Private::storeChunk(const guchar* aData, gsize aSize,
+    GString* aRecipe) const
+{
+    bool ok = true;
+    char* hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256, aData, aSize);
+    char* path = chunkPath(hash);
+    if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+        // g_file_set_contents writes a temporary file and renames it,
+        // so concurrent attempts to store the same chunk are fine.
+        GError* error = NULL;
+        if (!g_file_set_contents(path, (const char*)aData, aSize, &error) &&
+            g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            char* dir = g_path_get_dirname(path);
+            g_clear_error(&error);
+            g_mkdir_with_parents(dir, 0700);
+            g_file_set_contents(path, (const char*)aData, aSize, &error);
+            g_free(dir);
+        }
+        if (error) {
+            HWARN(error->message);
+            g_error_free(error);
+            ok = false;
+        } else {
+            HDEBUG("Stored" << hash << aSize);
+        }
+    }
+    g_string_append(aRecipe, hash);
+    g_string_append_c(aRecipe, '\n');
+    g_free(path);
+    g_free(hash);
+    return ok;
+}
+
+bool BackupChunkStore::Private::restoreChunk(int aFd, const char* aHash,
+    guint64* aTotal) const
+{
+    bool ok = false;
+    char* path = chunkPath(aHash);
+    char* data = NULL;
+    gsize size = 0;
+    GError* error = NULL;
+    if (g_file_get_contents(path, &data, &size, &error)) {
+        char* hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256,
+            (const guchar*)data, size);
+        if (strcmp(hash, aHash)) {
+            HWARN(path << "is corrupted");
+        } else if (!writeAll(aFd, data, size)) {
+            HWARN("Write error:" << strerror(errno));
+        } else {
+            *aTotal += size;
+            ok = true;
+        }
+        g_free(hash);
+        g_free(data);
+    } else {
+        HWARN(error->message);
+        g_error_free(error);
+    }
+    g_free(path);
+    return ok;
+}
+
+// ==========================================================================
+// BackupChunkStore
+// ==========================================================================
+
+BackupChunkStore::BackupChunkStore(const QString aDir) :
+    iPrivate(new Private(aDir))
+{
+}
+
+BackupChunkStore::~BackupChunkStore()
+{
+    delete iPrivate;
+}
+
+bool BackupChunkStore::storeFile(int aRecipeDirFd, const char* aRecipeName,
+    int aSrcDirFd, const char* aSrcName, const struct stat* aStat) const
+{
+    const int fd = openat(aSrcDirFd, aSrcName, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || (!aStat && fstat(fd, &st))) {
+        HWARN("Failed to open" << aSrcName << ":" << strerror(errno));
+        if (fd >= 0) close(fd);
+        return false;
+    } else if (!aStat) {
+        aStat = &st;
+    }
+
+    const gsize bufSize = 2 * Private::MAX_CHUNK;
+    guchar* buf = (guchar*)g_malloc(bufSize);
+    GString* chunks = g_string_new(NULL);
+    gsize start = 0, avail = 0;
+    guint64 total = 0;
+    bool eof = false, ok = true;
+
+    while (ok) {
+        if (avail < Private::MAX_CHUNK && !eof) {
+            // Refill the buffer
+            memmove(buf, buf + start, avail);
+            start = 0;
+            while (avail < bufSize) {
+                const ssize_t n = read(fd, buf + avail, bufSize - avail);
+                if (n > 0) {
+                    avail += n;
+                } else if (!n) {
+                    eof = true;
+                    break;
+                } else if (errno != EINTR) {
+                    HWARN("Error reading" << aSrcName << ":" <<
+                        strerror(errno));
+                    ok = false;
+                    break;
+                }
+            }
+        }
+        if (ok && avail) {
+            const gsize n = Private::findCut(buf + start,
+                MIN(avail, (gsize)Private::MAX_CHUNK));
+            ok = iPrivate->storeChunk(buf + start, n, chunks);
+            start += n;
+            avail -= n;
+            total += n;
+        } else {
+            break;
+        }
+    }
+    close(fd);
+    g_free(buf);
+
+    if (ok) {
+        char* tmp = NULL;
+        const int out = Private::createTemp(aRecipeDirFd, aRecipeName, &tmp);
+        if (out >= 0) {
+            char* header = g_strdup_printf("%s\n%s%" G_GUINT64_FORMAT "\n",
+                Private::RECIPE_MAGIC, Private::RECIPE_SIZE, total);
+            if (Private::writeAll(out, header, strlen(header)) &&
+                Private::writeAll(out, chunks->str, chunks->len)) {
+                // The recipe carries the attributes of the original file
+                ok = Private::commitTemp(out, aRecipeDirFd, tmp,
+                    aRecipeName, aStat);
+            } else {
+                HWARN("Failed to write" << aRecipeName << ":" <<
+                    strerror(errno));
+                close(out);
+                unlinkat(aRecipeDirFd, tmp, 0);
+                ok = false;
+            }
+            if (ok) {
+                HDEBUG(aSrcName << "=>" << aRecipeName);
+            }
+            g_free(header);
+            g_free(tmp);
+        } else {
+            ok = false;
+        }
+    }
+    g_string_free(chunks, TRUE);
+    return ok;
+}
+
+bool BackupChunkStore::restoreFile(int aDestDirFd, const char* aDestName,
+    int aRecipeDirFd, const char* aRecipeName, quint64* aSize) const
+{
+    struct stat st;
+    char* contents = NULL;
+    const int in = openat(aRecipeDirFd, aRecipeName, O_RDONLY | O_CLOEXEC);
+    if (in >= 0) {
+        if (!fstat(in, &st)) {
+            contents = Private::readAll(in);
+        }
+        close(in);
+    }
+    if (!contents) {
+        HWARN("Failed to read" << aRecipeName << ":" << strerror(errno));
+        return false;
+    }
+
+    bool ok = false;
+    char** lines = g_strsplit(contents, "\n", -1);
+    if (g_strv_length(lines) >= 2 &&
+        !strcmp(lines[0], Private::RECIPE_MAGIC) &&
+        g_str_has_prefix(lines[1], Private::RECIPE_SIZE)) {
+        const guint64 size = g_ascii_strtoull(lines[1] +
+            strlen(Private::RECIPE_SIZE), NULL, 10);
+
+        // Assemble the file next to the destination and then rename it
+        char* tmp = NULL;
+        const int fd = Private::createTemp(aDestDirFd, aDestName, &tmp);
+        if (fd >= 0) {
+            guint64 total = 0;
+            ok = true;
+            for (char** ptr = lines + 2; ok && *ptr; ptr++) {
+                if (**ptr) {
+                    ok = iPrivate->restoreChunk(fd, *ptr, &total);
+                }
+            }
+            if (ok && total != size) {
+                HWARN(aRecipeName << "size mismatch" << total << "vs" <<
+                    size);
+                ok = false;
+            }
+            if (ok) {
+                ok = Private::commitTemp(fd, aDestDirFd, tmp, aDestName, &st);
+                if (ok) {
+                    HDEBUG(aRecipeName << "=>" << aDestName);
+                    if (aSize) {
+                        *aSize = size;
+                    }
+                }
+            } else {
+                close(fd);
+                unlinkat(aDestDirFd, tmp, 0);
+            }
+            g_free(tmp);
+        }
+    } else {
+        HWARN("Invalid recipe" << aRecipeName);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    return ok;
+}
+
+int BackupChunkStore::sweep(const QString aRecipeDir) const
+{
+    // Mark the chunks referenced by the recipes
+    const QByteArray recipeDir(aRecipeDir.toLocal8Bit());
+    const int recipeFd = open(recipeDir.constData(), O_RDONLY | O_DIRECTORY |
+        O_CLOEXEC);
+    if (recipeFd < 0) {
+        HWARN("Failed to open" << recipeDir.constData() << ":" <<
+            strerror(errno));
+        return -1;
+    }
+    GHashTable* used = g_hash_table_new_full(g_str_hash, g_str_equal,
+        g_free, NULL);
+    if (!Private::markRecipes(recipeFd, used)) {
+        HWARN("Not sweeping the chunks");
+        g_hash_table_destroy(used);
+        return -1;
+    }
+
+    // And sweep the rest
+    int removed = 0;
+    const int chunksFd = open(iPrivate->iDir.constData(), O_RDONLY |
+        O_DIRECTORY | O_CLOEXEC);
+    DIR* chunks = (chunksFd >= 0) ? fdopendir(chunksFd) : NULL;
+    if (chunks) {
+        const struct dirent* sub;
+        while ((sub = readdir(chunks)) != NULL) {
+            if (Private::isDotOrDotDot(sub->d_name)) {
+                continue;
+            }
+            const int fd = openat(chunksFd, sub->d_name, O_RDONLY |
+                O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            DIR* dir = (fd >= 0) ? fdopendir(fd) : NULL;
+            if (dir) {
+                const struct dirent* entry;
+                while ((entry = readdir(dir)) != NULL) {
+                    const char* name = entry->d_name;
+                    if (!Private::isDotOrDotDot(name) &&
+                        !g_hash_table_contains(used, name)) {
+                        if (!unlinkat(fd, name, 0)) {
+                            removed++;
+                        } else {
+                            HWARN("Failed to remove" << name << ":" <<
+                                strerror(errno));
+                        }
+                    }
+                }
+                closedir(dir);
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+        closedir(chunks);
+    } else if (chunksFd >= 0) {
+        close(chunksFd);
+    }
+    HDEBUG(g_hash_table_size(used) << "chunk(s) in use," << removed <<
+        "removed");
+    g_hash_table_destroy(used);
+    return removed;
+}
+
+bool BackupChunkStore::recipeSize(int aRecipeDirFd, const char* aRecipeName,
+    quint64* aSize)
+{
+    // The size is on the second line, no need to read the whole thing
+    char buf[64];
+    ssize_t len = -1;
+    const int in = openat(aRecipeDirFd, aRecipeName, O_RDONLY | O_CLOEXEC);
+    if (in >= 0) {
+        do {
+            len = pread(in, buf, sizeof(buf) - 1, 0);
+        } while (len < 0 && errno == EINTR);
+        close(in);
+    }
+    if (len > 0) {
+        const size_t magicLen = strlen(Private::RECIPE_MAGIC);
+        const size_t sizeLen = strlen(Private::RECIPE_SIZE);
+        buf[len] = 0;
+        if (!strncmp(buf, Private::RECIPE_MAGIC, magicLen) &&
+            buf[magicLen] == '\n' && !strncmp(buf + magicLen + 1,
+            Private::RECIPE_SIZE, sizeLen)) {
+            *aSize = g_ascii_strtoull(buf + magicLen + 1 + sizeLen, NULL, 10);
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef BACKUP_CHUNK_STORE_H
+#define BACKUP_CHUNK_STORE_H
+
+#include <QByteArray>
+#include <QString>
+
+#include <sys/stat.h>
+
+//
+// Content-addressed storage of file data. Files are split into
+// content-defined chunks, each unique chunk is stored once under its
+// SHA-256 hash. Each file is represented by a recipe (a text file
+// listing the hashes of its chunks) which also carries the ownership,
+// permissions and modification time of the original file.
+//
+// All methods except sweep() are thread-safe.
+//
+class BackupChunkStore {
+    Q_DISABLE_COPY(BackupChunkStore)
+    class Private;
+
+public:
+    BackupChunkStore(const QString aDir);
+    ~BackupChunkStore();
+
+    // Paths are relative to the directory descriptors (which can
+    // be AT_FDCWD). If aStat is NULL, the source file is stat'ed
+    // after it's been opened.
+    bool storeFile(int aRecipeDirFd, const char* aRecipeName,
+        int aSrcDirFd, const char* aSrcName, const struct stat* aStat) const;
+    // aSize (if not NULL) receives the size of the restored file
+    bool restoreFile(int aDestDirFd, const char* aDestName,
+        int aRecipeDirFd, const char* aRecipeName, quint64* aSize) const;
+
+    // Removes the chunks which aren't referenced by any recipe under
+    // aRecipeDir. Returns the number of removed chunks, or -1 if the
+    // recipes couldn't be read (in which case nothing is removed).
+    // Must not run concurrently with storeFile().
+    int sweep(const QString aRecipeDir) const;
+
+    // Size of the file described by the recipe, without restoring it
+    static bool recipeSize(int aRecipeDirFd, const char* aRecipeName,
+        quint64* aSize);
+
+private:
+    Private* iPrivate;
+};
+
+#endif // BACKUP_CHUNK_STORE_H
@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "BackupCopyEngine.h"
+
+#include "HarbourDebug.h"
+
+#include <glib.h>
+
+// ==========================================================================
+// BackupCopyEngine::Job
+// ==========================================================================
+
+BackupCopyEngine::Job::~Job()
+{
+}
+
+// ==========================================================================
+// BackupCopyEngine::Private
+// ==========================================================================
+
+class BackupCopyEngine::Private {
+public:
+    class Worker;
+
+    // Limits the amount of memory occupied by the queued jobs
+    enum { MAX_QUEUED_PER_WORKER = 64 };
+
+    Private(int aJobs);
+    ~Private();
+
+    void submit(Job* aJob);
+    Job* take(Worker* aWorker);
+    void done();
+    void finish();
+
+public:
+    const int iJobs;
+    const int iMaxQueued;
+    Worker** iWorkers;
+    int iWorkerCount;
+    guint iNextWorker;
+    GMutex iMutex;
+    GCond iWorkCond;
+    GCond iSpaceCond;
+    GCond iIdleCond;
+    int iQueued;  // Sitting in the queues
+    int iPending; // Queued or being run
+    bool iExit;
+};
+
+// ==========================================================================
+// BackupCopyEngine::Private::Worker
+// ==========================================================================
+
+class BackupCopyEngine::Private::Worker {
+public:
+    Worker(Private* aEngine, int aIndex);
+    ~Worker();
+
+    void start();
+    void push(Job* aJob);
+    Job* pop();
+    Job* steal();
+
+    static gpointer threadProc(gpointer aWorker);
+
+public:
+    Private* iEngine;
+    const int iIndex;
+    GMutex iMutex;
+    GQueue iQueue;
+    GThread* iThread;
+};
+
+BackupCopyEngine::Private::Worker::Worker(Private* aEngine, int aIndex) :
+    iEngine(aEngine),
+    iIndex(aIndex),
+    iThread(NULL)
+{
+    g_mutex_init(&iMutex);
+    g_queue_init(&iQueue);
+}
+
+BackupCopyEngine::Private::Worker::~Worker()
+{
+    if (iThread) {
+        g_thread_join(iThread);
+    }
+    g_mutex_clear(&iMutex);
+}
+
+void BackupCopyEngine::Private::Worker::start()
+{
+    char* name = g_strdup_printf("copy-%d", iIndex);
+    iThread = g_thread_new(name, threadProc, this);
+    g_free(name);
+}
+
+void BackupCopyEngine::Private::Worker::push(Job* aJob)
+{
+    g_mutex_lock(&iMutex);
+    g_queue_push_tail(&iQueue, aJob);
+    g_mutex_unlock(&iMutex);
+}
+
+BackupCopyEngine::Job* BackupCopyEngine::Private::Worker::pop()
+{
+    // The owner takes jobs from the head...
+    g_mutex_lock(&iMutex);
+    Job* job = (Job*)g_queue_pop_head(&iQueue);
+    g_mutex_unlock(&iMutex);
+    return job;
+}
+
+BackupCopyEngine::Job* BackupCopyEngine::Private::Worker::steal()
+{
+    // ... and the others steal from the tail
+    g_mutex_lock(&iMutex);
+    Job* job = (Job*)g_queue_pop_tail(&iQueue);
+    g_mutex_unlock(&iMutex);
+    return job;
+}
+
+gpointer BackupCopyEngine::Private::Worker::threadProc(gpointer aWorker)
+{
+    Worker* self = (Worker*)aWorker;
+    Private* engine = self->iEngine;
+    Job* job;
+
+    while ((job = engine->take(self)) != NULL) {
+        job->run();
+        delete job;
+        engine->done();
+    }
+    return NULL;
+}
+
+// ==========================================================================
+// BackupCopyEngine::Private
+// ==========================================================================
+
+BackupCopyEngine::Private::Private(int aJobs) :
+    iJobs(aJobs > 0 ? aJobs : defaultJobs()),
+    iMaxQueued(iJobs * MAX_QUEUED_PER_WORKER),
+    iWorkers(NULL),
+    iWorkerCount(0),
+    iNextWorker(0),
+    iQueued(0),
+    iPending(0),
+    iExit(false)
+{
+    g_mutex_init(&iMutex);
+    g_cond_init(&iWorkCond);
+    g_cond_init(&iSpaceCond);
+    g_cond_init(&iIdleCond);
+    if (iJobs > 1) {
+        iWorkers = new Worker*[iJobs];
+        for (int i = 0; i < iJobs; i++) {
+            iWorkers[i] = new Worker(this, i);
+        }
+        // Start the threads when all the queues are there
+        iWorkerCount = iJobs;
+        for (int i = 0; i < iWorkerCount; i++) {
+            iWorkers[i]->start();
+        }
+        HDEBUG(iWorkerCount << "copy threads");
+    }
+}
+
+BackupCopyEngine::Private::~Private()
+{
+    finish();
+    g_mutex_lock(&iMutex);
+    iExit = true;
+    g_cond_broadcast(&iWorkCond);
+    g_mutex_unlock(&iMutex);
+    for (int i = 0; i < iWorkerCount; i++) {
+        delete iWorkers[i];
+    }
+    delete [] iWorkers;
+    g_cond_clear(&iIdleCond);
+    g_cond_clear(&iSpaceCond);
+    g_cond_clear(&iWorkCond);
+    g_mutex_clear(&iMutex);
+}
+
+void BackupCopyEngine::Private::submit(Job* aJob)
+{
+    if (iWorkerCount) {
+        g_mutex_lock(&iMutex);
+        while (iQueued >= iMaxQueued) {
+            g_cond_wait(&iSpaceCond, &iMutex);
+        }
+        // Counted before it's pushed, otherwise a worker could take
+        // the job first and drive iQueued negative
+        iQueued++;
+        iPending++;
+        g_mutex_unlock(&iMutex);
+
+        // Spread the jobs evenly, stealing takes care of the rest
+        iWorkers[(iNextWorker++) % iWorkerCount]->push(aJob);
+
+        g_mutex_lock(&iMutex);
+        g_cond_signal(&iWorkCond);
+        g_mutex_unlock(&iMutex);
+    } else {
+        // Deterministic single-threaded mode
+        aJob->run();
+        delete aJob;
+    }
+}
+
+BackupCopyEngine::Job* BackupCopyEngine::Private::take(Worker* aWorker)
+{
+    for (;;) {
+        Job* job = aWorker->pop();
+        for (int i = 1; !job && i < iWorkerCount; i++) {
+            job = iWorkers[(aWorker->iIndex + i) % iWorkerCount]->steal();
+        }
+
+        g_mutex_lock(&iMutex);
+        if (job) {
+            iQueued--;
+            g_cond_signal(&iSpaceCond);
+            g_mutex_unlock(&iMutex);
+            return job;
+        } else if (!iQueued) {
+            if (iExit) {
+                g_mutex_unlock(&iMutex);
+                return NULL;
+            }
+            g_cond_wait(&iWorkCond, &iMutex);
+        }
+        // Otherwise the job is being pushed right now, try again
+        g_mutex_unlock(&iMutex);
+    }
+}
+
+void BackupCopyEngine::Private::done()
+{
+    g_mutex_lock(&iMutex);
+    if (!--iPending) {
+        g_cond_broadcast(&iIdleCond);
+    }
+    g_mutex_unlock(&iMutex);
+}
+
+void BackupCopyEngine::Private::finish()
+{
+    g_mutex_lock(&iMutex);
+    while (iPending) {
+        g_cond_wait(&iIdleCond, &iMutex);
+    }
+    g_mutex_unlock(&iMutex);
+}
+
+// ==========================================================================
+// BackupCopyEngine
+// ==========================================================================
+
+BackupCopyEngine::BackupCopyEngine(int aJobs) :
+    iPrivate(new Private(aJobs))
+{
+}
+
+BackupCopyEngine::~BackupCopyEngine()
+{
+    delete iPrivate;
+}
+
+int BackupCopyEngine::defaultJobs()
+{
+    return qMax((int)g_get_num_processors(), 1);
+}
+
+int BackupCopyEngine::jobs() const
+{
+    return iPrivate->iJobs;
+}
+
+void BackupCopyEngine::submit(Job* aJob)
+{
+    if (aJob) {
+        iPrivate->submit(aJob);
+    }
+}
+
+void BackupCopyEngine::finish()
+{
+    iPrivate->finish();
+}
@@ -0,0 +1,409 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "BackupDelta.h"
+
+#include "HarbourDebug.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QDataStream>
+#include <QVector>
+
+#include <glib.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+const qint64 BackupDelta::MIN_SIZE = 1024 * 1024;
+
+// ==========================================================================
+// BackupDelta::Private
+// ==========================================================================
+
+class BackupDelta::Private {
+public:
+    static const quint32 MAGIC = 0x4d424453; // MBDS
+    static const quint32 VERSION = 1;
+    static const int BLOCK_SIZE = 16 * 1024;
+    static const int STRONG_SIZE = 20; // SHA1
+
+    struct Block {
+        quint32 iWeak;
+        guint8 iStrong[STRONG_SIZE];
+    };
+
+    // Describes the state of the backup copy
+    class Signature {
+    public:
+        Signature();
+
+        bool load(const QString aFile);
+        bool save(const QString aFile) const;
+        bool matches(const struct stat* aStat) const;
+        void setStat(const struct stat* aStat);
+
+    public:
+        quint64 iSize;
+        qint64 iMtimeSec;
+        quint32 iMtimeNsec;
+        QVector<Block> iBlocks;
+    };
+
+    Private(const QString aSignatureDir);
+
+    static quint32 weakChecksum(const guint8* aData, gsize aSize);
+    static void strongChecksum(const guint8* aData, gsize aSize,
+        guint8* aDigest);
+    static void blockSignature(const guint8* aData, gsize aSize,
+        Block* aBlock);
+    static bool readBlock(int aFd, guint8* aBuf, gsize aSize);
+    static bool isShared(const struct stat* aDest, const struct stat* aSrc);
+    QString signatureFile(const QByteArray aRelPath) const;
+
+public:
+    const QString iSignatureDir;
+};
+
+BackupDelta::Private::Signature::Signature() :
+    iSize(0),
+    iMtimeSec(0),
+    iMtimeNsec(0)
+{
+}
+
+bool BackupDelta::Private::Signature::load(const QString aFile)
+{
+    QFile file(aFile);
+    if (file.open(QIODevice::ReadOnly)) {
+        QDataStream in(&file);
+        quint32 magic = 0, version = 0, blockSize = 0;
+        qint32 n = 0;
+        in >> magic >> version >> blockSize >> iSize >> iMtimeSec >>
+            iMtimeNsec >> n;
+        if (magic == MAGIC && version == VERSION &&
+            blockSize == BLOCK_SIZE && n >= 0 &&
+            (quint64)n == (iSize + BLOCK_SIZE - 1) / BLOCK_SIZE) {
+            iBlocks.resize(n);
+            for (int i = 0; i < n && in.status() == QDataStream::Ok; i++) {
+                Block* block = iBlocks.data() + i;
+                in >> block->iWeak;
+                in.readRawData((char*)block->iStrong, STRONG_SIZE);
+            }
+            if (in.status() == QDataStream::Ok) {
+                return true;
+            }
+        }
+        HWARN("Invalid signature" << qPrintable(aFile));
+        iBlocks.clear();
+    }
+    return false;
+}
+
+bool BackupDelta::Private::Signature::save(const QString aFile) const
+{
+    QSaveFile file(aFile);
+    QFileInfo(aFile).dir().mkpath(QStringLiteral("."));
+    if (file.open(QIODevice::WriteOnly)) {
+        QDataStream out(&file);
+        const int n = iBlocks.count();
+        out << MAGIC << VERSION << (quint32)BLOCK_SIZE << iSize <<
+            iMtimeSec << iMtimeNsec << (qint32)n;
+        for (int i = 0; i < n; i++) {
+            const Block& block = iBlocks.at(i);
+            out << block.iWeak;
+            out.writeRawData((const char*)block.iStrong, STRONG_SIZE);
+        }
+        if (out.status() == QDataStream::Ok && file.commit()) {
+            return true;
+        }
+    }
+    HWARN("Failed to write" << qPrintable(aFile));
+    return false;
+}
+
+bool BackupDelta::Private::Signature::matches(const struct stat* aStat) const
+{
+    return iSize == (quint64)aStat->st_size &&
+        iMtimeSec == (qint64)aStat->st_mtim.tv_sec &&
+        iMtimeNsec == (quint32)aStat->st_mtim.tv_nsec;
+}
+
+void BackupDelta::Private::Signature::setStat(const struct stat* aStat)
+{
+    iSize = aStat->st_size;
+    iMtimeSec = aStat->st_mtim.tv_sec;
+    iMtimeNsec = aStat->st_mtim.tv_nsec;
+}
+
+BackupDelta::Private::Private(const QString aSignatureDir) :
+    iSignatureDir(aSignatureDir)
+{
+}
+
+quint32 BackupDelta::Private::weakChecksum(const guint8* aData, gsize aSize)
+{
+    // rsync style rolling checksum
+    quint32 a = 0, b = 0;
+    for (gsize i = 0; i < aSize; i++) {
+        a += aData[i];
+        b += (quint32)(aSize - i) * aData[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+void BackupDelta::Private::strongChecksum(const guint8* aData, gsize aSize,
+    guint8* aDigest)
+{
+    GChecksum* sha1 = g_checksum_new(G_CHECKSUM_SHA1);
+    gsize len = STRONG_SIZE;
+    g_checksum_update(sha1, aData, aSize);
+    g_checksum_get_digest(sha1, aDigest, &len);
+    g_checksum_free(sha1);
+}
+
+void BackupDelta::Private::blockSignature(const guint8* aData, gsize aSize,
+    Block* aBlock)
+{
+    aBlock->iWeak = weakChecksum(aData, aSize);
+    strongChecksum(aData, aSize, aBlock->iStrong);
+}
+
+bool BackupDelta::Private::readBlock(int aFd, guint8* aBuf, gsize aSize)
+{
+    while (aSize > 0) {
+        const ssize_t n = read(aFd, aBuf, aSize);
+        if (n > 0) {
+            aBuf += n;
+            aSize -= n;
+        } else if (!n || errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BackupDelta::Private::isShared(const struct stat* aDest,
+    const struct stat* aSrc)
+{
+    return aDest->st_nlink != 1 || (aDest->st_dev == aSrc->st_dev &&
+        aDest->st_ino == aSrc->st_ino);
+}
+
+QString BackupDelta::Private::signatureFile(const QByteArray aRelPath) const
+{
+    return iSignatureDir + QDir::separator() +
+        QString::fromLocal8Bit(aRelPath);
+}
+
+// ==========================================================================
+// BackupDelta
+// ==========================================================================
+
+BackupDelta::BackupDelta(const QString aSignatureDir) :
+    iPrivate(new Private(aSignatureDir))
+{
+}
+
+BackupDelta::~BackupDelta()
+{
+    delete iPrivate;
+}
+
+bool BackupDelta::update(int aDestDirFd, const char* aDestName,
+    int aSrcDirFd, const char* aSrcName, const struct stat* aSrcStat,
+    const QByteArray aRelPath) const
+{
+    if (!aSrcStat || aSrcStat->st_size < MIN_SIZE) {
+        return false;
+    }
+
+    // The signature must describe what's in the backup right now
+    struct stat dest;
+    const QString sigFile(iPrivate->signatureFile(aRelPath));
+    Private::Signature sig;
+    if (fstatat(aDestDirFd, aDestName, &dest, AT_SYMLINK_NOFOLLOW) ||
+        !S_ISREG(dest.st_mode) || Private::isShared(&dest, aSrcStat) ||
+        !sig.load(sigFile) || !sig.matches(&dest)) {
+        return false;
+    }
+
+    const int srcFd = openat(aSrcDirFd, aSrcName, O_RDONLY | O_CLOEXEC);
+    if (srcFd < 0) {
+        return false;
+    }
+    const int destFd = openat(aDestDirFd, aDestName, O_WRONLY | O_CLOEXEC |
+        O_NOFOLLOW);
+    if (destFd < 0) {
+        close(srcFd);
+        return false;
+    }
+
+    const qint64 size = aSrcStat->st_size;
+    const int n = (int)((size + Private::BLOCK_SIZE - 1) /
+        Private::BLOCK_SIZE);
+    guint8* buf = (guint8*)g_malloc(Private::BLOCK_SIZE);
+    QVector<Private::Block> blocks(n);
+    qint64 changed = 0;
+    bool ok = true;
+
+    posix_fadvise(srcFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    for (int i = 0; i < n && ok; i++) {
+        const off_t offset = (off_t)i * Private::BLOCK_SIZE;
+        const gsize len = (gsize)qMin((qint64)Private::BLOCK_SIZE,
+            size - offset);
+        Private::Block* block = blocks.data() + i;
+        if (!Private::readBlock(srcFd, buf, len)) {
+            // The file has changed under our feet
+            ok = false;
+            break;
+        }
+
+        // Both checksums are needed for the new signature anyway. Only
+        // the blocks of the same size as before can match.
+        Private::blockSignature(buf, len, block);
+        const quint64 end = offset + len;
+        const bool same = i < sig.iBlocks.count() &&
+            (len == Private::BLOCK_SIZE ? (end <= sig.iSize) :
+            (end == sig.iSize)) &&
+            sig.iBlocks.at(i).iWeak == block->iWeak &&
+            !memcmp(block->iStrong, sig.iBlocks.at(i).iStrong,
+                Private::STRONG_SIZE);
+
+        if (!same) {
+            const guint8* ptr = buf;
+            gsize remaining = len;
+            off_t pos = offset;
+            while (remaining > 0) {
+                const ssize_t written = pwrite(destFd, ptr, remaining, pos);
+                if (written > 0) {
+                    ptr += written;
+                    remaining -= written;
+                    pos += written;
+                } else if (written < 0 && errno != EINTR) {
+                    HWARN("Failed to write" << aRelPath.constData() << ":" <<
+                        strerror(errno));
+                    ok = false;
+                    break;
+                }
+            }
+            changed += len;
+        }
+    }
+    g_free(buf);
+
+    if (ok && dest.st_size != size && ftruncate(destFd, size)) {
+        ok = false;
+    }
+
+    if (ok) {
+        // Copy the metadata
+        struct timespec times[2];
+        times[0] = aSrcStat->st_atim;
+        times[1] = aSrcStat->st_mtim;
+        if (fchown(destFd, aSrcStat->st_uid, aSrcStat->st_gid)) {
+            HWARN("Failed to chown" << aRelPath.constData() << ":" <<
+                strerror(errno));
+        }
+        if (fchmod(destFd, aSrcStat->st_mode & ~S_IFMT)) {
+            HWARN("Failed to chmod" << aRelPath.constData() << ":" <<
+                strerror(errno));
+        }
+        if (futimens(destFd, times) || fstat(destFd, &dest)) {
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        sig.iBlocks.swap(blocks);
+        sig.setStat(&dest);
+        ok = sig.save(sigFile);
+        HDEBUG(aRelPath.constData() << changed << "bytes of" << size <<
+            "updated in place");
+    } else {
+        // The copy is damaged now, make sure it's replaced
+        QFile::remove(sigFile);
+    }
+    close(destFd);
+    close(srcFd);
+    return ok;
+}
+
+void BackupDelta::sign(int aDestDirFd, const char* aDestName,
+    const QByteArray aRelPath) const
+{
+    const QString sigFile(iPrivate->signatureFile(aRelPath));
+    const int fd = openat(aDestDirFd, aDestName, O_RDONLY | O_CLOEXEC |
+        O_NOFOLLOW);
+    struct stat st;
+    if (fd >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode) &&
+        st.st_nlink == 1 && st.st_size >= MIN_SIZE) {
+        const int n = (int)((st.st_size + Private::BLOCK_SIZE - 1) /
+            Private::BLOCK_SIZE);
+        guint8* buf = (guint8*)g_malloc(Private::BLOCK_SIZE);
+        Private::Signature sig;
+        sig.iBlocks.resize(n);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        bool ok = true;
+        for (int i = 0; i < n && ok; i++) {
+            const gsize len = (gsize)qMin((qint64)Private::BLOCK_SIZE,
+                (qint64)st.st_size - (qint64)i * Private::BLOCK_SIZE);
+            ok = Private::readBlock(fd, buf, len);
+            if (ok) {
+                Private::blockSignature(buf, len, sig.iBlocks.data() + i);
+            }
+        }
+        g_free(buf);
+        if (ok) {
+            sig.setStat(&st);
+            sig.save(sigFile);
+            HDEBUG("Signed" << aRelPath.constData());
+        } else {
+            QFile::remove(sigFile);
+        }
+    } else {
+        // Shared or small files don't need signatures
+        QFile::remove(sigFile);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
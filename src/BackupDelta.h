@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef BACKUP_DELTA_H
+#define BACKUP_DELTA_H
+
+#include <QByteArray>
+#include <QString>
+
+#include <sys/stat.h>
+
+//
+// Updates large backup files in place, rewriting only the blocks which
+// have changed since the last backup. Each backed up file has a sidecar
+// signature (stored separately, under the same relative path) holding a
+// weak rolling checksum and a strong hash for each block. The weak
+// checksum is compared first, the strong one confirms the match.
+//
+// Blocks are only compared at the same offsets. Files which are shared
+// with anything else (hard links, including the ones to the live files)
+// are never touched in place.
+//
+// All methods are thread-safe.
+//
+class BackupDelta {
+    Q_DISABLE_COPY(BackupDelta)
+    class Private;
+
+public:
+    static const qint64 MIN_SIZE; // Smaller files are simply copied
+
+    BackupDelta(const QString aSignatureDir);
+    ~BackupDelta();
+
+    // Returns false if the file has to be copied in full
+    bool update(int aDestDirFd, const char* aDestName, int aSrcDirFd,
+        const char* aSrcName, const struct stat* aSrcStat,
+        const QByteArray aRelPath) const;
+
+    // Writes the signature of a fully copied file
+    void sign(int aDestDirFd, const char* aDestName,
+        const QByteArray aRelPath) const;
+
+private:
+    Private* iPrivate;
+};
+
+#endif // BACKUP_DELTA_H
@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "BackupExcludes.h"
+
+#include "HarbourDebug.h"
+
+#include <QHash>
+#include <QList>
+
+#include <glib.h>
+
+#include <string.h>
+
+// ==========================================================================
+// BackupExcludes::Node
+// ==========================================================================
+
+struct BackupExcludes::Node {
+    struct Glob {
+        QByteArray iPattern;
+        GPatternSpec* iSpec;
+        Node* iNode;
+    };
+
+    Node();
+    ~Node();
+
+    Node* literal(const QByteArray aName);
+    Node* glob(const QByteArray aPattern);
+    Node* anyDepth();
+
+    QHash<QByteArray,Node*> iLiterals;
+    QList<Glob> iGlobs;
+    Node* iAnyDepth; // The "**" child
+    bool iStar; // This is a "**" node itself
+    bool iExcluded; // Matches anything
+    bool iExcludedDir; // Matches directories only
+};
+
+BackupExcludes::Node::Node() :
+    iAnyDepth(Q_NULLPTR),
+    iStar(false),
+    iExcluded(false),
+    iExcludedDir(false)
+{
+}
+
+BackupExcludes::Node::~Node()
+{
+    qDeleteAll(iLiterals);
+    const int n = iGlobs.count();
+    for (int i = 0; i < n; i++) {
+        g_pattern_spec_free(iGlobs.at(i).iSpec);
+        delete iGlobs.at(i).iNode;
+    }
+    delete iAnyDepth;
+}
+
+BackupExcludes::Node* BackupExcludes::Node::literal(const QByteArray aName)
+{
+    Node* node = iLiterals.value(aName);
+    if (!node) {
+        node = new Node;
+        iLiterals.insert(aName, node);
+    }
+    return node;
+}
+
+BackupExcludes::Node* BackupExcludes::Node::glob(const QByteArray aPattern)
+{
+    const int n = iGlobs.count();
+    for (int i = 0; i < n; i++) {
+        if (iGlobs.at(i).iPattern == aPattern) {
+            return iGlobs.at(i).iNode;
+        }
+    }
+    Glob glob;
+    glob.iPattern = aPattern;
+    glob.iSpec = g_pattern_spec_new(aPattern.constData());
+    glob.iNode = new Node;
+    iGlobs.append(glob);
+    return glob.iNode;
+}
+
+BackupExcludes::Node* BackupExcludes::Node::anyDepth()
+{
+    if (iStar) {
+        return this; // "**/**" is the same as "**"
+    } else if (!iAnyDepth) {
+        iAnyDepth = new Node;
+        iAnyDepth->iStar = true;
+    }
+    return iAnyDepth;
+}
+
+// ==========================================================================
+// BackupExcludes::Private
+// ==========================================================================
+
+class BackupExcludes::Private {
+public:
+    Private() : iEmpty(true) {}
+
+    static QList<QByteArray> split(const QByteArray aPath);
+    static void add(State* aState, const Node* aNode);
+    void add(const QList<QByteArray> aComponents, bool aDirOnly);
+
+public:
+    Node iRoot;
+    bool iEmpty;
+};
+
+QList<QByteArray> BackupExcludes::Private::split(const QByteArray aPath)
+{
+    QList<QByteArray> out;
+    const QList<QByteArray> parts(aPath.split('/'));
+    const int n = parts.count();
+    for (int i = 0; i < n; i++) {
+        const QByteArray part(parts.at(i));
+        if (!part.isEmpty() && part != ".") {
+            out.append(part);
+        }
+    }
+    return out;
+}
+
+void BackupExcludes::Private::add(State* aState, const Node* aNode)
+{
+    // "**" may match nothing, its node is reachable right away
+    if (!aState->iNodes.contains(aNode)) {
+        aState->iNodes.append(aNode);
+        if (aNode->iAnyDepth) {
+            add(aState, aNode->iAnyDepth);
+        }
+    }
+}
+
+void BackupExcludes::Private::add(const QList<QByteArray> aComponents,
+    bool aDirOnly)
+{
+    Node* node = &iRoot;
+    const int n = aComponents.count();
+    for (int i = 0; i < n; i++) {
+        const QByteArray name(aComponents.at(i));
+        if (name == "**") {
+            node = node->anyDepth();
+        } else if (name.contains('*') || name.contains('?')) {
+            node = node->glob(name);
+        } else {
+            node = node->literal(name);
+        }
+    }
+    if (aDirOnly) {
+        node->iExcludedDir = true;
+    } else {
+        node->iExcluded = true;
+    }
+    iEmpty = false;
+}
+
+// ==========================================================================
+// BackupExcludes
+// ==========================================================================
+
+BackupExcludes::BackupExcludes() :
+    iPrivate(new Private)
+{
+}
+
+BackupExcludes::~BackupExcludes()
+{
+    delete iPrivate;
+}
+
+void BackupExcludes::addDir(const QByteArray aAbsPath)
+{
+    const QList<QByteArray> path(Private::split(aAbsPath));
+    if (!path.isEmpty()) {
+        HDEBUG("Excluding" << aAbsPath.constData());
+        iPrivate->add(path, false);
+    }
+}
+
+void BackupExcludes::addPattern(const QByteArray aRoot, const QString aPattern)
+{
+    QByteArray pattern(aPattern.trimmed().toLocal8Bit());
+    if (pattern.isEmpty() || pattern.startsWith('#')) {
+        return;
+    } else if (pattern.startsWith('!')) {
+        HWARN("Negated patterns are not supported:" << pattern.constData());
+        return;
+    }
+
+    bool dirOnly = false;
+    while (pattern.endsWith('/')) {
+        pattern.chop(1);
+        dirOnly = true;
+    }
+    if (!pattern.isEmpty()) {
+        // Patterns without slashes match at any depth
+        QList<QByteArray> path(Private::split(aRoot));
+        if (!pattern.contains('/')) {
+            path.append(QByteArray("**"));
+        }
+        path.append(Private::split(pattern));
+        HDEBUG("Excluding" << aRoot.constData() << pattern.constData() <<
+            (dirOnly ? "(directories)" : ""));
+        iPrivate->add(path, dirOnly);
+    }
+}
+
+void BackupExcludes::addPatterns(const QByteArray aRoot,
+    const QStringList aPatterns)
+{
+    const int n = aPatterns.count();
+    for (int i = 0; i < n; i++) {
+        addPattern(aRoot, aPatterns.at(i));
+    }
+}
+
+bool BackupExcludes::accept(const State& aParent, const char* aName,
+    bool aDir, State* aState) const
+{
+    State next;
+    if (!aParent.isEmpty()) {
+        const QByteArray name(QByteArray::fromRawData(aName, strlen(aName)));
+        const int n = aParent.iNodes.count();
+        for (int i = 0; i < n; i++) {
+            const Node* node = aParent.iNodes.at(i);
+            const Node* child = node->iLiterals.value(name);
+            if (node->iStar) {
+                Private::add(&next, node);
+            }
+            if (child) {
+                Private::add(&next, child);
+            }
+            const int k = node->iGlobs.count();
+            for (int j = 0; j < k; j++) {
+                const Node::Glob& glob = node->iGlobs.at(j);
+                if (g_pattern_match_string(glob.iSpec, aName)) {
+                    Private::add(&next, glob.iNode);
+                }
+            }
+        }
+
+        const int k = next.iNodes.count();
+        for (int j = 0; j < k; j++) {
+            const Node* node = next.iNodes.at(j);
+            if (node->iExcluded || (aDir && node->iExcludedDir)) {
+                HDEBUG(aName << "is excluded");
+                return false;
+            }
+        }
+    }
+    if (aState) {
+        *aState = next;
+    }
+    return true;
+}
+
+bool BackupExcludes::acceptPath(const QByteArray aAbsPath, bool aDir,
+    State* aState) const
+{
+    // Everything above the last component is a directory
+    State state;
+    if (!iPrivate->iEmpty) {
+        Private::add(&state, &iPrivate->iRoot);
+        const QList<QByteArray> path(Private::split(aAbsPath));
+        const int n = path.count();
+        for (int i = 0; i < n && !state.isEmpty(); i++) {
+            if (!accept(state, path.at(i).constData(), aDir || i < n - 1,
+                &state)) {
+                HDEBUG(aAbsPath.constData() << "is excluded");
+                return false;
+            }
+        }
+    }
+    if (aState) {
+        *aState = state;
+    }
+    return true;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef BACKUP_EXCLUDES_H
+#define BACKUP_EXCLUDES_H
+
+#include <QByteArray>
+#include <QStringList>
+#include <QVector>
+
+//
+// Compiled set of exclusions, evaluated one path component at a time
+// while the directory tree is being traversed. Excluded directories are
+// pruned without descending into them.
+//
+// Excluded directories (such as the backup directory itself) are given
+// as absolute paths. Patterns are gitignore-style and relative to the
+// directory they are added for:
+//
+//   - a pattern without slashes (other than the trailing one) matches
+//     a name at any depth, e.g. "*.tmp" or "node_modules/"
+//   - other patterns are anchored, e.g. ".cache/" or "/Pictures/*/thumbs"
+//   - a trailing slash makes the pattern match directories only
+//   - "*" and "?" match within a component, "**" matches any number of
+//     components
+//
+// Negation ("!") and character classes are not supported. Once compiled,
+// the matcher is immutable and can be used by several threads at once.
+//
+class BackupExcludes {
+    Q_DISABLE_COPY(BackupExcludes)
+    class Private;
+    struct Node;
+
+public:
+    // Position of a directory in the compiled patterns. Empty state
+    // means that nothing below that directory can be excluded.
+    class State {
+        friend class BackupExcludes;
+        friend class Private;
+    public:
+        bool isEmpty() const { return iNodes.isEmpty(); }
+    private:
+        QVector<const Node*> iNodes;
+    };
+
+    BackupExcludes();
+    ~BackupExcludes();
+
+    void addDir(const QByteArray aAbsPath);
+    void addPattern(const QByteArray aRoot, const QString aPattern);
+    void addPatterns(const QByteArray aRoot, const QStringList aPatterns);
+
+    // These return false if the entry is excluded, otherwise fill
+    // the state of the entry (if it's a directory and aState isn't NULL)
+    bool accept(const State& aParent, const char* aName, bool aDir,
+        State* aState = Q_NULLPTR) const;
+    bool acceptPath(const QByteArray aAbsPath, bool aDir,
+        State* aState = Q_NULLPTR) const;
+
+private:
+    Private* iPrivate;
+};
+
+#endif // BACKUP_EXCLUDES_H
@@ -0,0 +1,623 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "BackupFileCopier.h"
+
+#include "HarbourDebug.h"
+
+#include <glib.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
+#ifndef FICLONE
+#  define FICLONE _IOW(0x94, 9, int)
+#endif
+
+// ==========================================================================
+// BackupFileCopier::Private
+// ==========================================================================
+
+class BackupFileCopier::Private {
+public:
+    enum {
+        MAX_DEVICE_PAIRS = 16,
+        BUFFER_SIZE = 256 * 1024,
+        BUFFER_ALIGN = 4096,
+        MAX_BUFFERS = 16,
+        DEFAULT_READ_AHEAD = 4 * BUFFER_SIZE,
+        MAX_TEMP_ATTEMPTS = 8,
+        CHUNK_SIZE = 0x40000000 // Max bytes per copy_file_range/sendfile
+    };
+
+    struct DevicePair {
+        dev_t iSrcDev;
+        dev_t iDestDev;
+        Method iMethod;
+    };
+
+    struct Pipe;
+
+    Private(int aReadAhead);
+    ~Private();
+
+    Method method(dev_t aSrcDev, dev_t aDestDev);
+    void setMethod(dev_t aSrcDev, dev_t aDestDev, Method aMethod);
+    char* allocBuffer();
+    void freeBuffer(char* aBuf);
+
+    static bool isUnsupported(int aError);
+    static int reflink(int aDestFd, int aSrcFd);
+    static int copyFileRange(int aDestFd, int aSrcFd);
+    static int sendFile(int aDestFd, int aSrcFd);
+    static ssize_t readBlock(int aFd, char* aBuf, off_t aOffset);
+    static int writeBlock(int aFd, const char* aBuf, size_t aSize,
+        off_t aOffset);
+    static gpointer readProc(gpointer aPipe);
+    int readWrite(int aDestFd, int aSrcFd);
+    int pipeCopy(int aDestFd, int aSrcFd);
+    int copyData(int aDestFd, int aSrcFd, off_t aSize, Method* aMethod);
+
+public:
+    GMutex iMutex;
+    DevicePair iPairs[MAX_DEVICE_PAIRS];
+    int iPairCount;
+    int iBufferCount; // Per pipeline
+    GSList* iFreeBuffers; // Reused by the next copy
+};
+
+// Ring of buffers between the reader thread and the writer
+struct BackupFileCopier::Private::Pipe {
+    GMutex iMutex;
+    GCond iCond;
+    int iSrcFd;
+    off_t iReadAhead;
+    int iCount;
+    int iFilled;
+    bool iCancel;
+    char* iBuf[MAX_BUFFERS];
+    ssize_t iLen[MAX_BUFFERS]; // Zero at the end, negative errno on error
+};
+
+BackupFileCopier::Private::Private(int aReadAhead) :
+    iPairCount(0),
+    iBufferCount(CLAMP((aReadAhead > 0 ? aReadAhead : DEFAULT_READ_AHEAD) /
+        BUFFER_SIZE, 2, MAX_BUFFERS)),
+    iFreeBuffers(NULL)
+{
+    g_mutex_init(&iMutex);
+}
+
+BackupFileCopier::Private::~Private()
+{
+    g_slist_free_full(iFreeBuffers, free);
+    g_mutex_clear(&iMutex);
+}
+
+BackupFileCopier::Method BackupFileCopier::Private::method(dev_t aSrcDev,
+    dev_t aDestDev)
+{
+    Method method = MethodReflink;
+    g_mutex_lock(&iMutex);
+    for (int i = 0; i < iPairCount; i++) {
+        const DevicePair* pair = iPairs + i;
+        if (pair->iSrcDev == aSrcDev && pair->iDestDev == aDestDev) {
+            method = pair->iMethod;
+            break;
+        }
+    }
+    g_mutex_unlock(&iMutex);
+    return method;
+}
+
+void BackupFileCopier::Private::setMethod(dev_t aSrcDev, dev_t aDestDev,
+    Method aMethod)
+{
+    g_mutex_lock(&iMutex);
+    int i;
+    for (i = 0; i < iPairCount; i++) {
+        DevicePair* pair = iPairs + i;
+        if (pair->iSrcDev == aSrcDev && pair->iDestDev == aDestDev) {
+            pair->iMethod = aMethod;
+            break;
+        }
+    }
+    if (i == iPairCount && iPairCount < MAX_DEVICE_PAIRS) {
+        DevicePair* pair = iPairs + (iPairCount++);
+        pair->iSrcDev = aSrcDev;
+        pair->iDestDev = aDestDev;
+        pair->iMethod = aMethod;
+    }
+    g_mutex_unlock(&iMutex);
+}
+
+char* BackupFileCopier::Private::allocBuffer()
+{
+    g_mutex_lock(&iMutex);
+    char* buf = (char*)(iFreeBuffers ? iFreeBuffers->data : NULL);
+    iFreeBuffers = g_slist_delete_link(iFreeBuffers, iFreeBuffers);
+    g_mutex_unlock(&iMutex);
+    if (!buf) {
+        void* ptr = NULL;
+        if (!posix_memalign(&ptr, BUFFER_ALIGN, BUFFER_SIZE)) {
+            buf = (char*)ptr;
+        }
+    }
+    return buf;
+}
+
+void BackupFileCopier::Private::freeBuffer(char* aBuf)
+{
+    if (aBuf) {
+        g_mutex_lock(&iMutex);
+        iFreeBuffers = g_slist_prepend(iFreeBuffers, aBuf);
+        g_mutex_unlock(&iMutex);
+    }
+}
+
+bool BackupFileCopier::Private::isUnsupported(int aError)
+{
+    switch (aError) {
+    case ENOSYS:
+    case ENOTTY:
+    case EXDEV:
+    case EINVAL:
+    case EOPNOTSUPP:
+#if ENOTSUP != EOPNOTSUPP
+    case ENOTSUP:
+#endif
+        return true;
+    }
+    return false;
+}
+
+int BackupFileCopier::Private::reflink(int aDestFd, int aSrcFd)
+{
+    return ioctl(aDestFd, FICLONE, aSrcFd) ? errno : 0;
+}
+
+int BackupFileCopier::Private::copyFileRange(int aDestFd, int aSrcFd)
+{
+#ifdef __NR_copy_file_range
+    loff_t srcOff = 0, destOff = 0;
+    for (;;) {
+        const ssize_t n = syscall(__NR_copy_file_range, aSrcFd, &srcOff,
+            aDestFd, &destOff, (size_t)CHUNK_SIZE, 0);
+        if (n > 0) {
+            continue;
+        } else if (!n) {
+            // Some file systems pretend that there's nothing to copy
+            return (srcOff || !lseek(aSrcFd, 0, SEEK_END)) ? 0 : EINVAL;
+        } else if (errno != EINTR) {
+            // Don't fall back in the middle of the file
+            return (srcOff && isUnsupported(errno)) ? EIO : errno;
+        }
+    }
+#else
+    return ENOSYS;
+#endif
+}
+
+int BackupFileCopier::Private::sendFile(int aDestFd, int aSrcFd)
+{
+    off_t srcOff = 0;
+    for (;;) {
+        const ssize_t n = sendfile(aDestFd, aSrcFd, &srcOff, CHUNK_SIZE);
+        if (n > 0) {
+            continue;
+        } else if (!n) {
+            return 0;
+        } else if (errno != EINTR) {
+            return (srcOff && isUnsupported(errno)) ? EIO : errno;
+        }
+    }
+}
+
+ssize_t BackupFileCopier::Private::readBlock(int aFd, char* aBuf,
+    off_t aOffset)
+{
+    // Returns less than BUFFER_SIZE only at the end of file
+    ssize_t total = 0;
+    while (total < BUFFER_SIZE) {
+        const ssize_t n = pread(aFd, aBuf + total, BUFFER_SIZE - total,
+            aOffset + total);
+        if (n > 0) {
+            total += n;
+        } else if (!n) {
+            break;
+        } else if (errno != EINTR) {
+            return -errno;
+        }
+    }
+    return total;
+}
+
+int BackupFileCopier::Private::writeBlock(int aFd, const char* aBuf,
+    size_t aSize, off_t aOffset)
+{
+    size_t written = 0;
+    while (written < aSize) {
+        const ssize_t n = pwrite(aFd, aBuf + written, aSize - written,
+            aOffset + written);
+        if (n > 0) {
+            written += n;
+        } else if (n < 0 && errno != EINTR) {
+            return errno;
+        }
+    }
+    return 0;
+}
+
+gpointer BackupFileCopier::Private::readProc(gpointer aPipe)
+{
+    Pipe* pipe = (Pipe*)aPipe;
+    off_t off = 0;
+    for (int slot = 0; ; slot = (slot + 1) % pipe->iCount) {
+        g_mutex_lock(&pipe->iMutex);
+        while (pipe->iFilled == pipe->iCount && !pipe->iCancel) {
+            g_cond_wait(&pipe->iCond, &pipe->iMutex);
+        }
+        const bool cancel = pipe->iCancel;
+        g_mutex_unlock(&pipe->iMutex);
+        if (cancel) {
+            break;
+        }
+
+        // Keep the kernel busy reading the next window while we are
+        // reading this block. Once the data is in the buffer, the page
+        // cache doesn't need it anymore.
+        posix_fadvise(pipe->iSrcFd, off + BUFFER_SIZE, pipe->iReadAhead,
+            POSIX_FADV_WILLNEED);
+        const ssize_t n = readBlock(pipe->iSrcFd, pipe->iBuf[slot], off);
+        if (n > 0) {
+            posix_fadvise(pipe->iSrcFd, off, n, POSIX_FADV_DONTNEED);
+            off += n;
+        }
+
+        g_mutex_lock(&pipe->iMutex);
+        pipe->iLen[slot] = n;
+        pipe->iFilled++;
+        g_cond_broadcast(&pipe->iCond);
+        g_mutex_unlock(&pipe->iMutex);
+        if (n <= 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+int BackupFileCopier::Private::pipeCopy(int aDestFd, int aSrcFd)
+{
+    Pipe pipe;
+    g_mutex_init(&pipe.iMutex);
+    g_cond_init(&pipe.iCond);
+    pipe.iSrcFd = aSrcFd;
+    pipe.iReadAhead = (off_t)iBufferCount * BUFFER_SIZE;
+    pipe.iCount = 0;
+    pipe.iFilled = 0;
+    pipe.iCancel = false;
+    while (pipe.iCount < iBufferCount) {
+        char* buf = allocBuffer();
+        if (!buf) break;
+        pipe.iBuf[pipe.iCount++] = buf;
+    }
+
+    int err = 0;
+    if (pipe.iCount < 2) {
+        err = ENOMEM;
+    } else {
+        posix_fadvise(aSrcFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        GThread* reader = g_thread_new("reader", readProc, &pipe);
+        off_t off = 0, dropped = 0;
+        for (int slot = 0; ; slot = (slot + 1) % pipe.iCount) {
+            g_mutex_lock(&pipe.iMutex);
+            while (!pipe.iFilled) {
+                g_cond_wait(&pipe.iCond, &pipe.iMutex);
+            }
+            const ssize_t n = pipe.iLen[slot];
+            g_mutex_unlock(&pipe.iMutex);
+            if (n <= 0) {
+                err = -n;
+                break;
+            }
+
+            err = writeBlock(aDestFd, pipe.iBuf[slot], n, off);
+            g_mutex_lock(&pipe.iMutex);
+            pipe.iFilled--;
+            g_cond_broadcast(&pipe.iCond);
+            g_mutex_unlock(&pipe.iMutex);
+            if (err) {
+                break;
+            }
+
+            // Start writing this block back right away. Whatever was
+            // written one window ago is waited for and dropped from
+            // the page cache, that bounds the amount of dirty pages.
+            sync_file_range(aDestFd, off, n, SYNC_FILE_RANGE_WRITE);
+            off += n;
+            if (off - dropped > 2 * pipe.iReadAhead) {
+                const off_t len = off - dropped - pipe.iReadAhead;
+                sync_file_range(aDestFd, dropped, len,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                    SYNC_FILE_RANGE_WAIT_AFTER);
+                posix_fadvise(aDestFd, dropped, len, POSIX_FADV_DONTNEED);
+                dropped += len;
+            }
+        }
+        if (err) {
+            g_mutex_lock(&pipe.iMutex);
+            pipe.iCancel = true;
+            g_cond_broadcast(&pipe.iCond);
+            g_mutex_unlock(&pipe.iMutex);
+        }
+        g_thread_join(reader);
+    }
+
+    for (int i = 0; i < pipe.iCount; i++) {
+        freeBuffer(pipe.iBuf[i]);
+    }
+    g_cond_clear(&pipe.iCond);
+    g_mutex_clear(&pipe.iMutex);
+    return err;
+}
+
+int BackupFileCopier::Private::readWrite(int aDestFd, int aSrcFd)
+{
+    // Small files don't need the reader thread
+    char* buf = allocBuffer();
+    if (!buf) {
+        return ENOMEM;
+    }
+    off_t off = 0;
+    int err = 0;
+    for (;;) {
+        const ssize_t n = readBlock(aSrcFd, buf, off);
+        if (n > 0) {
+            err = writeBlock(aDestFd, buf, n, off);
+            if (err) break;
+            off += n;
+        } else {
+            err = -n;
+            break;
+        }
+    }
+    if (!err && off) {
+        posix_fadvise(aSrcFd, 0, off, POSIX_FADV_DONTNEED);
+    }
+    freeBuffer(buf);
+    return err;
+}
+
+int BackupFileCopier::Private::copyData(int aDestFd, int aSrcFd,
+    off_t aSize, Method* aMethod)
+{
+    for (;;) {
+        int err;
+        switch (*aMethod) {
+        case MethodReflink:
+            err = reflink(aDestFd, aSrcFd);
+            break;
+        case MethodCopyFileRange:
+            err = copyFileRange(aDestFd, aSrcFd);
+            break;
+        case MethodSendfile:
+            err = sendFile(aDestFd, aSrcFd);
+            break;
+        case MethodReadWrite:
+        default:
+            return (aSize > BUFFER_SIZE) ? pipeCopy(aDestFd, aSrcFd) :
+                readWrite(aDestFd, aSrcFd);
+        }
+        if (!err || !isUnsupported(err)) {
+            return err;
+        }
+        // Try the next one, starting from scratch
+        *aMethod = (Method)(*aMethod + 1);
+        if (ftruncate(aDestFd, 0) || lseek(aDestFd, 0, SEEK_SET) < 0) {
+            return errno;
+        }
+    }
+}
+
+// ==========================================================================
+// BackupFileCopier
+// ==========================================================================
+
+BackupFileCopier::BackupFileCopier(int aReadAhead) :
+    iPrivate(new Private(aReadAhead))
+{
+}
+
+BackupFileCopier::~BackupFileCopier()
+{
+    delete iPrivate;
+}
+
+int BackupFileCopier::copy(int aDestDirFd, const char* aDestName,
+    int aSrcDirFd, const char* aSrcName, struct stat* aSrcStat)
+{
+    const int srcFd = openat(aSrcDirFd, aSrcName, O_RDONLY | O_CLOEXEC);
+    if (srcFd < 0) {
+        return errno;
+    }
+
+    // The file may have changed since it was scanned, what's copied is
+    // described by the stat of the open file
+    struct stat srcStat;
+    if (fstat(srcFd, &srcStat)) {
+        const int err = errno;
+        close(srcFd);
+        return err;
+    }
+
+    // The old copy stays there until the new one is complete
+    char tmpName[TEMP_NAME_SIZE];
+    const int destFd = createTemp(aDestDirFd, tmpName);
+    if (destFd < 0) {
+        const int err = errno;
+        close(srcFd);
+        return err;
+    }
+
+    int err = 0;
+    struct stat destStat;
+    if (srcStat.st_size > 0) {
+        if (fstat(destFd, &destStat)) {
+            err = errno;
+        } else {
+            const Method start = iPrivate->method(srcStat.st_dev,
+                destStat.st_dev);
+            Method method = start;
+            err = iPrivate->copyData(destFd, srcFd, srcStat.st_size,
+                &method);
+            if (!err && method != start) {
+                HDEBUG("Using method" << method << "for" <<
+                    srcStat.st_dev << "=>" << destStat.st_dev);
+                iPrivate->setMethod(srcStat.st_dev, destStat.st_dev,
+                    method);
+            }
+        }
+    }
+
+    if (!err) {
+        copyMetadata(destFd, &srcStat, aDestName);
+        err = commitTemp(destFd, aDestDirFd, tmpName, aDestName);
+    }
+    if (close(destFd) && !err) {
+        err = errno;
+    }
+    close(srcFd);
+    if (err) {
+        discardTemp(aDestDirFd, tmpName);
+    } else if (aSrcStat) {
+        *aSrcStat = srcStat;
+    }
+    return err;
+}
+
+void BackupFileCopier::tempName(char* aBuf)
+{
+    // Hidden and short enough for any file system
+    snprintf(aBuf, TEMP_NAME_SIZE, ".mybackup-%08x", g_random_int());
+}
+
+int BackupFileCopier::createTemp(int aDirFd, char* aTmpName)
+{
+    aTmpName[0] = 0;
+#ifdef O_TMPFILE
+    // Anonymous files get linked via /proc, see commitTemp()
+    static const bool haveProcFd = !access("/proc/self/fd", F_OK);
+    if (haveProcFd) {
+        const int fd = openat(aDirFd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC,
+            0600);
+        if (fd >= 0) {
+            return fd;
+        }
+        // Not supported by the file system, fall back to a named file
+    }
+#endif
+    for (int i = 0; i < Private::MAX_TEMP_ATTEMPTS; i++) {
+        tempName(aTmpName);
+        const int fd = openat(aDirFd, aTmpName, O_WRONLY | O_CREAT |
+            O_EXCL | O_CLOEXEC, 0600);
+        if (fd >= 0 || errno != EEXIST) {
+            if (fd < 0) aTmpName[0] = 0;
+            return fd;
+        }
+    }
+    aTmpName[0] = 0;
+    errno = EEXIST;
+    return -1;
+}
+
+int BackupFileCopier::commitTemp(int aFd, int aDirFd, char* aTmpName,
+    const char* aName)
+{
+    if (!aTmpName[0]) {
+        // Give the anonymous file a name first
+        char proc[32];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", aFd);
+        int i;
+        for (i = 0; i < Private::MAX_TEMP_ATTEMPTS; i++) {
+            tempName(aTmpName);
+            if (!linkat(AT_FDCWD, proc, aDirFd, aTmpName,
+                AT_SYMLINK_FOLLOW)) {
+                break;
+            } else if (errno != EEXIST) {
+                const int err = errno;
+                aTmpName[0] = 0;
+                return err;
+            }
+        }
+        if (i == Private::MAX_TEMP_ATTEMPTS) {
+            aTmpName[0] = 0;
+            return EEXIST;
+        }
+    }
+    // Renaming replaces the old file (and breaks the hard links to it)
+    return renameat(aDirFd, aTmpName, aDirFd, aName) ? errno : 0;
+}
+
+void BackupFileCopier::discardTemp(int aDirFd, char* aTmpName)
+{
+    if (aTmpName[0]) {
+        unlinkat(aDirFd, aTmpName, 0);
+        aTmpName[0] = 0;
+    }
+}
+
+void BackupFileCopier::copyMetadata(int aDestFd, const struct stat* aStat,
+    const char* aName)
+{
+    const struct timespec times[2] = { aStat->st_atim, aStat->st_mtim };
+    if (fchown(aDestFd, aStat->st_uid, aStat->st_gid)) {
+        HWARN("Failed to chown" << aName << ":" << strerror(errno));
+    }
+    if (fchmod(aDestFd, aStat->st_mode & ~S_IFMT)) {
+        HWARN("Failed to chmod" << aName << ":" << strerror(errno));
+    }
+    if (futimens(aDestFd, times)) {
+        HWARN("Failed to set times" << aName << ":" << strerror(errno));
+    }
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef BACKUP_FILE_COPIER_H
+#define BACKUP_FILE_COPIER_H
+
+#include <QtGlobal>
+
+#include <sys/stat.h>
+
+//
+// Copies regular files with the cheapest method supported by the source
+// and destination file systems, trying them in this order:
+//
+//   1. Reflink (FICLONE ioctl)
+//   2. copy_file_range()
+//   3. sendfile()
+//   4. read()/write() loop
+//
+// The method that works is remembered for each pair of devices, so that
+// the unsupported ones are only probed once. Ownership, permissions and
+// timestamps are copied too. All methods are thread-safe.
+//
+// The data is written to a temporary file which replaces the destination
+// only when everything has been copied. That breaks hard links to the old
+// copy without losing it if something goes wrong.
+//
+// In the read()/write() case larger files are copied by a pipeline. A
+// reader thread fills a fixed ring of aligned buffers (read-ahead window)
+// while the calling thread drains them. The page cache is advised to
+// read ahead and to drop the pages that have already been copied, so that
+// backups don't push everything else out of memory.
+//
+class BackupFileCopier {
+    Q_DISABLE_COPY(BackupFileCopier)
+    class Private;
+
+public:
+    enum Method {
+        MethodReflink,
+        MethodCopyFileRange,
+        MethodSendfile,
+        MethodReadWrite
+    };
+
+    enum {
+        TEMP_NAME_SIZE = 24
+    };
+
+    BackupFileCopier(int aReadAhead = 0); // Bytes, 0 = default
+    ~BackupFileCopier();
+
+    // Returns zero on success, errno on failure. The file is copied up
+    // to the end, whatever its size was when it was scanned. If aSrcStat
+    // isn't NULL, it receives the stat of the source as it was copied.
+    int copy(int aDestDirFd, const char* aDestName, int aSrcDirFd,
+        const char* aSrcName, struct stat* aSrcStat);
+
+    // Random hidden name for a temporary file, TEMP_NAME_SIZE bytes
+    static void tempName(char* aBuf);
+
+    // Temporary file in aDirFd, anonymous (O_TMPFILE) if possible.
+    // Otherwise it has a hidden name stored in aTmpName (TEMP_NAME_SIZE
+    // bytes), which is empty for the anonymous ones. Returns -1 and sets
+    // errno on failure.
+    static int createTemp(int aDirFd, char* aTmpName);
+
+    // Atomically replaces aName with the temporary file, which must still
+    // be open. Returns zero on success, errno on failure.
+    static int commitTemp(int aFd, int aDirFd, char* aTmpName,
+        const char* aName);
+
+    // Removes the named temporary file, if any
+    static void discardTemp(int aDirFd, char* aTmpName);
+
+    // Ownership, permissions and timestamps. Failures are only logged.
+    static void copyMetadata(int aDestFd, const struct stat* aStat,
+        const char* aName);
+
+private:
+    Private* iPrivate;
+};
+
+#endif // BACKUP_FILE_COPIER_H
@@ -0,0 +1,613 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "BackupJson.h"
+
+#include "HarbourDebug.h"
+
+#include <QFile>
+#include <QVector>
+#include <qnumeric.h>
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <string.h>
+
+// ==========================================================================
+// BackupJson::Writer::Private
+// ==========================================================================
+
+class BackupJson::Writer::Private {
+public:
+    static const int BUF_SIZE = 0x10000;
+    static const int INDENT = 4;
+
+    Private(const QString aPath);
+
+    void flush();
+    void write(const char* aData, int aSize);
+    void write(const char* aString) { write(aString, (int)strlen(aString)); }
+    void writeString(const QString aString);
+    void writeValue(const QVariant aValue);
+    void separate();
+    void begin(char aBracket);
+    void end(char aBracket);
+
+public:
+    QFile iFile;
+    QByteArray iBuf;
+    QVector<bool> iStack; // True if the container is still empty
+    bool iAfterName;
+    bool iError;
+};
+
+BackupJson::Writer::Private::Private(const QString aPath) :
+    iFile(aPath),
+    iAfterName(false),
+    iError(false)
+{
+    if (iFile.open(QIODevice::WriteOnly | QIODevice::Unbuffered)) {
+        iBuf.reserve(BUF_SIZE);
+    } else {
+        HWARN("Failed to open" << qPrintable(aPath));
+        iError = true;
+    }
+}
+
+void BackupJson::Writer::Private::flush()
+{
+    if (!iBuf.isEmpty()) {
+        if (!iError && iFile.write(iBuf) != iBuf.size()) {
+            HWARN("Failed to write" << qPrintable(iFile.fileName()));
+            iError = true;
+        }
+        iBuf.resize(0);
+    }
+}
+
+void BackupJson::Writer::Private::write(const char* aData, int aSize)
+{
+    iBuf.append(aData, aSize);
+    if (iBuf.size() >= BUF_SIZE) {
+        flush();
+    }
+}
+
+void BackupJson::Writer::Private::writeString(const QString aString)
+{
+    const QByteArray utf8(aString.toUtf8());
+    const char* ptr = utf8.constData();
+    const char* end = ptr + utf8.size();
+    const char* chunk = ptr;
+
+    write("\"", 1);
+    for (; ptr < end; ptr++) {
+        const uchar c = *ptr;
+        if (c < 0x20 || c == '"' || c == '\\') {
+            char esc[8];
+            write(chunk, ptr - chunk);
+            chunk = ptr + 1;
+            switch (c) {
+            case '"': write("\\\""); break;
+            case '\\': write("\\\\"); break;
+            case '\b': write("\\b"); break;
+            case '\f': write("\\f"); break;
+            case '\n': write("\\n"); break;
+            case '\r': write("\\r"); break;
+            case '\t': write("\\t"); break;
+            default:
+                snprintf(esc, sizeof(esc), "\\u%04x", c);
+                write(esc);
+                break;
+            }
+        }
+    }
+    write(chunk, ptr - chunk);
+    write("\"", 1);
+}
+
+void BackupJson::Writer::Private::writeValue(const QVariant aValue)
+{
+    switch (aValue.userType()) {
+    case QMetaType::UnknownType:
+        write("null");
+        break;
+    case QMetaType::Bool:
+        write(aValue.toBool() ? "true" : "false");
+        break;
+    case QMetaType::Int:
+    case QMetaType::Short:
+    case QMetaType::Char:
+    case QMetaType::SChar:
+    case QMetaType::Long:
+    case QMetaType::LongLong:
+        write(QByteArray::number(aValue.toLongLong()).constData());
+        break;
+    case QMetaType::UInt:
+    case QMetaType::UShort:
+    case QMetaType::UChar:
+    case QMetaType::ULong:
+    case QMetaType::ULongLong:
+        write(QByteArray::number(aValue.toULongLong()).constData());
+        break;
+    case QMetaType::Float:
+    case QMetaType::Double:
+        {
+            const double d = aValue.toDouble();
+            if (qIsFinite(d)) {
+                char buf[G_ASCII_DTOSTR_BUF_SIZE];
+                write(g_ascii_dtostr(buf, sizeof(buf), d));
+            } else {
+                write("null");
+            }
+        }
+        break;
+    case QMetaType::QVariantList:
+    case QMetaType::QStringList:
+        {
+            const QVariantList list(aValue.toList());
+            const int n = list.count();
+            begin('[');
+            for (int i = 0; i < n; i++) {
+                separate();
+                writeValue(list.at(i));
+            }
+            end(']');
+        }
+        break;
+    case QMetaType::QVariantMap:
+        {
+            const QVariantMap map(aValue.toMap());
+            begin('{');
+            for (QVariantMap::ConstIterator it = map.constBegin();
+                 it != map.constEnd(); it++) {
+                separate();
+                writeString(it.key());
+                write(": ");
+                writeValue(it.value());
+            }
+            end('}');
+        }
+        break;
+    default:
+        if (aValue.canConvert<QString>()) {
+            writeString(aValue.toString());
+        } else {
+            write("null");
+        }
+        break;
+    }
+}
+
+// Puts each element on its own line, the way QJsonDocument does it
+void BackupJson::Writer::Private::separate()
+{
+    if (iAfterName) {
+        iAfterName = false;
+    } else if (!iStack.isEmpty()) {
+        bool& empty = iStack.last();
+        if (empty) {
+            empty = false;
+            write("\n", 1);
+        } else {
+            write(",\n", 2);
+        }
+        for (int i = iStack.count() * INDENT; i > 0; i--) {
+            write(" ", 1);
+        }
+    }
+}
+
+void BackupJson::Writer::Private::begin(char aBracket)
+{
+    write(&aBracket, 1);
+    iStack.append(true);
+}
+
+void BackupJson::Writer::Private::end(char aBracket)
+{
+    if (!iStack.isEmpty()) {
+        const bool empty = iStack.takeLast();
+        if (!empty) {
+            write("\n", 1);
+            for (int i = iStack.count() * INDENT; i > 0; i--) {
+                write(" ", 1);
+            }
+        }
+        write(&aBracket, 1);
+    }
+}
+
+// ==========================================================================
+// BackupJson::Writer
+// ==========================================================================
+
+BackupJson::Writer::Writer(const QString aPath) :
+    iPrivate(new Private(aPath))
+{
+}
+
+BackupJson::Writer::~Writer()
+{
+    delete iPrivate;
+}
+
+bool BackupJson::Writer::isOpen() const
+{
+    return iPrivate->iFile.isOpen();
+}
+
+void BackupJson::Writer::beginObject()
+{
+    iPrivate->separate();
+    iPrivate->begin('{');
+}
+
+void BackupJson::Writer::endObject()
+{
+    iPrivate->end('}');
+}
+
+void BackupJson::Writer::beginArray()
+{
+    iPrivate->separate();
+    iPrivate->begin('[');
+}
+
+void BackupJson::Writer::endArray()
+{
+    iPrivate->end(']');
+}
+
+void BackupJson::Writer::name(const QString aName)
+{
+    iPrivate->separate();
+    iPrivate->writeString(aName);
+    iPrivate->write(": ", 2);
+    iPrivate->iAfterName = true;
+}
+
+void BackupJson::Writer::value(const QVariant aValue)
+{
+    iPrivate->separate();
+    iPrivate->writeValue(aValue);
+}
+
+bool BackupJson::Writer::finish()
+{
+    if (iPrivate->iFile.isOpen()) {
+        iPrivate->write("\n", 1);
+        iPrivate->flush();
+        iPrivate->iFile.close();
+    }
+    return !iPrivate->iError;
+}
+
+// ==========================================================================
+// BackupJson::Reader::Private
+// ==========================================================================
+
+class BackupJson::Reader::Private {
+public:
+    static const int BUF_SIZE = 0x10000;
+
+    Private(const QString aPath);
+
+    int peek();
+    int get() { const int c = peek(); if (c >= 0) iPos++; return c; }
+    bool expect(const char* aLiteral);
+    bool readString(QString* aString);
+    bool readHex(guint* aValue);
+    bool readNumber();
+    Token token(Token aToken) { if (aToken == Error) iError = true; return aToken; }
+    Token next();
+
+public:
+    QFile iFile;
+    QByteArray iBuf;
+    int iPos;
+    QVector<bool> iStack; // True for objects, false for arrays
+    bool iExpectName;
+    bool iError;
+    QString iName;
+    QVariant iValue;
+};
+
+BackupJson::Reader::Private::Private(const QString aPath) :
+    iFile(aPath),
+    iPos(0),
+    iExpectName(false),
+    iError(false)
+{
+    if (!iFile.open(QIODevice::ReadOnly | QIODevice::Unbuffered)) {
+        HDEBUG("Failed to open" << qPrintable(aPath));
+        iError = true;
+    }
+}
+
+int BackupJson::Reader::Private::peek()
+{
+    if (iPos >= iBuf.size()) {
+        iPos = 0;
+        iBuf = iFile.isOpen() ? iFile.read(BUF_SIZE) : QByteArray();
+        if (iBuf.isEmpty()) {
+            return -1;
+        }
+    }
+    return (uchar)iBuf.at(iPos);
+}
+
+bool BackupJson::Reader::Private::expect(const char* aLiteral)
+{
+    for (const char* ptr = aLiteral; *ptr; ptr++) {
+        if (get() != *ptr) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BackupJson::Reader::Private::readHex(guint* aValue)
+{
+    *aValue = 0;
+    for (int i = 0; i < 4; i++) {
+        const int digit = g_ascii_xdigit_value(get());
+        if (digit < 0) {
+            return false;
+        }
+        *aValue = (*aValue << 4) | digit;
+    }
+    return true;
+}
+
+bool BackupJson::Reader::Private::readString(QString* aString)
+{
+    // Opening quote has already been consumed
+    QByteArray utf8;
+    for (;;) {
+        int c = get();
+        if (c < 0) {
+            return false;
+        } else if (c == '"') {
+            *aString = QString::fromUtf8(utf8);
+            return true;
+        } else if (c == '\\') {
+            guint u;
+            switch (c = get()) {
+            case '"': case '\\': case '/': utf8.append((char)c); break;
+            case 'b': utf8.append('\b'); break;
+            case 'f': utf8.append('\f'); break;
+            case 'n': utf8.append('\n'); break;
+            case 'r': utf8.append('\r'); break;
+            case 't': utf8.append('\t'); break;
+            case 'u':
+                if (!readHex(&u)) {
+                    return false;
+                }
+                if (u >= 0xd800 && u < 0xdc00) {
+                    guint low;
+                    if (!expect("\\u") || !readHex(&low) ||
+                        low < 0xdc00 || low >= 0xe000) {
+                        return false;
+                    }
+                    u = 0x10000 + ((u - 0xd800) << 10) + (low - 0xdc00);
+                }
+                {
+                    char buf[8];
+                    utf8.append(buf, g_unichar_to_utf8(u, buf));
+                }
+                break;
+            default:
+                return false;
+            }
+        } else {
+            utf8.append((char)c);
+        }
+    }
+}
+
+bool BackupJson::Reader::Private::readNumber()
+{
+    // Numbers are doubles, like QJsonDocument has them
+    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+    int len = 0;
+    int c;
+    while ((c = peek()) >= 0 && (g_ascii_isdigit(c) || c == '-' ||
+        c == '+' || c == '.' || c == 'e' || c == 'E')) {
+        if (len == (int)sizeof(buf) - 1) {
+            return false;
+        }
+        buf[len++] = (char)c;
+        iPos++;
+    }
+    buf[len] = 0;
+    char* end = NULL;
+    const double d = g_ascii_strtod(buf, &end);
+    if (len > 0 && end == buf + len) {
+        iValue = d;
+        return true;
+    }
+    return false;
+}
+
+BackupJson::Reader::Token BackupJson::Reader::Private::next()
+{
+    if (iError) {
+        return Error;
+    }
+    for (;;) {
+        const int c = peek();
+        switch (c) {
+        case -1:
+            return token(iStack.isEmpty() ? End : Error);
+        case ' ': case '\t': case '\n': case '\r': case ':':
+            iPos++;
+            break;
+        case ',':
+            iPos++;
+            iExpectName = !iStack.isEmpty() && iStack.last();
+            break;
+        case '{':
+        case '[':
+            iPos++;
+            iStack.append(c == '{');
+            iExpectName = (c == '{');
+            return (c == '{') ? BeginObject : BeginArray;
+        case '}':
+        case ']':
+            iPos++;
+            if (iStack.isEmpty() || iStack.takeLast() != (c == '}')) {
+                return token(Error);
+            }
+            iExpectName = false;
+            return (c == '}') ? EndObject : EndArray;
+        case '"':
+            iPos++;
+            if (iExpectName) {
+                iExpectName = false;
+                return token(readString(&iName) ? Name : Error);
+            } else {
+                QString s;
+                if (readString(&s)) {
+                    iValue = s;
+                    return Value;
+                }
+                return token(Error);
+            }
+        case 't':
+            iValue = true;
+            return token(expect("true") ? Value : Error);
+        case 'f':
+            iValue = false;
+            return token(expect("false") ? Value : Error);
+        case 'n':
+            iValue = QVariant();
+            return token(expect("null") ? Value : Error);
+        default:
+            return token(readNumber() ? Value : Error);
+        }
+    }
+}
+
+// ==========================================================================
+// BackupJson::Reader
+// ==========================================================================
+
+BackupJson::Reader::Reader(const QString aPath) :
+    iPrivate(new Private(aPath))
+{
+}
+
+BackupJson::Reader::~Reader()
+{
+    delete iPrivate;
+}
+
+bool BackupJson::Reader::isOpen() const
+{
+    return iPrivate->iFile.isOpen();
+}
+
+BackupJson::Reader::Token BackupJson::Reader::next()
+{
+    return iPrivate->next();
+}
+
+QString BackupJson::Reader::name() const
+{
+    return iPrivate->iName;
+}
+
+QVariant BackupJson::Reader::value() const
+{
+    return iPrivate->iValue;
+}
+
+QVariant BackupJson::Reader::readValue(Token aToken)
+{
+    Token token;
+    if (aToken == Value) {
+        return iPrivate->iValue;
+    } else if (aToken == BeginArray) {
+        QVariantList list;
+        while ((token = next()) != EndArray) {
+            const QVariant value(readValue(token));
+            if (iPrivate->iError) {
+                return QVariant();
+            }
+            list.append(value);
+        }
+        return list;
+    } else if (aToken == BeginObject) {
+        QVariantMap map;
+        while ((token = next()) == Name) {
+            const QString key(iPrivate->iName);
+            const QVariant value(readValue(next()));
+            if (iPrivate->iError) {
+                return QVariant();
+            }
+            map.insert(key, value);
+        }
+        if (token == EndObject) {
+            return map;
+        }
+    }
+    iPrivate->iError = true;
+    return QVariant();
+}
+
+bool BackupJson::Reader::skipValue(Token aToken)
+{
+    if (aToken == Value) {
+        return true;
+    } else if (aToken == BeginArray || aToken == BeginObject) {
+        // Only the nesting level needs to be tracked
+        int depth = 1;
+        while (depth > 0) {
+            switch (next()) {
+            case BeginArray: case BeginObject: depth++; break;
+            case EndArray: case EndObject: depth--; break;
+            case Name: case Value: break;
+            default: return false;
+            }
+        }
+        return true;
+    }
+    iPrivate->iError = true;
+    return false;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef BACKUP_JSON_H
+#define BACKUP_JSON_H
+
+#include <QString>
+#include <QVariant>
+
+//
+// Streaming JSON writer and pull parser. Neither of them keeps more than
+// a small buffer and the current nesting state in memory, so documents of
+// any size can be produced and consumed while they are being traversed.
+// The output is compatible with what QJsonDocument reads and writes.
+//
+class BackupJson {
+public:
+    class Writer {
+        Q_DISABLE_COPY(Writer)
+        class Private;
+
+    public:
+        Writer(const QString aPath);
+        ~Writer();
+
+        bool isOpen() const;
+        void beginObject();
+        void endObject();
+        void beginArray();
+        void endArray();
+        void name(const QString aName);    // Object member name
+        void value(const QVariant aValue); // Null if invalid
+        bool finish(); // Flushes and closes the file
+
+    private:
+        Private* iPrivate;
+    };
+
+    class Reader {
+        Q_DISABLE_COPY(Reader)
+        class Private;
+
+    public:
+        enum Token {
+            Error,
+            End,
+            BeginObject,
+            EndObject,
+            BeginArray,
+            EndArray,
+            Name,
+            Value
+        };
+
+        Reader(const QString aPath);
+        ~Reader();
+
+        bool isOpen() const;
+        Token next();
+        QString name() const;   // Valid after Name
+        QVariant value() const; // Valid after Value
+
+        // Completes the value which started with aToken
+        QVariant readValue(Token aToken);
+        bool skipValue(Token aToken);
+
+    private:
+        Private* iPrivate;
+    };
+};
+
+#endif // BACKUP_JSON_H
@@ -64,6 +64,7 @@ public:
     static const QString KEY_ITEMS;
     static const QString KEY_LAST_BACKUP;
     static const QString KEY_LAST_RESTORE;
+    static const QString KEY_EXCLUDES;
 
 public:
     void load(const QString& aFile);
@@ -79,6 +80,7 @@ public:
     QList<Item*> iList;
     QDateTime iLastBackup;
     QDateTime iLastRestore;
+    QStringList iExcludes;
 };
 
 const QString BackupList::Private::HOME_PREFIX("~/");
@@ -86,6 +88,7 @@ const QString BackupList::Private::DOTSLASH("./");
 const QString BackupList::Private::KEY_ITEMS("items");
 const QString BackupList::Private::KEY_LAST_BACKUP("lastBackup");
 const QString BackupList::Private::KEY_LAST_RESTORE("lastRestore");
+const QString BackupList::Private::KEY_EXCLUDES("excludes");
 
 BackupList::Private::~Private()
 {
@@ -97,6 +100,7 @@ void BackupList::Private::load(const QString& aFile)
     qDeleteAll(iList);
     iList.clear();
     iLastBackup = QDateTime();
+    iExcludes.clear();
     QVariantMap data;
     if (HarbourJson::load(aFile, data)) {
         QVariantList items = data.value(KEY_ITEMS).toList();
@@ -109,6 +113,7 @@ void BackupList::Private::load(const QString& aFile)
         }
         iLastBackup = getDateTimeValue(data, KEY_LAST_BACKUP);
         iLastRestore = getDateTimeValue(data, KEY_LAST_RESTORE);
+        iExcludes = data.value(KEY_EXCLUDES).toStringList();
     }
 }
 
@@ -123,6 +128,9 @@ bool BackupList::Private::save(const QString& aFile)
     data.insert(KEY_ITEMS, items);
     setDateTimeValue(&data, KEY_LAST_BACKUP, iLastBackup);
     setDateTimeValue(&data, KEY_LAST_RESTORE, iLastRestore);
+    if (!iExcludes.isEmpty()) {
+        data.insert(KEY_EXCLUDES, iExcludes);
+    }
     return HarbourJson::save(aFile, data);
 }
 
@@ -163,6 +171,7 @@ void BackupList::Private::swap(Private* aPrivate)
         aPrivate->iList = tmpList;
         aPrivate->iLastBackup = tmpBackup;
         aPrivate->iLastRestore = tmpRestore;
+        iExcludes.swap(aPrivate->iExcludes);
     }
 }
 
@@ -386,3 +395,8 @@ QStringList BackupList::backupConfigList(const QString aExtraEntry) const
     HDEBUG("Config list" << list);
     return list;
 }
+
+QStringList BackupList::excludeList() const
+{
+    return iPrivate->iExcludes;
+}
@@ -127,6 +127,7 @@ public:
 
     QStringList backupFileList(const QString aExtraPath) const;
     QStringList backupConfigList(const QString aExtraEntry) const;
+    QStringList excludeList() const; // See BackupExcludes
 
 private:
     class Private;
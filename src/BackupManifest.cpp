@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "BackupManifest.h"
+
+#include "HarbourDebug.h"
+
+#include <QDir>
+#include <QHash>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QSaveFile>
+#include <QDataStream>
+
+// ==========================================================================
+// BackupManifest::Private
+// ==========================================================================
+
+class BackupManifest::Private {
+public:
+    static const quint32 MAGIC = 0x4d424d46; // MBMF
+    static const quint32 VERSION = 1;
+
+    struct Entry {
+        quint64 iSize;
+        qint64 iMtimeSec;
+        quint32 iMtimeNsec;
+        quint64 iIno;
+        quint32 iMode;
+
+        void set(const struct stat* aStat);
+        bool matches(const struct stat* aStat) const;
+    };
+
+public:
+    QMutex iMutex;
+    QHash<QByteArray,Entry> iEntries;
+};
+
+void BackupManifest::Private::Entry::set(const struct stat* aStat)
+{
+    iSize = aStat->st_size;
+    iMtimeSec = aStat->st_mtim.tv_sec;
+    iMtimeNsec = aStat->st_mtim.tv_nsec;
+    iIno = aStat->st_ino;
+    iMode = aStat->st_mode;
+}
+
+bool BackupManifest::Private::Entry::matches(const struct stat* aStat) const
+{
+    return iSize == (quint64)aStat->st_size &&
+        iMtimeSec == (qint64)aStat->st_mtim.tv_sec &&
+        iMtimeNsec == (quint32)aStat->st_mtim.tv_nsec &&
+        iIno == (quint64)aStat->st_ino &&
+        iMode == (quint32)aStat->st_mode;
+}
+
+// ==========================================================================
+// BackupManifest
+// ==========================================================================
+
+BackupManifest::BackupManifest() :
+    iPrivate(new Private)
+{
+}
+
+BackupManifest::~BackupManifest()
+{
+    delete iPrivate;
+}
+
+bool BackupManifest::load(const QString aFile)
+{
+    iPrivate->iEntries.clear();
+    QFile file(aFile);
+    if (file.open(QIODevice::ReadOnly)) {
+        QDataStream in(&file);
+        quint32 magic = 0, version = 0;
+        qint32 n = 0;
+        in >> magic >> version >> n;
+        if (magic == Private::MAGIC && version == Private::VERSION && n >= 0) {
+            iPrivate->iEntries.reserve(n);
+            for (int i = 0; i < n && in.status() == QDataStream::Ok; i++) {
+                QByteArray path;
+                Private::Entry entry;
+                in >> path >> entry.iSize >> entry.iMtimeSec >>
+                    entry.iMtimeNsec >> entry.iIno >> entry.iMode;
+                iPrivate->iEntries.insert(path, entry);
+            }
+            if (in.status() == QDataStream::Ok) {
+                HDEBUG(n << "entries in" << qPrintable(aFile));
+                return true;
+            }
+        }
+        HWARN("Invalid manifest" << qPrintable(aFile));
+        iPrivate->iEntries.clear();
+    }
+    return false;
+}
+
+bool BackupManifest::save(const QString aFile) const
+{
+    QSaveFile file(aFile);
+    QFileInfo(aFile).dir().mkpath(QStringLiteral("."));
+    if (file.open(QIODevice::WriteOnly)) {
+        QDataStream out(&file);
+        const QHash<QByteArray,Private::Entry>& entries = iPrivate->iEntries;
+        out << Private::MAGIC << Private::VERSION << (qint32)entries.count();
+        QHashIterator<QByteArray,Private::Entry> it(entries);
+        while (it.hasNext()) {
+            it.next();
+            const Private::Entry& entry = it.value();
+            out << it.key() << entry.iSize << entry.iMtimeSec <<
+                entry.iMtimeNsec << entry.iIno << entry.iMode;
+        }
+        if (out.status() == QDataStream::Ok && file.commit()) {
+            HDEBUG("Wrote" << entries.count() << "entries to" <<
+                qPrintable(aFile));
+            return true;
+        }
+    }
+    HWARN("Failed to write" << qPrintable(aFile));
+    return false;
+}
+
+int BackupManifest::count() const
+{
+    return iPrivate->iEntries.count();
+}
+
+bool BackupManifest::contains(const QByteArray aPath,
+    const struct stat* aStat) const
+{
+    const QHash<QByteArray,Private::Entry>::const_iterator it =
+        iPrivate->iEntries.constFind(aPath);
+    return it != iPrivate->iEntries.constEnd() && it.value().matches(aStat);
+}
+
+void BackupManifest::add(const QByteArray aPath, const struct stat* aStat)
+{
+    Private::Entry entry;
+    entry.set(aStat);
+    QMutexLocker lock(&iPrivate->iMutex);
+    iPrivate->iEntries.insert(aPath, entry);
+}
@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "BackupProgress.h"
+
+#include "HarbourDebug.h"
+
+#include <glib.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+// ==========================================================================
+// BackupProgress::Private
+// ==========================================================================
+
+class BackupProgress::Private {
+public:
+    enum {
+        REPORT_INTERVAL_MS = 500,
+        RATE_WINDOW = 8 // Number of intervals the throughput is averaged over
+    };
+
+    Private(int aFd);
+    ~Private();
+
+    void write(const char* aFormat, ...) G_GNUC_PRINTF(2,3);
+    void report();
+    static gpointer threadProc(gpointer aPrivate);
+    void run();
+
+public:
+    const int iFd;
+    GMutex iMutex;
+    GCond iCond;
+    GThread* iThread;
+    bool iFinished;
+    gint64 iStartTime;
+    guint64 iTotalFiles;
+    guint64 iTotalBytes;
+    guint64 iFiles;
+    guint64 iBytes;
+    // Samples for the throughput calculation (reporter thread only)
+    guint64 iSampleBytes[RATE_WINDOW];
+    gint64 iSampleTime[RATE_WINDOW];
+    int iSampleCount;
+    int iNextSample;
+};
+
+BackupProgress::Private::Private(int aFd) :
+    iFd(aFd),
+    iThread(NULL),
+    iFinished(false),
+    iStartTime(g_get_monotonic_time()),
+    iTotalFiles(0),
+    iTotalBytes(0),
+    iFiles(0),
+    iBytes(0),
+    iSampleCount(0),
+    iNextSample(0)
+{
+    g_mutex_init(&iMutex);
+    g_cond_init(&iCond);
+}
+
+BackupProgress::Private::~Private()
+{
+    g_cond_clear(&iCond);
+    g_mutex_clear(&iMutex);
+}
+
+void BackupProgress::Private::write(const char* aFormat, ...)
+{
+    va_list va;
+    va_start(va, aFormat);
+    char* line = g_strdup_vprintf(aFormat, va);
+    va_end(va);
+
+    // Write the whole line at once (or fail)
+    const char* ptr = line;
+    gsize len = strlen(line);
+    while (len > 0) {
+        const ssize_t n = ::write(iFd, ptr, len);
+        if (n > 0) {
+            ptr += n;
+            len -= n;
+        } else if (n < 0 && errno != EINTR) {
+            HWARN("Progress report failed:" << strerror(errno));
+            break;
+        }
+    }
+    g_free(line);
+}
+
+void BackupProgress::Private::report()
+{
+    g_mutex_lock(&iMutex);
+    const guint64 files = iFiles;
+    const guint64 bytes = iBytes;
+    g_mutex_unlock(&iMutex);
+
+    // Throughput over the last RATE_WINDOW intervals
+    const gint64 now = g_get_monotonic_time();
+    guint64 rate = 0;
+    if (iSampleCount > 0) {
+        const int oldest = (iSampleCount < RATE_WINDOW) ? 0 : iNextSample;
+        const gint64 usec = now - iSampleTime[oldest];
+        if (usec > 0) {
+            rate = (bytes - iSampleBytes[oldest]) * G_USEC_PER_SEC / usec;
+        }
+    }
+    iSampleBytes[iNextSample] = bytes;
+    iSampleTime[iNextSample] = now;
+    iNextSample = (iNextSample + 1) % RATE_WINDOW;
+    if (iSampleCount < RATE_WINDOW) {
+        iSampleCount++;
+    }
+
+    gint64 eta = -1;
+    if (iTotalBytes) {
+        eta = (bytes >= iTotalBytes) ? 0 : rate ?
+            (gint64)((iTotalBytes - bytes) / rate) : -1;
+    }
+    write("progress %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+        " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+        " %" G_GINT64_FORMAT "\n", files, iTotalFiles, bytes, iTotalBytes,
+        rate, eta);
+}
+
+gpointer BackupProgress::Private::threadProc(gpointer aPrivate)
+{
+    ((Private*)aPrivate)->run();
+    return NULL;
+}
+
+void BackupProgress::Private::run()
+{
+    g_mutex_lock(&iMutex);
+    while (!iFinished) {
+        const gint64 deadline = g_get_monotonic_time() +
+            REPORT_INTERVAL_MS * G_TIME_SPAN_MILLISECOND;
+        while (!iFinished && g_cond_wait_until(&iCond, &iMutex, deadline));
+        if (!iFinished) {
+            g_mutex_unlock(&iMutex);
+            report();
+            g_mutex_lock(&iMutex);
+        }
+    }
+    g_mutex_unlock(&iMutex);
+}
+
+// ==========================================================================
+// BackupProgress
+// ==========================================================================
+
+BackupProgress::BackupProgress(int aFd) :
+    iPrivate((aFd >= 0) ? new Private(aFd) : NULL)
+{
+}
+
+BackupProgress::~BackupProgress()
+{
+    if (iPrivate) {
+        finish();
+        delete iPrivate;
+    }
+}
+
+bool BackupProgress::isEnabled() const
+{
+    return iPrivate != NULL;
+}
+
+void BackupProgress::setTotal(quint64 aFiles, quint64 aBytes)
+{
+    if (iPrivate) {
+        iPrivate->iTotalFiles = aFiles;
+        iPrivate->iTotalBytes = aBytes;
+        iPrivate->write("scan %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT "\n",
+            (guint64)aFiles, (guint64)aBytes);
+    }
+}
+
+void BackupProgress::start()
+{
+    if (iPrivate && !iPrivate->iThread) {
+        iPrivate->iStartTime = g_get_monotonic_time();
+        iPrivate->iThread = g_thread_new("progress", Private::threadProc,
+            iPrivate);
+    }
+}
+
+void BackupProgress::fileDone(quint64 aBytes)
+{
+    if (iPrivate) {
+        g_mutex_lock(&iPrivate->iMutex);
+        iPrivate->iFiles++;
+        iPrivate->iBytes += aBytes;
+        g_mutex_unlock(&iPrivate->iMutex);
+    }
+}
+
+void BackupProgress::finish()
+{
+    if (iPrivate && iPrivate->iThread) {
+        g_mutex_lock(&iPrivate->iMutex);
+        iPrivate->iFinished = true;
+        g_cond_broadcast(&iPrivate->iCond);
+        g_mutex_unlock(&iPrivate->iMutex);
+        g_thread_join(iPrivate->iThread);
+        iPrivate->iThread = NULL;
+
+        // Final report
+        iPrivate->report();
+        iPrivate->write("done %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+            " %" G_GINT64_FORMAT "\n", iPrivate->iFiles, iPrivate->iBytes,
+            (g_get_monotonic_time() - iPrivate->iStartTime) /
+            G_TIME_SPAN_MILLISECOND);
+    }
+}
+
+void BackupProgress::configRestored(int aWritten, int aReset)
+{
+    if (iPrivate) {
+        iPrivate->write("config %d %d\n", aWritten, aReset);
+    }
+}
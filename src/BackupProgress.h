@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef BACKUP_PROGRESS_H
+#define BACKUP_PROGRESS_H
+
+#include <QtGlobal>
+
+//
+// Machine readable progress report, one line per event written to a file
+// descriptor (typically, stdout or a pipe):
+//
+//   scan <files> <bytes>
+//   progress <files> <total files> <bytes> <total bytes> <bytes/s> <eta>
+//   done <files> <bytes> <milliseconds>
+//   config <written keys> <reset keys>
+//
+// The progress line is written periodically while the operation is
+// running, even if nothing is happening (which is how a stall can be
+// detected). Throughput is averaged over the last few seconds, ETA is
+// in seconds, -1 if unknown. All counters are 64-bit decimal numbers.
+//
+// fileDone() is thread-safe.
+//
+class BackupProgress {
+    Q_DISABLE_COPY(BackupProgress)
+    class Private;
+
+public:
+    BackupProgress(int aFd); // -1 to disable
+    ~BackupProgress();
+
+    bool isEnabled() const;
+    void setTotal(quint64 aFiles, quint64 aBytes);
+    void start();
+    void fileDone(quint64 aBytes);
+    void finish();
+    void configRestored(int aWritten, int aReset);
+
+private:
+    Private* iPrivate;
+};
+
+#endif // BACKUP_PROGRESS_H
@@ -0,0 +1,638 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "BackupUring.h"
+#include "BackupFileCopier.h"
+
+#include "HarbourDebug.h"
+
+#include <glib.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/syscall.h>
+
+#if defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#    include <linux/io_uring.h>
+#  endif
+#endif
+
+// IORING_FEAT_NATIVE_WORKERS appeared in 5.12 headers, those define all
+// the opcodes we need. Older kernels are filtered out by the runtime probe.
+#if defined(IORING_FEAT_NATIVE_WORKERS) && defined(__NR_io_uring_setup) && \
+    defined(STATX_BASIC_STATS)
+#  define HAVE_IO_URING
+#  include <sys/mman.h>
+#  include <sys/sysmacros.h>
+#endif
+
+#ifdef HAVE_IO_URING
+
+// ==========================================================================
+// BackupUring::Ring
+// ==========================================================================
+
+class BackupUring::Ring {
+    Q_DISABLE_COPY(Ring)
+    Ring(int aFd, const struct io_uring_params* aParams);
+
+public:
+    enum {
+        ENTRIES = 4 * MAX_BATCH // Up to 4 operations per file
+    };
+
+    static Ring* create();
+    ~Ring();
+
+    bool isValid() const;
+    struct io_uring_sqe* sqe(int* aTag);
+    bool run(int* aResults);
+
+private:
+    void reap(int* aResults);
+
+public:
+    const int iFd;
+
+private:
+    void* iSqMap;
+    size_t iSqMapSize;
+    void* iCqMap;
+    size_t iCqMapSize;
+    struct io_uring_sqe* iSqes;
+    size_t iSqesSize;
+    unsigned* iSqTail;
+    unsigned* iSqArray;
+    unsigned iSqMask;
+    unsigned* iCqHead;
+    unsigned* iCqTail;
+    unsigned iCqMask;
+    struct io_uring_cqe* iCqes;
+    unsigned iTail;
+    unsigned iQueued;
+    unsigned iCompleted;
+};
+
+BackupUring::Ring::Ring(int aFd, const struct io_uring_params* aParams) :
+    iFd(aFd),
+    iSqMap(MAP_FAILED),
+    iCqMap(MAP_FAILED),
+    iSqes((struct io_uring_sqe*)MAP_FAILED),
+    iTail(0),
+    iQueued(0),
+    iCompleted(0)
+{
+    const struct io_sqring_offsets* sq = &aParams->sq_off;
+    const struct io_cqring_offsets* cq = &aParams->cq_off;
+    iSqMapSize = sq->array + aParams->sq_entries * sizeof(unsigned);
+    iCqMapSize = cq->cqes + aParams->cq_entries * sizeof(struct io_uring_cqe);
+    iSqesSize = aParams->sq_entries * sizeof(struct io_uring_sqe);
+    if (aParams->features & IORING_FEAT_SINGLE_MMAP) {
+        iSqMapSize = iCqMapSize = qMax(iSqMapSize, iCqMapSize);
+    }
+    iSqMap = mmap(NULL, iSqMapSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, iFd, IORING_OFF_SQ_RING);
+    if (iSqMap == MAP_FAILED) {
+        return;
+    }
+    if (aParams->features & IORING_FEAT_SINGLE_MMAP) {
+        iCqMap = iSqMap;
+    } else {
+        iCqMap = mmap(NULL, iCqMapSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, iFd, IORING_OFF_CQ_RING);
+        if (iCqMap == MAP_FAILED) {
+            return;
+        }
+    }
+    iSqes = (struct io_uring_sqe*)mmap(NULL, iSqesSize, PROT_READ |
+        PROT_WRITE, MAP_SHARED | MAP_POPULATE, iFd, IORING_OFF_SQES);
+
+    char* sqMap = (char*)iSqMap;
+    char* cqMap = (char*)iCqMap;
+    iSqTail = (unsigned*)(sqMap + sq->tail);
+    iSqArray = (unsigned*)(sqMap + sq->array);
+    iSqMask = *(unsigned*)(sqMap + sq->ring_mask);
+    iCqHead = (unsigned*)(cqMap + cq->head);
+    iCqTail = (unsigned*)(cqMap + cq->tail);
+    iCqMask = *(unsigned*)(cqMap + cq->ring_mask);
+    iCqes = (struct io_uring_cqe*)(cqMap + cq->cqes);
+    iTail = *iSqTail;
+}
+
+BackupUring::Ring::~Ring()
+{
+    if (iSqes != MAP_FAILED) {
+        munmap(iSqes, iSqesSize);
+    }
+    if (iCqMap != MAP_FAILED && iCqMap != iSqMap) {
+        munmap(iCqMap, iCqMapSize);
+    }
+    if (iSqMap != MAP_FAILED) {
+        munmap(iSqMap, iSqMapSize);
+    }
+    close(iFd);
+}
+
+BackupUring::Ring* BackupUring::Ring::create()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    const int fd = syscall(__NR_io_uring_setup, ENTRIES, &params);
+    if (fd >= 0) {
+        Ring* ring = new Ring(fd, &params);
+        if (ring->isValid()) {
+            return ring;
+        }
+        HWARN("Failed to map io_uring:" << strerror(errno));
+        delete ring;
+    } else {
+        HDEBUG("io_uring is not available:" << strerror(errno));
+    }
+    return Q_NULLPTR;
+}
+
+bool BackupUring::Ring::isValid() const
+{
+    return iSqMap != MAP_FAILED && iCqMap != MAP_FAILED &&
+        iSqes != MAP_FAILED;
+}
+
+struct io_uring_sqe* BackupUring::Ring::sqe(int* aTag)
+{
+    // The tag is used as user_data and the index in the result array
+    const unsigned index = iTail & iSqMask;
+    struct io_uring_sqe* sqe = iSqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = iQueued;
+    iSqArray[index] = index;
+    iTail++;
+    *aTag = iQueued++;
+    return sqe;
+}
+
+void BackupUring::Ring::reap(int* aResults)
+{
+    unsigned head = *iCqHead;
+    const unsigned tail = __atomic_load_n(iCqTail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        const struct io_uring_cqe* cqe = iCqes + (head & iCqMask);
+        if (cqe->user_data < iQueued) {
+            aResults[cqe->user_data] = cqe->res;
+        }
+        head++;
+        iCompleted++;
+    }
+    __atomic_store_n(iCqHead, head, __ATOMIC_RELEASE);
+}
+
+bool BackupUring::Ring::run(int* aResults)
+{
+    // Submits everything queued by sqe() and waits for all of it
+    // to complete. Each submission produces exactly one completion,
+    // including the cancelled ones.
+    const unsigned count = iQueued;
+    unsigned submitted = 0;
+    bool ok = true;
+    for (unsigned i = 0; i < count; i++) {
+        aResults[i] = -ECANCELED;
+    }
+    __atomic_store_n(iSqTail, iTail, __ATOMIC_RELEASE);
+    iCompleted = 0;
+    while (iCompleted < count) {
+        // The kernel doesn't wait if it couldn't submit everything
+        const int ret = syscall(__NR_io_uring_enter, iFd, count - submitted,
+            count - iCompleted, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret >= 0) {
+            submitted += ret;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            HWARN("io_uring_enter failed:" << strerror(errno));
+            ok = false;
+            break;
+        }
+        reap(aResults);
+    }
+    iQueued = 0;
+    return ok;
+}
+
+// ==========================================================================
+// BackupUring::Private
+// ==========================================================================
+
+class BackupUring::Private {
+public:
+    struct Slot {
+        struct statx iStatx;
+        char iTmpName[BackupFileCopier::TEMP_NAME_SIZE];
+        char* iBuf;
+        int iBufSize;
+        int iLength;
+        int iSrcFd;
+        int iDestFd;
+        int iSrcTag;
+        int iDestTag;
+        int iStatTag;
+        int iReadTag;
+        int iWriteTag;
+        int iRenameTag;
+        int iCloseTag;
+        bool iOk;
+    };
+
+    Private();
+    ~Private();
+
+    static bool probe(int aFd);
+    static void statxToStat(const struct statx* aStatx, struct stat* aStat);
+    Ring* takeRing();
+    void returnRing(Ring* aRing);
+
+public:
+    GMutex iMutex;
+    GSList* iRings;
+    bool iValid;
+};
+
+BackupUring::Private::Private() :
+    iRings(NULL),
+    iValid(false)
+{
+    g_mutex_init(&iMutex);
+    Ring* ring = Ring::create();
+    if (ring) {
+        if (probe(ring->iFd)) {
+            HDEBUG("Using io_uring");
+            iValid = true;
+            returnRing(ring);
+        } else {
+            HDEBUG("io_uring is missing some operations");
+            delete ring;
+        }
+    }
+}
+
+BackupUring::Private::~Private()
+{
+    for (GSList* l = iRings; l; l = l->next) {
+        delete (Ring*)l->data;
+    }
+    g_slist_free(iRings);
+    g_mutex_clear(&iMutex);
+}
+
+bool BackupUring::Private::probe(int aFd)
+{
+    static const int ops[] = {
+        IORING_OP_OPENAT,
+        IORING_OP_STATX,
+        IORING_OP_RENAMEAT,
+        IORING_OP_READ,
+        IORING_OP_WRITE,
+        IORING_OP_CLOSE
+    };
+    const int maxOps = 256;
+    const gsize size = sizeof(struct io_uring_probe) +
+        maxOps * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*)g_malloc0(size);
+    bool ok = !syscall(__NR_io_uring_register, aFd, IORING_REGISTER_PROBE,
+        probe, maxOps);
+    for (guint i = 0; ok && i < G_N_ELEMENTS(ops); i++) {
+        ok = ops[i] <= probe->last_op &&
+            (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    g_free(probe);
+    return ok;
+}
+
+void BackupUring::Private::statxToStat(const struct statx* aStatx,
+    struct stat* aStat)
+{
+    memset(aStat, 0, sizeof(*aStat));
+    aStat->st_dev = makedev(aStatx->stx_dev_major, aStatx->stx_dev_minor);
+    aStat->st_ino = aStatx->stx_ino;
+    aStat->st_mode = aStatx->stx_mode;
+    aStat->st_nlink = aStatx->stx_nlink;
+    aStat->st_uid = aStatx->stx_uid;
+    aStat->st_gid = aStatx->stx_gid;
+    aStat->st_size = aStatx->stx_size;
+    aStat->st_blksize = aStatx->stx_blksize;
+    aStat->st_blocks = aStatx->stx_blocks;
+    aStat->st_atim.tv_sec = aStatx->stx_atime.tv_sec;
+    aStat->st_atim.tv_nsec = aStatx->stx_atime.tv_nsec;
+    aStat->st_mtim.tv_sec = aStatx->stx_mtime.tv_sec;
+    aStat->st_mtim.tv_nsec = aStatx->stx_mtime.tv_nsec;
+    aStat->st_ctim.tv_sec = aStatx->stx_ctime.tv_sec;
+    aStat->st_ctim.tv_nsec = aStatx->stx_ctime.tv_nsec;
+}
+
+BackupUring::Ring* BackupUring::Private::takeRing()
+{
+    // Each copy thread needs its own ring, they are reused
+    g_mutex_lock(&iMutex);
+    Ring* ring = (Ring*)(iRings ? iRings->data : NULL);
+    iRings = g_slist_delete_link(iRings, iRings);
+    g_mutex_unlock(&iMutex);
+    return ring ? ring : Ring::create();
+}
+
+void BackupUring::Private::returnRing(Ring* aRing)
+{
+    g_mutex_lock(&iMutex);
+    iRings = g_slist_prepend(iRings, aRing);
+    g_mutex_unlock(&iMutex);
+}
+
+#else
+
+class BackupUring::Private {
+public:
+    Private() : iValid(false) {}
+
+public:
+    bool iValid;
+};
+
+#endif // HAVE_IO_URING
+
+// ==========================================================================
+// BackupUring
+// ==========================================================================
+
+BackupUring::BackupUring() :
+    iPrivate(new Private)
+{
+}
+
+BackupUring::~BackupUring()
+{
+    delete iPrivate;
+}
+
+bool BackupUring::isValid() const
+{
+    return iPrivate->iValid;
+}
+
+void BackupUring::copyFiles(int aDestDirFd, int aSrcDirFd, File* aFiles,
+    int aCount) const
+{
+    for (int i = 0; i < aCount; i++) {
+        aFiles[i].iCopied = false;
+    }
+
+#ifdef HAVE_IO_URING
+    Ring* ring;
+    if (!iPrivate->iValid || aCount <= 0 || aCount > MAX_BATCH ||
+        (ring = iPrivate->takeRing()) == Q_NULLPTR) {
+        return;
+    }
+
+    // The results are collected here, indexed by tags
+    int res[Ring::ENTRIES];
+    Private::Slot slots[MAX_BATCH];
+    struct io_uring_sqe* sqe;
+    gsize total = 0;
+    int i;
+
+    // Round 1: open the source and a temporary file next to the
+    // destination. The old copy stays there until the new one is
+    // complete.
+    for (i = 0; i < aCount; i++) {
+        const File* file = aFiles + i;
+        Private::Slot* slot = slots + i;
+        slot->iSrcFd = slot->iDestFd = -1;
+        slot->iStatTag = slot->iReadTag = slot->iWriteTag = -1;
+        slot->iRenameTag = slot->iCloseTag = -1;
+        slot->iTmpName[0] = 0;
+        slot->iBuf = NULL;
+        slot->iLength = 0;
+        slot->iOk = !file->iHaveStat || file->iStat.st_size <= MAX_FILE_SIZE;
+        if (slot->iOk) {
+            // One extra byte shows that the file has grown since the scan
+            slot->iBufSize = (file->iHaveStat ? file->iStat.st_size :
+                MAX_FILE_SIZE) + 1;
+            total += slot->iBufSize;
+            BackupFileCopier::tempName(slot->iTmpName);
+            sqe = ring->sqe(&slot->iSrcTag);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = aSrcDirFd;
+            sqe->addr = (quintptr)file->iName;
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            sqe = ring->sqe(&slot->iDestTag);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = aDestDirFd;
+            sqe->addr = (quintptr)slot->iTmpName;
+            sqe->len = 0600;
+            sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+        }
+    }
+    bool ok = ring->run(res);
+
+    for (i = 0; i < aCount; i++) {
+        Private::Slot* slot = slots + i;
+        if (slot->iOk) {
+            slot->iSrcFd = res[slot->iSrcTag];
+            slot->iDestFd = res[slot->iDestTag];
+            if (slot->iDestFd < 0) {
+                // Nothing to clean up
+                slot->iTmpName[0] = 0;
+            }
+            if (slot->iSrcFd < 0 || slot->iDestFd < 0) {
+                slot->iOk = false;
+            }
+        }
+    }
+
+    // Round 2: stat the open file and read all of it
+    static const char empty[] = "";
+    char* buf = ok ? (char*)g_malloc(total) : NULL;
+    if (ok) {
+        char* ptr = buf;
+        for (i = 0; i < aCount; i++) {
+            Private::Slot* slot = slots + i;
+            if (slot->iOk) {
+                slot->iBuf = ptr;
+                ptr += slot->iBufSize;
+                sqe = ring->sqe(&slot->iStatTag);
+                sqe->opcode = IORING_OP_STATX;
+                sqe->fd = slot->iSrcFd;
+                sqe->addr = (quintptr)empty;
+                sqe->len = STATX_BASIC_STATS;
+                sqe->off = (quintptr)&slot->iStatx;
+                sqe->statx_flags = AT_EMPTY_PATH | AT_STATX_SYNC_AS_STAT;
+                sqe->flags = IOSQE_IO_LINK;
+                sqe = ring->sqe(&slot->iReadTag);
+                sqe->opcode = IORING_OP_READ;
+                sqe->fd = slot->iSrcFd;
+                sqe->addr = (quintptr)slot->iBuf;
+                sqe->len = slot->iBufSize;
+            }
+        }
+        ok = ring->run(res);
+    }
+
+    // Only the files which have been read exactly as stat'ed are
+    // written, the others are left to the caller
+    for (i = 0; ok && i < aCount; i++) {
+        File* file = aFiles + i;
+        Private::Slot* slot = slots + i;
+        if (slot->iOk) {
+            if (res[slot->iStatTag] < 0) {
+                slot->iOk = false;
+            } else {
+                struct stat st;
+                Private::statxToStat(&slot->iStatx, &st);
+                slot->iLength = res[slot->iReadTag];
+                if (!S_ISREG(st.st_mode) || slot->iLength < 0 ||
+                    slot->iLength != st.st_size) {
+                    slot->iOk = false;
+                } else {
+                    // The manifest gets what has actually been copied
+                    file->iStat = st;
+                    file->iHaveStat = true;
+                }
+            }
+        }
+    }
+
+    // Round 3: write it out. A short write is finished synchronously.
+    if (ok) {
+        bool writing = false;
+        for (i = 0; i < aCount; i++) {
+            Private::Slot* slot = slots + i;
+            if (slot->iOk && slot->iLength > 0) {
+                sqe = ring->sqe(&slot->iWriteTag);
+                sqe->opcode = IORING_OP_WRITE;
+                sqe->fd = slot->iDestFd;
+                sqe->addr = (quintptr)slot->iBuf;
+                sqe->len = slot->iLength;
+                writing = true;
+            }
+        }
+        ok = !writing || ring->run(res);
+    }
+
+    if (ok) {
+        for (i = 0; i < aCount; i++) {
+            const File* file = aFiles + i;
+            Private::Slot* slot = slots + i;
+            if (slot->iOk && slot->iWriteTag >= 0) {
+                int written = res[slot->iWriteTag];
+                if (written < 0) {
+                    slot->iOk = false;
+                } else {
+                    while (written < slot->iLength) {
+                        const ssize_t n = pwrite(slot->iDestFd,
+                            slot->iBuf + written, slot->iLength - written,
+                            written);
+                        if (n > 0) {
+                            written += n;
+                        } else if (n < 0 && errno != EINTR) {
+                            slot->iOk = false;
+                            break;
+                        }
+                    }
+                }
+            }
+            if (slot->iOk) {
+                // Not something io_uring can do
+                BackupFileCopier::copyMetadata(slot->iDestFd, &file->iStat,
+                    file->iName);
+            }
+        }
+    }
+    g_free(buf);
+
+    // Round 4: replace the old copies and close everything
+    if (ok) {
+        for (i = 0; i < aCount; i++) {
+            const File* file = aFiles + i;
+            Private::Slot* slot = slots + i;
+            if (slot->iOk) {
+                sqe = ring->sqe(&slot->iRenameTag);
+                sqe->opcode = IORING_OP_RENAMEAT;
+                sqe->fd = aDestDirFd;
+                sqe->addr = (quintptr)slot->iTmpName;
+                sqe->len = aDestDirFd;
+                sqe->addr2 = (quintptr)file->iName;
+            }
+            if (slot->iSrcFd >= 0) {
+                int tag;
+                sqe = ring->sqe(&tag);
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = slot->iSrcFd;
+            }
+            if (slot->iDestFd >= 0) {
+                sqe = ring->sqe(&slot->iCloseTag);
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = slot->iDestFd;
+            }
+        }
+        ok = ring->run(res);
+    }
+
+    for (i = 0; i < aCount; i++) {
+        File* file = aFiles + i;
+        Private::Slot* slot = slots + i;
+        if (!ok) {
+            // The ring is broken, nothing can be trusted
+            slot->iOk = false;
+            if (slot->iSrcFd >= 0) close(slot->iSrcFd);
+            if (slot->iDestFd >= 0) close(slot->iDestFd);
+        } else if (slot->iOk && (res[slot->iRenameTag] < 0 ||
+            res[slot->iCloseTag] < 0)) {
+            slot->iOk = false;
+        }
+        if (slot->iOk) {
+            file->iCopied = true;
+        } else if (slot->iTmpName[0]) {
+            // Nothing to remove if it has been renamed, the file gets
+            // copied again anyway
+            unlinkat(aDestDirFd, slot->iTmpName, 0);
+        }
+    }
+
+    if (ok) {
+        iPrivate->returnRing(ring);
+    } else {
+        delete ring;
+    }
+#endif // HAVE_IO_URING
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef BACKUP_URING_H
+#define BACKUP_URING_H
+
+#include <QtGlobal>
+
+#include <sys/stat.h>
+
+//
+// Copies batches of small files between two directories with io_uring,
+// so that opening, reading, writing and closing a few dozen files costs
+// a handful of system calls rather than a handful per file. The kernel
+// interface is used directly, there's no dependency on liburing.
+//
+// If the kernel (or the headers the app was built against) doesn't
+// support io_uring or any of the required operations, isValid() returns
+// false and copyFiles() does nothing. Files that haven't been copied for
+// whatever reason are supposed to be copied the usual way, which also
+// takes care of reporting the errors. Files that have changed size while
+// being copied are left to the caller too. The new copies replace the
+// old ones only when they are complete. All methods are thread-safe.
+//
+class BackupUring {
+    Q_DISABLE_COPY(BackupUring)
+    class Private;
+    class Ring;
+
+public:
+    enum {
+        MAX_FILE_SIZE = 64 * 1024, // Larger files are left to the caller
+        MAX_BATCH = 32 // Max number of files per copyFiles() call
+    };
+
+    struct File {
+        const char* iName;
+        bool iHaveStat; // Both get updated for the copied files
+        struct stat iStat;
+        bool iCopied; // Output
+    };
+
+    BackupUring();
+    ~BackupUring();
+
+    bool isValid() const;
+    void copyFiles(int aDestDirFd, int aSrcDirFd, File* aFiles,
+        int aCount) const;
+
+private:
+    Private* iPrivate;
+};
+
+#endif // BACKUP_URING_H
@@ -36,9 +36,183 @@
  */
 
 #include <client/dconf-client.h>
+#include <common/dconf-changeset.h>
+#include <common/dconf-paths.h>
 
 #include "ConfigClient.h"
 
+#include "HarbourDebug.h"
+
+#include <math.h>
+
+namespace {
+
+    struct Reduction {
+        DConfClient* iClient;
+        DConfChangeset* iResult;
+        int iWritten;
+        int iReset;
+    };
+
+    bool numericValue(GVariant* aValue, double* aNumber)
+    {
+        switch (g_variant_classify(aValue)) {
+        case G_VARIANT_CLASS_BYTE:
+            *aNumber = g_variant_get_byte(aValue); return true;
+        case G_VARIANT_CLASS_INT16:
+            *aNumber = g_variant_get_int16(aValue); return true;
+        case G_VARIANT_CLASS_UINT16:
+            *aNumber = g_variant_get_uint16(aValue); return true;
+        case G_VARIANT_CLASS_INT32:
+            *aNumber = g_variant_get_int32(aValue); return true;
+        case G_VARIANT_CLASS_UINT32:
+            *aNumber = g_variant_get_uint32(aValue); return true;
+        case G_VARIANT_CLASS_INT64:
+            *aNumber = (double)g_variant_get_int64(aValue); return true;
+        case G_VARIANT_CLASS_UINT64:
+            *aNumber = (double)g_variant_get_uint64(aValue); return true;
+        case G_VARIANT_CLASS_DOUBLE:
+            *aNumber = g_variant_get_double(aValue); return true;
+        default:
+            return false;
+        }
+    }
+
+    // JSON doesn't preserve numeric types. Convert the restored number
+    // to the type of the existing value if it fits there exactly.
+    GVariant* coerce(GVariant* aValue, GVariant* aCurrent)
+    {
+        double d, unused;
+        if (numericValue(aValue, &d) && numericValue(aCurrent, &unused)) {
+            const bool integral = (d == floor(d));
+            switch (g_variant_classify(aCurrent)) {
+            case G_VARIANT_CLASS_BYTE:
+                if (integral && d >= 0 && d <= G_MAXUINT8)
+                    return g_variant_new_byte((guint8)d);
+                break;
+            case G_VARIANT_CLASS_INT16:
+                if (integral && d >= G_MININT16 && d <= G_MAXINT16)
+                    return g_variant_new_int16((gint16)d);
+                break;
+            case G_VARIANT_CLASS_UINT16:
+                if (integral && d >= 0 && d <= G_MAXUINT16)
+                    return g_variant_new_uint16((guint16)d);
+                break;
+            case G_VARIANT_CLASS_INT32:
+                if (integral && d >= G_MININT32 && d <= G_MAXINT32)
+                    return g_variant_new_int32((gint32)d);
+                break;
+            case G_VARIANT_CLASS_UINT32:
+                if (integral && d >= 0 && d <= G_MAXUINT32)
+                    return g_variant_new_uint32((guint32)d);
+                break;
+            case G_VARIANT_CLASS_INT64:
+                if (integral && fabs(d) < 9007199254740992.0)
+                    return g_variant_new_int64((gint64)d);
+                break;
+            case G_VARIANT_CLASS_UINT64:
+                if (integral && d >= 0 && d < 9007199254740992.0)
+                    return g_variant_new_uint64((guint64)d);
+                break;
+            case G_VARIANT_CLASS_DOUBLE:
+                return g_variant_new_double(d);
+            default:
+                break;
+            }
+        }
+        return NULL;
+    }
+
+    gboolean reduceChange(const gchar* aPath, GVariant* aValue, gpointer aData)
+    {
+        Reduction* reduction = (Reduction*)aData;
+        GVariant* current = dconf_client_read(reduction->iClient, aPath);
+        GVariant* value = aValue;
+        if (value && current && !g_variant_is_of_type(value,
+            g_variant_get_type(current))) {
+            GVariant* coerced = coerce(value, current);
+            if (coerced) {
+                value = g_variant_ref_sink(coerced);
+            } else {
+                g_variant_ref(value);
+            }
+        } else if (value) {
+            g_variant_ref(value);
+        }
+        if (value ? !(current && g_variant_equal(value, current)) : !!current) {
+            dconf_changeset_set(reduction->iResult, aPath, value);
+            if (value) {
+                reduction->iWritten++;
+            } else {
+                reduction->iReset++;
+            }
+        }
+        if (value) {
+            g_variant_unref(value);
+        }
+        if (current) {
+            g_variant_unref(current);
+        }
+        return TRUE;
+    }
+}
+
+// ==========================================================================
+// ConfigClient::Visitor
+// ==========================================================================
+
+ConfigClient::Visitor::~Visitor()
+{
+}
+
+void ConfigClient::Visitor::beginGroup(const QString)
+{
+}
+
+void ConfigClient::Visitor::endGroup(const QString)
+{
+}
+
+// ==========================================================================
+// ConfigClient::Changeset
+// ==========================================================================
+
+ConfigClient::Changeset::Changeset() :
+    iChangeset(dconf_changeset_new())
+{
+}
+
+ConfigClient::Changeset::~Changeset()
+{
+    dconf_changeset_unref(iChangeset);
+}
+
+bool ConfigClient::Changeset::isEmpty() const
+{
+    return dconf_changeset_is_empty(iChangeset);
+}
+
+void ConfigClient::Changeset::set(QString aKey, const QVariant aValue)
+{
+    // Later changes to the same key replace the earlier ones
+    setValue(aKey, aValue.isValid() ? toGVariant(aValue) : NULL);
+}
+
+void ConfigClient::Changeset::setValue(QString aKey, GVariant* aValue)
+{
+    const QByteArray key(aKey.toUtf8());
+    if (dconf_is_key(key.constData(), NULL)) {
+        dconf_changeset_set(iChangeset, key.constData(), aValue);
+    } else if (aValue) {
+        // Sink and drop the floating reference
+        g_variant_unref(g_variant_ref_sink(aValue));
+    }
+}
+
+// ==========================================================================
+// ConfigClient
+// ==========================================================================
+
 ConfigClient::ConfigClient(struct _DConfClient* aDConf) :
     iClient(aDConf ?  (DConfClient*) g_object_ref(aDConf) : Q_NULLPTR)
 {
@@ -100,6 +274,237 @@ QStringList ConfigClient::list(QString aDir) const
     return out;
 }
 
+QVariant ConfigClient::read(QString aKey) const
+{
+    QVariant result;
+    GVariant* value = readValue(aKey);
+    if (value) {
+        result = toVariant(value);
+        g_variant_unref(value);
+    }
+    return result;
+}
+
+GVariant* ConfigClient::readValue(QString aKey) const
+{
+    if (iClient) {
+        const QByteArray key(aKey.toUtf8());
+        return dconf_client_read(iClient, key.constData());
+    }
+    return NULL;
+}
+
+void ConfigClient::snapshot(QString aDir, Visitor* aVisitor) const
+{
+    // Everything is read from the local database, without going
+    // through the dconf service
+    if (iClient && aDir.endsWith('/')) {
+        snapshot(iClient, aDir.toUtf8(), aVisitor);
+    }
+}
+
+void ConfigClient::snapshot(DConfClient* aClient, const QByteArray aDir,
+    Visitor* aVisitor)
+{
+    const QString dir(QString::fromUtf8(aDir));
+    gint n = 0;
+    gchar** entries = dconf_client_list(aClient, aDir.constData(), &n);
+    aVisitor->beginGroup(dir);
+    if (entries) {
+        // Keys of the group are visited before its subgroups
+        for (char** ptr = entries; *ptr; ptr++) {
+            if (!g_str_has_suffix(*ptr, "/")) {
+                const QByteArray path(aDir + *ptr);
+                GVariant* value = dconf_client_read(aClient, path.constData());
+                if (value) {
+                    aVisitor->key(QString::fromUtf8(path), value);
+                    g_variant_unref(value);
+                }
+            }
+        }
+        for (char** ptr = entries; *ptr; ptr++) {
+            if (g_str_has_suffix(*ptr, "/")) {
+                snapshot(aClient, aDir + *ptr, aVisitor);
+            }
+        }
+        g_strfreev(entries);
+    }
+    aVisitor->endGroup(dir);
+}
+
+void ConfigClient::resetGroup(QString aDir, Changeset* aChangeset) const
+{
+    // Dir resets and key writes under the same dir don't mix well in
+    // a single changeset, reset the existing keys one by one instead
+    class Resetter : public Visitor {
+    public:
+        Resetter(Changeset* aChangeset) : iChangeset(aChangeset) {}
+        void key(const QString aPath, GVariant*) Q_DECL_OVERRIDE
+            { iChangeset->setValue(aPath, NULL); }
+    private:
+        Changeset* iChangeset;
+    } resetter(aChangeset);
+    snapshot(aDir, &resetter);
+}
+
+void ConfigClient::reduce(Changeset* aChangeset, int* aWritten,
+    int* aReset) const
+{
+    // Drop the changes which wouldn't change anything
+    Reduction reduction;
+    reduction.iClient = iClient;
+    reduction.iResult = dconf_changeset_new();
+    reduction.iWritten = 0;
+    reduction.iReset = 0;
+    if (iClient) {
+        dconf_changeset_all(aChangeset->iChangeset, reduceChange, &reduction);
+    }
+    dconf_changeset_unref(aChangeset->iChangeset);
+    aChangeset->iChangeset = reduction.iResult;
+    if (aWritten) *aWritten = reduction.iWritten;
+    if (aReset) *aReset = reduction.iReset;
+}
+
+bool ConfigClient::apply(const Changeset& aChangeset)
+{
+    if (iClient && !aChangeset.isEmpty()) {
+        GError* error = NULL;
+        if (dconf_client_change_sync(iClient, aChangeset.iChangeset, NULL,
+            NULL, &error)) {
+            return true;
+        }
+        HWARN(error->message);
+        g_error_free(error);
+    }
+    return false;
+}
+
+GVariant* ConfigClient::toGVariant(const QVariant aValue)
+{
+    switch ((QMetaType::Type)aValue.type()) {
+    case QMetaType::Bool:
+        return g_variant_new_boolean(aValue.toBool());
+    case QMetaType::Char:
+    case QMetaType::UChar:
+        return g_variant_new_byte((guchar)aValue.toUInt());
+    case QMetaType::Short:
+        return g_variant_new_int16((gint16)aValue.toInt());
+    case QMetaType::UShort:
+        return g_variant_new_uint16((guint16)aValue.toUInt());
+    case QMetaType::Int:
+        return g_variant_new_int32(aValue.toInt());
+    case QMetaType::UInt:
+        return g_variant_new_uint32(aValue.toUInt());
+    case QMetaType::LongLong:
+        return g_variant_new_int64(aValue.toLongLong());
+    case QMetaType::ULongLong:
+        return g_variant_new_uint64(aValue.toULongLong());
+    case QMetaType::Double:
+        return g_variant_new_double(aValue.toDouble());
+    case QMetaType::QString:
+        return g_variant_new_string(aValue.toString().toUtf8().constData());
+    case QMetaType::QStringList:
+        {
+            const QStringList list(aValue.toStringList());
+            GVariantBuilder builder;
+            g_variant_builder_init(&builder, G_VARIANT_TYPE_STRING_ARRAY);
+            for (int i = 0; i < list.count(); i++) {
+                g_variant_builder_add(&builder, "s",
+                    list.at(i).toUtf8().constData());
+            }
+            return g_variant_builder_end(&builder);
+        }
+    case QMetaType::QVariantList:
+        {
+            // A list of strings (which is what JSON gives us) is "as",
+            // anything else is an array of variants
+            const QVariantList list(aValue.toList());
+            bool strings = true;
+            for (int i = 0; i < list.count() && strings; i++) {
+                strings = (list.at(i).type() == QVariant::String);
+            }
+            if (strings) {
+                return toGVariant(QVariant(aValue.toStringList()));
+            }
+            GVariantBuilder builder;
+            g_variant_builder_init(&builder, G_VARIANT_TYPE("av"));
+            for (int i = 0; i < list.count(); i++) {
+                GVariant* child = toGVariant(list.at(i));
+                if (child) {
+                    g_variant_builder_add(&builder, "v", child);
+                }
+            }
+            return g_variant_builder_end(&builder);
+        }
+    default:
+        HWARN("Unsupported value type" << aValue.typeName());
+        break;
+    }
+    return NULL;
+}
+
+QVariant ConfigClient::toVariant(GVariant* aValue)
+{
+    switch (g_variant_classify(aValue)) {
+    case G_VARIANT_CLASS_BOOLEAN:
+        return QVariant((bool)g_variant_get_boolean(aValue));
+    case G_VARIANT_CLASS_BYTE:
+        return QVariant((char)g_variant_get_byte(aValue));
+    case G_VARIANT_CLASS_INT16:
+        return QVariant((int)g_variant_get_int16(aValue));
+    case G_VARIANT_CLASS_UINT16:
+        return QVariant((uint)g_variant_get_uint16(aValue));
+    case G_VARIANT_CLASS_INT32:
+        return QVariant((int)g_variant_get_int32(aValue));
+    case G_VARIANT_CLASS_UINT32:
+        return QVariant((uint)g_variant_get_uint32(aValue));
+    case G_VARIANT_CLASS_INT64:
+        return QVariant((qlonglong)g_variant_get_int64(aValue));
+    case G_VARIANT_CLASS_UINT64:
+        return QVariant((qulonglong)g_variant_get_uint64(aValue));
+    case G_VARIANT_CLASS_DOUBLE:
+        return QVariant(g_variant_get_double(aValue));
+    case G_VARIANT_CLASS_STRING:
+    case G_VARIANT_CLASS_OBJECT_PATH:
+    case G_VARIANT_CLASS_SIGNATURE:
+        return QVariant(QString::fromUtf8(g_variant_get_string(aValue, NULL)));
+    case G_VARIANT_CLASS_VARIANT:
+        {
+            GVariant* inner = g_variant_get_variant(aValue);
+            const QVariant result(toVariant(inner));
+            g_variant_unref(inner);
+            return result;
+        }
+    case G_VARIANT_CLASS_ARRAY:
+        if (g_variant_is_of_type(aValue, G_VARIANT_TYPE_STRING_ARRAY)) {
+            QStringList list;
+            gsize n = 0;
+            const gchar** strv = g_variant_get_strv(aValue, &n);
+            for (gsize i = 0; i < n; i++) {
+                list.append(QString::fromUtf8(strv[i]));
+            }
+            g_free(strv);
+            return QVariant(list);
+        }
+        /* fallthrough */
+    case G_VARIANT_CLASS_TUPLE:
+        {
+            QVariantList list;
+            const gsize n = g_variant_n_children(aValue);
+            for (gsize i = 0; i < n; i++) {
+                GVariant* child = g_variant_get_child_value(aValue, i);
+                list.append(toVariant(child));
+                g_variant_unref(child);
+            }
+            return QVariant(list);
+        }
+    default:
+        HWARN("Unsupported value type" << g_variant_get_type_string(aValue));
+        break;
+    }
+    return QVariant();
+}
+
 void ConfigClient::sync()
 {
     if (iClient) {
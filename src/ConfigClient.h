@@ -41,12 +41,44 @@
 #include <QList>
 #include <QString>
 #include <QStringList>
+#include <QVariant>
 #include <QMetaType>
 
 extern "C" struct _DConfClient;
+extern "C" struct _DConfChangeset;
+extern "C" struct _GVariant;
 
 class ConfigClient {
 public:
+    // Receives the contents of a dconf subtree, depth first. Keys of each
+    // group come before its subgroups. Paths are absolute, groups end
+    // with slash.
+    class Visitor {
+    public:
+        virtual ~Visitor();
+        virtual void beginGroup(const QString aPath);
+        virtual void endGroup(const QString aPath);
+        virtual void key(const QString aPath, struct _GVariant* aValue) = 0;
+    };
+
+    // Set of changes applied in a single transaction
+    class Changeset {
+        Q_DISABLE_COPY(Changeset)
+        friend class ConfigClient;
+
+    public:
+        Changeset();
+        ~Changeset();
+
+        bool isEmpty() const;
+        void set(QString aKey, const QVariant aValue); // Invalid resets
+        void setValue(QString aKey, struct _GVariant* aValue);
+
+    private:
+        struct _DConfChangeset* iChangeset;
+    };
+
+
     ConfigClient(struct _DConfClient* aDConf);
     ConfigClient(const ConfigClient& aClient);
     ConfigClient();
@@ -62,8 +94,22 @@ public:
     static ConfigClient create();
 
     QStringList list(QString aDir) const;
+    QVariant read(QString aKey) const;
+    struct _GVariant* readValue(QString aKey) const; // Caller unrefs
+    void snapshot(QString aDir, Visitor* aVisitor) const;
+    void resetGroup(QString aDir, Changeset* aChangeset) const;
+    void reduce(Changeset* aChangeset, int* aWritten, int* aReset) const;
+    bool apply(const Changeset& aChangeset);
     void sync();
 
+    // Same conversion as done by MGConfItem
+    static QVariant toVariant(struct _GVariant* aValue);
+    static struct _GVariant* toGVariant(const QVariant aValue); // Floating
+
+private:
+    static void snapshot(struct _DConfClient* aClient, const QByteArray aDir,
+        Visitor* aVisitor);
+
 private:
     struct _DConfClient* iClient;
 };
@@ -40,6 +40,7 @@
 
 #include <glib.h>
 #include <stdio.h>
+#include <signal.h>
 
 #define RET_OK (0)
 #define RET_CMDLINE (1)
@@ -57,16 +58,45 @@ __attribute__((visibility("default"))) int main(int argc, char *argv[])
     char* action = NULL;
     char* dir = NULL;
     char* home = NULL;
+    gboolean chunks = FALSE;
+    gboolean archive = FALSE;
+    char* snapshot = NULL;
+    gboolean delta = FALSE;
+    gboolean sequential = FALSE;
+    char** excludes = NULL;
+    Backup::Options opt;
 
     // Using glib to parse command line arguments (if any)
     GOptionContext* options = g_option_context_new(NULL);
     const GOptionEntry entries[] = {
         { "action", 0, 0, G_OPTION_ARG_STRING, &action,
-          "Action to perform (import|export)", "ACTION" },
+          "Action to perform (import|export|estimate)", "ACTION" },
         { "home-dir", 0, 0, G_OPTION_ARG_FILENAME, &home,
           "Home directory", "DIR" },
         { "dir", 0, 0, G_OPTION_ARG_FILENAME, &dir,
           "Backup directory", "DIR" },
+        { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt.iJobs,
+          "Number of copy threads (default is one per CPU)", "N" },
+        { "read-ahead", 0, 0, G_OPTION_ARG_INT, &opt.iReadAhead,
+          "Read-ahead window per copied file (default is 1024)", "KB" },
+        { "chunks", 0, 0, G_OPTION_ARG_NONE, &chunks,
+          "Store files in deduplicated chunks", NULL },
+        { "archive", 0, 0, G_OPTION_ARG_NONE, &archive,
+          "Store everything in a compressed archive", NULL },
+        { "compression", 0, 0, G_OPTION_ARG_INT, &opt.iCompression,
+          "Archive compression level (0-9, default is 6)", "N" },
+        { "progress", 0, 0, G_OPTION_ARG_INT, &opt.iProgressFd,
+          "Write progress reports to file descriptor FD", "FD" },
+        { "snapshots", 0, 0, G_OPTION_ARG_INT, &opt.iSnapshots,
+          "Export into a new snapshot, keeping N latest ones", "N" },
+        { "snapshot", 0, 0, G_OPTION_ARG_STRING, &snapshot,
+          "Snapshot to import (default is the latest one)", "NAME" },
+        { "delta", 0, 0, G_OPTION_ARG_NONE, &delta,
+          "Only rewrite the changed blocks of large files", NULL },
+        { "sequential", 0, 0, G_OPTION_ARG_NONE, &sequential,
+          "Handle files and configuration one after another", NULL },
+        { "exclude", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &excludes,
+          "Exclude files matching the pattern (may be repeated)", "PATTERN" },
         { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
     };
 
@@ -79,8 +109,22 @@ __attribute__((visibility("default"))) int main(int argc, char *argv[])
     g_option_context_parse(options, &tmp_argc, &tmp_argv, NULL);
     g_free(tmp_argv);
 
-    // Are we started by backup or running the app?
-    if (action && dir && home) {
+    opt.iChunks = chunks;
+    opt.iArchive = archive;
+    opt.iSnapshot = snapshot;
+    opt.iDelta = delta;
+    opt.iSequential = sequential;
+    opt.iExcludes = excludes;
+    opt.iCompression = CLAMP(opt.iCompression, 0, 9);
+    if (opt.iProgressFd >= 0) {
+        // Don't die if whoever is reading the progress goes away
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    // Are we started by backup or running the app? Estimate doesn't
+    // need the backup directory.
+    const bool estimate = !g_strcmp0(action, Backup::ACTION_ESTIMATE);
+    if (action && home && (dir || estimate)) {
         // Looks like backup/restore action
         const Backup::Action backupAction =
             (!g_strcmp0(action, Backup::ACTION_IMPORT) ||
@@ -88,10 +132,13 @@ __attribute__((visibility("default"))) int main(int argc, char *argv[])
                 Backup::ImportAction :
             !g_strcmp0(action, Backup::ACTION_EXPORT) ?
                 Backup::ExportAction :
+            estimate ?
+                Backup::EstimateAction :
                 Backup::NoAction;
 
         if (backupAction != Backup::NoAction) {
-            ret = Backup::run(backupAction, home, dir);
+            ret = Backup::run(backupAction, home, dir, opt) ?
+                RET_OK : RET_ERR;
         } else {
             char* help = g_option_context_get_help(options, TRUE, NULL);
 
@@ -106,5 +153,7 @@ __attribute__((visibility("default"))) int main(int argc, char *argv[])
     g_free(dir);
     g_free(home);
     g_free(action);
+    g_free(snapshot);
+    g_strfreev(excludes);
     return ret;
 }